@@ -0,0 +1,84 @@
+#include "NetDebugLink.hpp"
+
+#include <sys/random.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "host_hardware.hpp"
+
+// 主机仿真没有 BLE，配网直接重连 WiFi 桩
+// No BLE on the host: provisioning just reconnects the WiFi stand-in
+
+void NetDebugLink::BlufiInit() {}
+
+void NetDebugLink::PowerSaveInit() {}
+
+// Linux 线程栈未预填，无法得到最低水位 / Linux thread stacks are not
+// painted, so there is no low-water mark
+uint32_t NetDebugLink::StackHeadroom() { return 0; }
+
+void NetDebugLink::FillRandom(uint8_t *buf, size_t len) {
+  while (len > 0) {
+    auto ans = getrandom(buf, len, 0);
+    if (ans > 0) {
+      buf += ans;
+      len -= ans;
+    }
+  }
+}
+
+static uint32_t s_blufi_start;
+static bool s_blufi_associating;
+
+void NetDebugLink::BlufiStart() {
+  XR_LOG_INFO("BLUFI is not available on host, reconnecting WiFi");
+  s_blufi_associating = false;
+}
+
+ErrorCode NetDebugLink::BlufiPoll(uint32_t timeout_ms) {
+  UNUSED(timeout_ms);
+  uint32_t now = LibXR::Timebase::GetMilliseconds();
+  if (!s_blufi_associating) {
+    KnownAp ap{};
+    strncpy(ap.ssid, reinterpret_cast<const char *>(sta_cfg_.ssid),
+            sizeof(ap.ssid) - 1);
+    FastConnect(ap);
+    s_blufi_associating = true;
+    s_blufi_start = now;
+    return ErrorCode::BUSY;
+  }
+  if (wifi_->IsConnected()) {
+    s_blufi_associating = false;
+    return ErrorCode::OK;
+  }
+  if (now - s_blufi_start >= RECONNECT_ATTEMPT_MS) {
+    s_blufi_associating = false;
+    return ErrorCode::TIMEOUT;
+  }
+  return ErrorCode::BUSY;
+}
+
+ErrorCode NetDebugLink::FastConnect(const KnownAp &ap) {
+  auto wifi = static_cast<NetDebugLinkHost::HostWifiClient *>(wifi_);
+  return wifi->BeginConnect(ap.channel != 0 ? ap.bssid : nullptr,
+                            ap.channel);
+}
+
+bool NetDebugLink::QueryApInfo(KnownAp &ap) {
+  if (!wifi_->IsConnected()) {
+    return false;
+  }
+  auto wifi = static_cast<NetDebugLinkHost::HostWifiClient *>(wifi_);
+  strncpy(ap.ssid, "NetDebugLinkHost", sizeof(ap.ssid) - 1);
+  memcpy(ap.bssid, wifi->ap_bssid_, sizeof(ap.bssid));
+  ap.channel = wifi->ap_channel_;
+  return true;
+}
+
+CaptureFlash *NetDebugLink::OpenCaptureFlash() {
+  const char *path = getenv("NDL_CAPTURE_FILE");
+  static NetDebugLinkHost::FileCaptureFlash flash(path ? path : "netdebuglink_capture.bin",
+                                256 * 1024);
+  return flash.IsOpen() ? &flash : nullptr;
+}
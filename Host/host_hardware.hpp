@@ -0,0 +1,225 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+
+#include "capture_store.hpp"
+#include "gpio.hpp"
+#include "libxr.hpp"
+#include "net/wifi_client.hpp"
+#include "pwm.hpp"
+
+namespace NetDebugLinkHost {
+
+/**
+ * @brief 仅记录配置的 LED / LED stand-in that only logs its configuration
+ */
+class HostPWM : public LibXR::PWM {
+ public:
+  ErrorCode SetDutyCycle(float value) override {
+    duty_cycle_ = value;
+    return ErrorCode::OK;
+  }
+
+  ErrorCode SetConfig(Configuration config) override {
+    XR_LOG_DEBUG("LED frequency: %d Hz", config.frequency);
+    return ErrorCode::OK;
+  }
+
+  ErrorCode Enable() override { return ErrorCode::OK; }
+
+  ErrorCode Disable() override { return ErrorCode::OK; }
+
+  float duty_cycle_ = 0.0f;
+};
+
+/**
+ * @brief 永不触发的配网按钮 / Configuration button that never fires
+ */
+class HostGPIO : public LibXR::GPIO {
+ public:
+  bool Read() override { return true; }
+
+  ErrorCode Write(bool value) override {
+    UNUSED(value);
+    return ErrorCode::OK;
+  }
+
+  ErrorCode EnableInterrupt() override { return ErrorCode::OK; }
+
+  ErrorCode DisableInterrupt() override { return ErrorCode::OK; }
+
+  ErrorCode SetConfig(Configuration config) override {
+    UNUSED(config);
+    return ErrorCode::OK;
+  }
+};
+
+/**
+ * @brief WiFi 客户端桩，数据走主机网络栈 /
+ *        WiFi client stand-in; traffic uses the host network stack
+ *
+ * 可通过 DropLink 模拟断线，connect_delay_ms_ 模拟关联耗时，用于测量断线到
+ * 恢复传输的时间。
+ * DropLink simulates a link loss and connect_delay_ms_ the association time,
+ * for measuring link loss to streaming again.
+ *
+ * BeginConnect 是 NetDebugLink::FastConnect 的非阻塞关联，记下收到的 BSSID
+ * 与信道；模拟 AP 的 BSSID 与信道由 QueryApInfo 读出。
+ * BeginConnect is the non-blocking association behind
+ * NetDebugLink::FastConnect and records the BSSID and channel it was given;
+ * QueryApInfo reads the simulated AP's BSSID and channel.
+ */
+class HostWifiClient : public LibXR::WifiClient {
+ public:
+  ErrorCode Enable() override { return ErrorCode::OK; }
+
+  void Disable() override {}
+
+  ErrorCode Connect(const Config &config) override {
+    UNUSED(config);
+    connect_count_++;
+    if (connect_delay_ms_ > 0) {
+      LibXR::Thread::Sleep(connect_delay_ms_);
+    }
+    connected_ = true;
+    return ErrorCode::OK;
+  }
+
+  /**
+   * @brief 开始关联并立即返回，connect_delay_ms_ 后连上 /
+   *        Start associating and return at once; connected after
+   *        connect_delay_ms_
+   * @param bssid nullptr 表示未指定，需扫描 / nullptr when unset, scan
+   */
+  ErrorCode BeginConnect(const uint8_t *bssid, uint8_t channel) {
+    connect_count_++;
+    last_bssid_set_ = bssid != nullptr;
+    if (bssid != nullptr) {
+      memcpy(last_bssid_, bssid, sizeof(last_bssid_));
+    }
+    last_channel_ = channel;
+    connected_ = false;
+    connect_at_ms_ = LibXR::Timebase::GetMilliseconds() + connect_delay_ms_;
+    connecting_ = true;
+    return ErrorCode::OK;
+  }
+
+  ErrorCode Disconnect() override {
+    connected_ = false;
+    connecting_ = false;
+    return ErrorCode::OK;
+  }
+
+  bool IsConnected() const override {
+    return connected_ ||
+           (connecting_ &&
+            LibXR::Timebase::GetMilliseconds() >= connect_at_ms_.load());
+  }
+
+  LibXR::IPAddressRaw GetIPAddress() const override {
+    return {127, 0, 0, 1};
+  }
+
+  LibXR::MACAddressRaw GetMACAddress() const override {
+    return {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+  }
+
+  ErrorCode Scan(ScanResult *out_list, size_t max_count,
+                 size_t &found_count) override {
+    UNUSED(out_list);
+    UNUSED(max_count);
+    found_count = 0;
+    return ErrorCode::OK;
+  }
+
+  int GetRSSI() const override { return 0; }
+
+  void DropLink() {
+    XR_LOG_WARN("Simulated WiFi link loss");
+    connected_ = false;
+    connecting_ = false;
+  }
+
+  std::atomic<bool> connected_ = true;
+  std::atomic<bool> connecting_ = false;
+  std::atomic<uint64_t> connect_at_ms_ = 0;
+  std::atomic<uint32_t> connect_count_ = 0;
+  uint32_t connect_delay_ms_ = 0;
+
+  // 模拟 AP / Simulated AP
+  uint8_t ap_bssid_[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x10};
+  uint8_t ap_channel_ = 6;
+
+  // 最近一次 BeginConnect 的参数 / Arguments of the last BeginConnect
+  bool last_bssid_set_ = false;
+  uint8_t last_bssid_[6] = {};
+  uint8_t last_channel_ = 0;
+};
+
+/**
+ * @brief 文件模拟的 NOR 闪存 / File-backed NOR flash stand-in
+ *
+ * 写入按位与，与真实闪存一样只能把 1 变为 0，便于在主机上验证存储格式。
+ * Writes AND into the existing bytes, clearing bits only like real flash,
+ * so the on-flash format can be exercised on the host.
+ */
+class FileCaptureFlash : public CaptureFlash {
+ public:
+  FileCaptureFlash(const char *path, size_t size) : size_(size) {
+    file_ = fopen(path, "r+b");
+    if (file_ == nullptr) {
+      file_ = fopen(path, "w+b");
+      if (file_ != nullptr) {
+        Erase(0, size_);
+      }
+    }
+  }
+
+  bool IsOpen() const { return file_ != nullptr; }
+
+  size_t Size() const override { return size_; }
+
+  ErrorCode Erase(size_t offset, size_t size) override {
+    static uint8_t erased[CaptureStore::SECTOR_SIZE];
+    memset(erased, 0xff, sizeof(erased));
+    fseek(file_, static_cast<long>(offset), SEEK_SET);
+    for (size_t done = 0; done < size; done += sizeof(erased)) {
+      fwrite(erased, 1, LibXR::min(sizeof(erased), size - done), file_);
+    }
+    fflush(file_);
+    return ErrorCode::OK;
+  }
+
+  ErrorCode Write(size_t offset, const void *data, size_t size) override {
+    static uint8_t old[CaptureStore::SECTOR_SIZE];
+    auto src = static_cast<const uint8_t *>(data);
+    while (size > 0) {
+      size_t len = LibXR::min(sizeof(old), size);
+      Read(offset, old, len);
+      for (size_t i = 0; i < len; i++) {
+        old[i] &= src[i];
+      }
+      fseek(file_, static_cast<long>(offset), SEEK_SET);
+      fwrite(old, 1, len, file_);
+      offset += len;
+      src += len;
+      size -= len;
+    }
+    fflush(file_);
+    return ErrorCode::OK;
+  }
+
+  ErrorCode Read(size_t offset, void *data, size_t size) override {
+    fseek(file_, static_cast<long>(offset), SEEK_SET);
+    return fread(data, 1, size, file_) == size ? ErrorCode::OK
+                                               : ErrorCode::FAILED;
+  }
+
+ private:
+  FILE *file_ = nullptr;
+  size_t size_;
+};
+
+}  // namespace NetDebugLinkHost
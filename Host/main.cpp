@@ -0,0 +1,69 @@
+#include <cstdlib>
+
+#include "NetDebugLink.hpp"
+#include "host_hardware.hpp"
+#include "libxr.hpp"
+#include "linux_flash.hpp"
+#include "linux_uart.hpp"
+
+// 串口由 pty 提供，例如 / UARTs are backed by ptys, e.g.:
+//   socat pty,raw,echo=0,link=/tmp/ndl_uart1 pty,raw,echo=0,link=/tmp/ndl_uart1_peer
+// 用法 / Usage: netdebuglink_host [cdc_tty] [uart1_tty] [uart2_tty] [db_file]
+// 环境变量 / Environment:
+//   NDL_WIFI_DROP_MS   周期性模拟 WiFi 断线 / drop the WiFi link periodically
+//   NDL_WIFI_ASSOC_MS  模拟关联耗时 / simulated association time
+
+int main(int argc, char **argv) {
+  const char *cdc_path = argc > 1 ? argv[1] : "/tmp/ndl_cdc";
+  const char *uart1_path = argc > 2 ? argv[2] : "/tmp/ndl_uart1";
+  const char *uart2_path = argc > 3 ? argv[3] : "/tmp/ndl_uart2";
+  const char *db_path = argc > 4 ? argv[4] : "netdebuglink_db.bin";
+
+  LibXR::PlatformInit();
+
+  LibXR::LinuxBinaryFileFlash<64 * 1024> flash(db_path);
+  LibXR::DatabaseRaw<1> db(flash);
+
+  NetDebugLinkHost::HostPWM led_pwm;
+  NetDebugLinkHost::HostGPIO button_gpio;
+  NetDebugLinkHost::HostWifiClient wifi;
+  const char *drop_env = getenv("NDL_WIFI_DROP_MS");
+  const char *assoc_env = getenv("NDL_WIFI_ASSOC_MS");
+  uint32_t drop_ms = drop_env ? strtoul(drop_env, nullptr, 10) : 0;
+  wifi.connect_delay_ms_ = assoc_env ? strtoul(assoc_env, nullptr, 10) : 0;
+
+  LibXR::LinuxUART uart_cdc(cdc_path, 115200, LibXR::UART::Parity::NO_PARITY,
+                            8, 1, 4, 2048);
+  LibXR::LinuxUART uart_1(uart1_path, 115200, LibXR::UART::Parity::NO_PARITY,
+                          8, 1, 4, 2048);
+  LibXR::LinuxUART uart_2(uart2_path, 115200, LibXR::UART::Parity::NO_PARITY,
+                          8, 1, 4, 2048);
+
+  LibXR::HardwareContainer hw(
+      LibXR::Entry<LibXR::PWM>{.object = led_pwm, .aliases = {"led"}},
+      LibXR::Entry<LibXR::GPIO>{.object = button_gpio, .aliases = {"button"}},
+      LibXR::Entry<LibXR::UART>{.object = uart_1, .aliases = {"uart1"}},
+      LibXR::Entry<LibXR::UART>{.object = uart_2, .aliases = {"uart2"}},
+      LibXR::Entry<LibXR::UART>{.object = uart_cdc, .aliases = {"uart_cdc"}},
+      LibXR::Entry<LibXR::WifiClient>{.object = wifi,
+                                      .aliases = {"wifi_client"}},
+      LibXR::Entry<LibXR::Database>{.object = db, .aliases = {"database"}});
+
+  LibXR::ApplicationManager appmgr;
+
+  static NetDebugLink netdebuglink(hw, appmgr, 5000, 5001, 40000, 16384,
+                                   "uart_cdc", {"uart1", "uart2"});
+
+  uint32_t last_drop_ms = LibXR::Timebase::GetMilliseconds();
+  while (true) {
+    appmgr.MonitorAll();
+    LibXR::Thread::Sleep(1000);
+    if (drop_ms > 0 &&
+        LibXR::Timebase::GetMilliseconds() - last_drop_ms >= drop_ms) {
+      last_drop_ms = LibXR::Timebase::GetMilliseconds();
+      wifi.DropLink();
+    }
+  }
+
+  return 0;
+}
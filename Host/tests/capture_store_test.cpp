@@ -0,0 +1,180 @@
+#include "test_device.hpp"
+
+// 在文件模拟的闪存上检查离线存储：跨重启保留记录并递增启动计数、负载损坏
+// 的记录被丢弃、环满时覆盖最旧数据
+// Exercise the capture store on the file-backed flash: records and a rising
+// boot count survive reboots, records with a damaged payload are dropped,
+// and a full ring overwrites the oldest data
+
+using namespace NetDebugLinkTest;
+using NetDebugLinkHost::FileCaptureFlash;
+
+static constexpr size_t FLASH_SIZE = 8 * CaptureStore::SECTOR_SIZE;
+
+struct Record {
+  uint8_t port;
+  uint16_t boot;
+  uint64_t timestamp_us;
+  std::vector<uint8_t> data;
+};
+
+static Record MakeRecord(uint16_t boot, uint32_t index) {
+  Record record{static_cast<uint8_t>(index % 3), boot, 1000ull * index, {}};
+  record.data.resize(1 + (index * 37) % 300);
+  for (size_t i = 0; i < record.data.size(); i++) {
+    record.data[i] = static_cast<uint8_t>(index + i * 13);
+  }
+  return record;
+}
+
+static void Append(CaptureStore &store, const Record &record) {
+  NDL_CHECK(store.Append(record.port, record.timestamp_us,
+                         record.data.data(),
+                         record.data.size()) == ErrorCode::OK);
+}
+
+static std::vector<Record> ReadAll(CaptureStore &store) {
+  static uint8_t buf[CaptureStore::MAX_PAYLOAD];
+  std::vector<Record> records;
+  while (store.PeekSize() > 0) {
+    Record record;
+    size_t len =
+        store.Read(record.port, record.boot, record.timestamp_us, buf,
+                   sizeof(buf));
+    NDL_CHECK(len > 0);
+    record.data.assign(buf, buf + len);
+    records.push_back(record);
+  }
+  return records;
+}
+
+static bool Same(const Record &a, const Record &b) {
+  return a.port == b.port && a.boot == b.boot &&
+         a.timestamp_us == b.timestamp_us && a.data == b.data;
+}
+
+/**
+ * @brief 重启前后写入的记录都按序读出，启动计数逐次加一 /
+ *        Records from before and after a reboot read back in order, with the
+ *        boot count going up by one per boot
+ */
+static void TestReboot() {
+  std::string path = WorkDir() + "/reboot.bin";
+  FileCaptureFlash flash(path.c_str(), FLASH_SIZE);
+  std::vector<Record> expected;
+
+  {
+    CaptureStore store;
+    NDL_CHECK(store.Init(&flash) == ErrorCode::OK);
+    NDL_CHECK(store.Boot() == 0);
+    for (uint32_t i = 0; i < 40; i++) {
+      expected.push_back(MakeRecord(0, i));
+      Append(store, expected.back());
+    }
+    store.Sync();
+  }
+
+  {
+    CaptureStore store;
+    NDL_CHECK(store.Init(&flash) == ErrorCode::OK);
+    NDL_CHECK(store.Boot() == 1);
+    for (uint32_t i = 0; i < 10; i++) {
+      expected.push_back(MakeRecord(1, i));
+      Append(store, expected.back());
+    }
+    store.Sync();
+  }
+
+  CaptureStore store;
+  NDL_CHECK(store.Init(&flash) == ErrorCode::OK);
+  NDL_CHECK(store.Boot() == 2);
+  auto records = ReadAll(store);
+  printf("reboot: %zu of %zu records\n", records.size(), expected.size());
+  NDL_CHECK(records.size() == expected.size());
+  for (size_t i = 0; i < records.size(); i++) {
+    NDL_CHECK(Same(records[i], expected[i]));
+  }
+}
+
+/**
+ * @brief 清掉一个负载位后该记录被丢弃，其余记录完好 /
+ *        Clearing one payload bit drops that record and leaves the rest
+ */
+static void TestCorruptPayload() {
+  std::string path = WorkDir() + "/corrupt.bin";
+  FileCaptureFlash flash(path.c_str(), FLASH_SIZE);
+  std::vector<Record> expected;
+
+  {
+    CaptureStore store;
+    NDL_CHECK(store.Init(&flash) == ErrorCode::OK);
+    for (uint32_t i = 0; i < 5; i++) {
+      expected.push_back(MakeRecord(0, i));
+      Append(store, expected.back());
+    }
+    store.Sync();
+  }
+
+  // 第 0 扇区第 3 条记录的首个负载字节 / First payload byte of the third
+  // record in sector 0
+  size_t offset = sizeof(CaptureStore::SectorHeader);
+  for (size_t i = 0; i < 2; i++) {
+    offset += sizeof(CaptureStore::RecordHeader) + expected[i].data.size();
+  }
+  offset += sizeof(CaptureStore::RecordHeader);
+  uint8_t byte = 0;
+  NDL_CHECK(flash.Read(offset, &byte, 1) == ErrorCode::OK);
+  NDL_CHECK(byte != 0);
+  byte &= byte - 1;
+  NDL_CHECK(flash.Write(offset, &byte, 1) == ErrorCode::OK);
+
+  CaptureStore store;
+  NDL_CHECK(store.Init(&flash) == ErrorCode::OK);
+  auto records = ReadAll(store);
+  printf("corrupt: %zu records, %u bytes dropped\n", records.size(),
+         store.GetStats().corrupt_bytes);
+  NDL_CHECK(records.size() == expected.size() - 1);
+  NDL_CHECK(store.GetStats().corrupt_bytes == expected[2].data.size());
+  expected.erase(expected.begin() + 2);
+  for (size_t i = 0; i < records.size(); i++) {
+    NDL_CHECK(Same(records[i], expected[i]));
+  }
+}
+
+/**
+ * @brief 环满时丢弃最旧的扇区，读出的是连续的最新记录 /
+ *        A full ring drops the oldest sectors and reads back a contiguous run
+ *        of the newest records
+ */
+static void TestWrap() {
+  std::string path = WorkDir() + "/wrap.bin";
+  FileCaptureFlash flash(path.c_str(), FLASH_SIZE);
+  CaptureStore store;
+  NDL_CHECK(store.Init(&flash) == ErrorCode::OK);
+
+  std::vector<Record> written;
+  for (uint32_t i = 0; i < 400; i++) {
+    written.push_back(MakeRecord(0, i));
+    Append(store, written.back());
+  }
+  store.Sync();
+
+  auto records = ReadAll(store);
+  printf("wrap: %zu of %zu records kept, %u bytes lost\n", records.size(),
+         written.size(), store.GetStats().lost_bytes);
+  NDL_CHECK(store.GetStats().lost_bytes > 0);
+  NDL_CHECK(!records.empty() && records.size() < written.size());
+  size_t first = written.size() - records.size();
+  for (size_t i = 0; i < records.size(); i++) {
+    NDL_CHECK(Same(records[i], written[first + i]));
+  }
+}
+
+int main() {
+  TestReboot();
+  TestCorruptPayload();
+  TestWrap();
+
+  printf("PASS\n");
+  Finish(0);
+}
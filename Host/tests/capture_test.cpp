@@ -0,0 +1,121 @@
+#include <atomic>
+#include <thread>
+
+#include "test_device.hpp"
+
+// 以最高波特率在 uart1 上持续输入递增计数，主机端收到的字节流必须逐字节一致
+// Stream an incrementing counter into uart1 at the highest supported baud
+// rate; the host must receive every byte, in order
+//
+// pty 不按波特率限速，这里的 5 Mbaud 只决定写入节拍与队列分配，并不证明真实
+// 串口在该速率下无损；驱动中断与 DMA 的时序只能在硬件上验证
+// A pty does not pace by baud rate, so 5 Mbaud here only sets the write
+// pacing and the queue sizing. It does not prove a real UART is lossless at
+// that rate; driver interrupt and DMA timing can only be checked on hardware
+
+using namespace NetDebugLinkTest;
+
+static constexpr uint32_t BAUDRATE = 5000000;
+static constexpr size_t TOTAL_BYTES = 1536 * 1024;
+static constexpr uint32_t PACE_MS = 10;
+static constexpr size_t STALL_EVERY = 256 * 1024;
+static constexpr uint32_t STALL_MS = 100;
+
+static uint8_t Expected(size_t offset) {
+  uint32_t word = static_cast<uint32_t>(offset / 4);
+  return static_cast<uint8_t>(word >> (8 * (offset % 4)));
+}
+
+int main() {
+  TestHost host;
+  auto dev = StartAttached(host, 8192);
+
+  NetDebugLink::Command cmd{};
+  cmd.type = NetDebugLink::Command::Type::CONFIG_UART;
+  cmd.data.uart_config.uart_index = 1;
+  cmd.data.uart_config.uart_config = {BAUDRATE,
+                                      LibXR::UART::Parity::NO_PARITY, 8, 1};
+  NetDebugLink::Command ack{};
+  NDL_CHECK(host.Request(cmd, NetDebugLink::Command::Type::CONFIG_ACK, 2000,
+                         ack));
+  NDL_CHECK(ack.data.config_ack.status == static_cast<int8_t>(ErrorCode::OK));
+
+  // 按线速节拍写入 / Write paced at line rate
+  std::atomic<bool> writer_done = false;
+  std::thread writer([&]() {
+    static uint8_t chunk[BAUDRATE / 10 * PACE_MS / 1000];
+    size_t offset = 0;
+    uint64_t next_ms = NowMs();
+    while (offset < TOTAL_BYTES) {
+      size_t len = LibXR::min(sizeof(chunk), TOTAL_BYTES - offset);
+      for (size_t i = 0; i < len; i++) {
+        chunk[i] = Expected(offset + i);
+      }
+      WriteAll(dev.uart1, chunk, len);
+      offset += len;
+      next_ms += PACE_MS;
+      while (NowMs() < next_ms) {
+        usleep(500);
+      }
+    }
+    writer_done = true;
+  });
+
+  // 主机端周期性停读 NET_QUEUE_HOLD_MS，模拟 WiFi 断流
+  // The host stops reading for NET_QUEUE_HOLD_MS now and then, like a WiFi
+  // stall
+  std::vector<uint8_t> received;
+  received.reserve(TOTAL_BYTES);
+  size_t next_stall = STALL_EVERY;
+  uint64_t start_ms = NowMs();
+  uint64_t idle_since = NowMs();
+  uint32_t uart1_key = TestHost::Key("uart1");
+  uint32_t command_key = TestHost::Key("command");
+  uint32_t rx_dropped = 0;
+  while (received.size() < TOTAL_BYTES) {
+    size_t before = received.size();
+    NDL_CHECK(host.Poll(50, [&](uint32_t key, const uint8_t *data,
+                                size_t size) {
+      NetDebugLink::Command report;
+      if (key == uart1_key) {
+        received.insert(received.end(), data, data + size);
+      } else if (key == command_key && size == sizeof(report)) {
+        memcpy(&report, data, sizeof(report));
+        if (report.type == NetDebugLink::Command::Type::FLOW_CONTROL &&
+            report.data.flow_control.uart_index == 1) {
+          rx_dropped = report.data.flow_control.rx_dropped;
+        }
+      }
+    }));
+    if (received.size() != before) {
+      idle_since = NowMs();
+    } else if (writer_done && NowMs() - idle_since > 2000) {
+      break;
+    }
+    if (received.size() >= next_stall) {
+      next_stall += STALL_EVERY;
+      usleep(STALL_MS * 1000);
+    }
+  }
+  writer.join();
+  uint64_t elapsed_ms = LibXR::max<uint64_t>(NowMs() - start_ms, 1);
+
+  printf("received %zu of %zu bytes in %llu ms (%llu KB/s)\n",
+         received.size(), TOTAL_BYTES,
+         static_cast<unsigned long long>(elapsed_ms),
+         static_cast<unsigned long long>(received.size() / elapsed_ms));
+
+  for (size_t i = 0; i < received.size(); i++) {
+    if (received[i] != Expected(i)) {
+      fprintf(stderr, "FAIL: stream diverges at byte %zu\n", i);
+      Finish(1);
+    }
+  }
+  NDL_CHECK(received.size() == TOTAL_BYTES);
+
+  // 设备侧也不应报告上行丢弃 / The device must not report uplink drops
+  NDL_CHECK(rx_dropped == 0);
+
+  printf("PASS\n");
+  Finish(0);
+}
@@ -0,0 +1,59 @@
+#include "test_device.hpp"
+
+// USB 主机在 CDC 上接入：端口 0 的数据、发现报文与第一条命令在一次写入中
+// 到达，发现报文之后的命令必须进入 CDC 会话并得到回复
+// A USB host attaching over CDC: port 0 data, the discovery message and the
+// first command arrive in a single write, and the command after the
+// discovery message must reach the CDC session and get a reply
+
+using namespace NetDebugLinkTest;
+using Command = NetDebugLink::Command;
+
+static constexpr uint32_t PING_SEQ = 0x1234;
+
+int main() {
+  auto dev = StartDevice(8192);
+
+  Command ping{};
+  ping.type = Command::Type::REMOTE_PING;
+  ping.data.ping.seq = PING_SEQ;
+  ping.data.ping.t1 = 1;
+  std::vector<uint8_t> frame(sizeof(ping) + TOPIC_OVERHEAD);
+  LibXR::Topic::PackData(TestHost::Key("command"),
+                         {frame.data(), frame.size()}, {&ping, sizeof(ping)});
+
+  std::vector<uint8_t> burst;
+  const char port_data[] = "port 0 before the host\n";
+  burst.insert(burst.end(), port_data, port_data + sizeof(port_data) - 1);
+  burst.insert(burst.end(), DISCOVERY, DISCOVERY + sizeof(DISCOVERY) - 1);
+  burst.insert(burst.end(), frame.begin(), frame.end());
+  WriteAll(dev.cdc, burst.data(), burst.size());
+
+  uint32_t command_key = TestHost::Key("command");
+  std::vector<uint8_t> pending;
+  bool replied = false;
+  uint64_t deadline = NowMs() + 2000;
+  while (!replied && NowMs() < deadline) {
+    pollfd pfd = {dev.cdc, POLLIN, 0};
+    if (poll(&pfd, 1, 50) <= 0) {
+      continue;
+    }
+    uint8_t buf[4096];
+    ssize_t len = read(dev.cdc, buf, sizeof(buf));
+    NDL_CHECK(len > 0);
+    pending.insert(pending.end(), buf, buf + len);
+    ParseFrames(pending, [&](uint32_t key, const uint8_t *data, size_t size) {
+      if (key != command_key || size != sizeof(Command)) {
+        return;
+      }
+      Command reply;
+      memcpy(&reply, data, sizeof(reply));
+      replied |= reply.type == Command::Type::REMOTE_PING &&
+                 reply.data.ping.seq == PING_SEQ && reply.data.ping.t2 != 0;
+    });
+  }
+  NDL_CHECK(replied);
+
+  printf("PASS\n");
+  Finish(0);
+}
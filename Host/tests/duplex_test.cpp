@@ -0,0 +1,153 @@
+#include "test_device.hpp"
+
+// 收发分离的时延基准：先只有上行，再叠加持续的下行，比较 uart2 上行记录从
+// 写入串口到主机收到的时延，并打印 TASK_STATS。下行解析与串口写入在接收
+// 任务中进行，不应明显推迟上行
+// Latency benchmark for the RX/TX split: first uplink only, then with a
+// steady downlink on top, comparing how long uart2 uplink records take from
+// the UART to the host, and printing TASK_STATS. The downlink is parsed and
+// written to the UART on the RX task, so it must not hold back the uplink
+// noticeably
+
+using namespace NetDebugLinkTest;
+using Command = NetDebugLink::Command;
+
+static constexpr uint32_t PHASE_MS = 3000;
+static constexpr uint32_t RECORD_GAP_MS = 5;
+// 序号 u32 与写入时刻 u64 / Sequence u32 and write time u64
+static constexpr size_t RECORD_SIZE = 12;
+// 每 2 ms 一块，约 500 KB/s / One chunk every 2 ms, about 500 KB/s
+static constexpr size_t DOWNLINK_CHUNK = 1024;
+static constexpr uint32_t DOWNLINK_GAP_MS = 2;
+// 叠加下行后 p99 最多变差的量，覆盖批次等待 DEFAULT_LATENCY_MS
+// How much worse p99 may get under downlink load, covering a batch waiting
+// for DEFAULT_LATENCY_MS
+static constexpr uint32_t P99_SLACK_US = 50 * 1000;
+static constexpr uint32_t MAX_LATENCY_US = 500 * 1000;
+
+struct Phase {
+  const char *name;
+  std::vector<uint32_t> latency_us;
+  uint32_t rx_busy_max_us = 0;
+  uint32_t tx_flush_max_us = 0;
+  size_t reports = 0;
+};
+
+static uint32_t Percentile(std::vector<uint32_t> samples, double p) {
+  std::sort(samples.begin(), samples.end());
+  return samples[static_cast<size_t>(p * (samples.size() - 1))];
+}
+
+int main() {
+  TestHost host;
+  auto dev = StartAttached(host, 8192);
+
+  int flags = fcntl(dev.uart1, F_GETFL);
+  fcntl(dev.uart1, F_SETFL, flags | O_NONBLOCK);
+
+  uint32_t uart2_key = TestHost::Key("uart2");
+  uint32_t command_key = TestHost::Key("command");
+  std::vector<uint8_t> uplink;
+  size_t downlink_sent = 0;
+  size_t downlink_seen = 0;
+  uint32_t seq = 0;
+  uint32_t next_seq = 0;
+  Phase idle{"uplink only"};
+  Phase loaded{"with downlink"};
+  Phase *phase = &idle;
+
+  auto poll = [&]() {
+    NDL_CHECK(host.Poll(1, [&](uint32_t key, const uint8_t *data,
+                               size_t size) {
+      uint64_t now_us = LibXR::Timebase::GetMicroseconds();
+      if (key == uart2_key) {
+        uplink.insert(uplink.end(), data, data + size);
+        size_t offset = 0;
+        for (; uplink.size() - offset >= RECORD_SIZE; offset += RECORD_SIZE) {
+          uint32_t record_seq;
+          uint64_t sent_us;
+          memcpy(&record_seq, uplink.data() + offset, sizeof(record_seq));
+          memcpy(&sent_us, uplink.data() + offset + sizeof(record_seq),
+                 sizeof(sent_us));
+          NDL_CHECK(record_seq == next_seq);
+          next_seq++;
+          phase->latency_us.push_back(
+              static_cast<uint32_t>(now_us - sent_us));
+        }
+        uplink.erase(uplink.begin(), uplink.begin() + offset);
+      } else if (key == command_key && size == sizeof(Command)) {
+        Command report;
+        memcpy(&report, data, sizeof(report));
+        if (report.type == Command::Type::TASK_STATS) {
+          phase->reports++;
+          phase->rx_busy_max_us = LibXR::max(
+              phase->rx_busy_max_us, report.data.task_stats.rx_busy_max_us);
+          phase->tx_flush_max_us = LibXR::max(
+              phase->tx_flush_max_us, report.data.task_stats.tx_flush_max_us);
+        }
+      }
+    }));
+    // 目标侧持续读走下行 / The target keeps draining the downlink
+    uint8_t buf[4096];
+    ssize_t len;
+    while ((len = read(dev.uart1, buf, sizeof(buf))) > 0) {
+      downlink_seen += len;
+    }
+  };
+
+  auto run_phase = [&](bool with_downlink) {
+    uint64_t end_ms = NowMs() + PHASE_MS;
+    uint64_t next_record_ms = NowMs();
+    uint64_t next_downlink_ms = NowMs();
+    std::vector<uint8_t> chunk(DOWNLINK_CHUNK, 0x5a);
+    while (NowMs() < end_ms) {
+      if (NowMs() >= next_record_ms) {
+        uint8_t record[RECORD_SIZE];
+        uint64_t sent_us = LibXR::Timebase::GetMicroseconds();
+        memcpy(record, &seq, sizeof(seq));
+        memcpy(record + sizeof(seq), &sent_us, sizeof(sent_us));
+        WriteAll(dev.uart2, record, sizeof(record));
+        seq++;
+        next_record_ms += RECORD_GAP_MS;
+      }
+      if (with_downlink && NowMs() >= next_downlink_ms) {
+        host.Send("uart1", chunk.data(), chunk.size());
+        downlink_sent += chunk.size();
+        next_downlink_ms += DOWNLINK_GAP_MS;
+      }
+      poll();
+    }
+  };
+
+  run_phase(false);
+  phase = &loaded;
+  run_phase(true);
+
+  // 等最后的上行记录到齐 / Let the last uplink records arrive
+  uint64_t deadline = NowMs() + 2000;
+  while (next_seq < seq && NowMs() < deadline) {
+    poll();
+  }
+
+  for (auto *result : {&idle, &loaded}) {
+    NDL_CHECK(!result->latency_us.empty());
+    printf("%s: %zu records, p50 %u us, p99 %u us, max %u us; "
+           "rx_busy_max %u us, tx_flush_max %u us over %zu reports\n",
+           result->name, result->latency_us.size(),
+           Percentile(result->latency_us, 0.5),
+           Percentile(result->latency_us, 0.99),
+           Percentile(result->latency_us, 1.0), result->rx_busy_max_us,
+           result->tx_flush_max_us, result->reports);
+  }
+  printf("downlink: %zu of %zu bytes reached the target\n", downlink_seen,
+         downlink_sent);
+
+  NDL_CHECK(next_seq == seq);
+  NDL_CHECK(downlink_seen > 0);
+  NDL_CHECK(Percentile(loaded.latency_us, 0.99) <=
+            Percentile(idle.latency_us, 0.99) + P99_SLACK_US);
+  NDL_CHECK(Percentile(loaded.latency_us, 1.0) < MAX_LATENCY_US);
+
+  printf("PASS\n");
+  Finish(0);
+}
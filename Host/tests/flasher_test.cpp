@@ -0,0 +1,230 @@
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "test_device.hpp"
+
+// 在 uart1 的 pty 上模拟 ESP ROM 下载器，通过 TCP 远程烧录并检查：
+// ROM（4 字节状态）与桩程序（2 字节状态）都能完成、镜像超过窗口时不丢数据、
+// 主机停止推送时烧录失败
+// Simulate the ESP ROM loader on the uart1 pty and flash over TCP, checking
+// that both the ROM (4 status bytes) and the stub (2 status bytes) finish,
+// that an image larger than the window arrives intact, and that a host stall
+// fails the flash
+
+using namespace NetDebugLinkTest;
+using Command = NetDebugLink::Command;
+
+static constexpr uint8_t SLIP_END = 0xc0;
+static constexpr uint8_t SLIP_ESC = 0xdb;
+
+/**
+ * @brief 模拟的下载模式目标 / Simulated target in download mode
+ */
+class FakeTarget {
+ public:
+  FakeTarget(int fd, const uint8_t md5[16]) : fd_(fd) {
+    memcpy(md5_, md5, sizeof(md5_));
+    thread_ = std::thread([this]() { Run(); });
+  }
+
+  ~FakeTarget() {
+    stop_ = true;
+    thread_.join();
+  }
+
+  void Reset(bool stub) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stub_ = stub;
+    image_.clear();
+    end_ = false;
+  }
+
+  std::vector<uint8_t> Image() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return image_;
+  }
+
+  bool Ended() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return end_;
+  }
+
+ private:
+  void Run() {
+    std::vector<uint8_t> packet;
+    bool escape = false;
+    while (!stop_) {
+      pollfd pfd = {fd_, POLLIN, 0};
+      if (poll(&pfd, 1, 50) <= 0) {
+        continue;
+      }
+      uint8_t buf[4096];
+      ssize_t len = read(fd_, buf, sizeof(buf));
+      for (ssize_t i = 0; i < len; i++) {
+        uint8_t byte = buf[i];
+        if (byte == SLIP_END) {
+          if (packet.size() >= 8 && packet[0] == 0x00) {
+            OnCommand(packet);
+          }
+          packet.clear();
+          escape = false;
+        } else if (escape) {
+          packet.push_back(byte == 0xdc ? SLIP_END : SLIP_ESC);
+          escape = false;
+        } else if (byte == SLIP_ESC) {
+          escape = true;
+        } else {
+          packet.push_back(byte);
+        }
+      }
+    }
+  }
+
+  void OnCommand(const std::vector<uint8_t> &packet) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    uint8_t op = packet[1];
+    const uint8_t *payload = packet.data() + 8;
+    std::vector<uint8_t> data;
+
+    switch (op) {
+      case 0x11: {  // FLASH_DEFL_DATA
+        uint32_t len;
+        memcpy(&len, payload, sizeof(len));
+        image_.insert(image_.end(), payload + 16, payload + 16 + len);
+        break;
+      }
+      case 0x12:  // FLASH_DEFL_END
+        end_ = true;
+        break;
+      case 0x13:  // SPI_FLASH_MD5
+        if (stub_) {
+          data.assign(md5_, md5_ + 16);
+        } else {
+          static constexpr char HEX[] = "0123456789abcdef";
+          for (uint8_t byte : md5_) {
+            data.push_back(HEX[byte >> 4]);
+            data.push_back(HEX[byte & 0x0f]);
+          }
+        }
+        break;
+      default:
+        break;
+    }
+
+    // 状态：成功与错误码，ROM 另有 2 字节保留 / Status: success and error,
+    // plus 2 reserved bytes from the ROM
+    data.insert(data.end(), stub_ ? 2 : 4, 0);
+
+    std::vector<uint8_t> reply = {0x01, op,
+                                  static_cast<uint8_t>(data.size()),
+                                  static_cast<uint8_t>(data.size() >> 8),
+                                  0, 0, 0, 0};
+    reply.insert(reply.end(), data.begin(), data.end());
+
+    std::vector<uint8_t> out = {SLIP_END};
+    for (uint8_t byte : reply) {
+      if (byte == SLIP_END) {
+        out.insert(out.end(), {SLIP_ESC, 0xdc});
+      } else if (byte == SLIP_ESC) {
+        out.insert(out.end(), {SLIP_ESC, 0xdd});
+      } else {
+        out.push_back(byte);
+      }
+    }
+    out.push_back(SLIP_END);
+    WriteAll(fd_, out.data(), out.size());
+  }
+
+  int fd_;
+  uint8_t md5_[16];
+  std::mutex mutex_;
+  bool stub_ = false;
+  std::vector<uint8_t> image_;
+  bool end_ = false;
+  std::atomic<bool> stop_ = false;
+  std::thread thread_;
+};
+
+static const uint8_t MD5[16] = {0xc0, 0xdb, 0x01, 0x02, 0x03, 0x04,
+                                0x05, 0x06, 0x07, 0x08, 0x09, 0x0a,
+                                0x0b, 0x0c, 0x0d, 0x0e};
+
+static void Begin(TestHost &host, uint32_t size) {
+  Command cmd{};
+  cmd.type = Command::Type::FLASH_BEGIN;
+  auto &config = cmd.data.flash_begin;
+  config.uart_index = 1;
+  config.offset = 0x10000;
+  config.size = size;
+  config.compressed_size = size;
+  memcpy(config.md5, MD5, sizeof(MD5));
+  host.SendCommand(cmd);
+}
+
+/**
+ * @brief 等待烧录结束，返回最后的状态 / Wait for the flash to finish and
+ *        return the final status
+ */
+static SlipFlasher::Status WaitFinished(TestHost &host, uint32_t timeout_ms) {
+  uint64_t deadline = NowMs() + timeout_ms;
+  Command status{};
+  while (NowMs() < deadline) {
+    if (!host.WaitCommand(Command::Type::FLASH_STATUS, 100, status)) {
+      continue;
+    }
+    auto state = status.data.flash_status.state;
+    if (state == SlipFlasher::State::DONE ||
+        state == SlipFlasher::State::FAILED) {
+      return status.data.flash_status;
+    }
+  }
+  fprintf(stderr, "FAIL: flashing never finished\n");
+  Finish(1);
+}
+
+static void FlashImage(TestHost &host, FakeTarget &target, bool stub) {
+  // 三倍窗口大小，主机一次推完，依赖设备背压 / Three windows' worth,
+  // pushed in one go, relying on device backpressure
+  std::vector<uint8_t> image(SlipFlasher::IMAGE_WINDOW * 3 + 123);
+  for (size_t i = 0; i < image.size(); i++) {
+    image[i] = static_cast<uint8_t>(i * 7 + i / 251);
+  }
+
+  target.Reset(stub);
+  Begin(host, static_cast<uint32_t>(image.size()));
+  for (size_t offset = 0; offset < image.size(); offset += 4000) {
+    size_t len = LibXR::min<size_t>(4000, image.size() - offset);
+    host.Send("flash", image.data() + offset, len);
+  }
+
+  auto status = WaitFinished(host, 30000);
+  printf("%s: state %d error %d, %u of %zu bytes written\n",
+         stub ? "stub" : "rom", static_cast<int>(status.state),
+         status.error, status.written, image.size());
+  NDL_CHECK(status.state == SlipFlasher::State::DONE);
+  NDL_CHECK(status.written == image.size());
+  NDL_CHECK(target.Image() == image);
+  NDL_CHECK(target.Ended());
+}
+
+int main() {
+  TestHost host;
+  auto dev = StartAttached(host);
+  FakeTarget target(dev.uart1, MD5);
+
+  FlashImage(host, target, false);
+  FlashImage(host, target, true);
+
+  // 主机只推送一部分后停止 / The host stops after part of the image
+  target.Reset(false);
+  std::vector<uint8_t> part(100, 0x5a);
+  Begin(host, 4096);
+  host.Send("flash", part.data(), part.size());
+  auto status = WaitFinished(host, SlipFlasher::HOST_STALL_TIMEOUT_MS + 5000);
+  NDL_CHECK(status.state == SlipFlasher::State::FAILED);
+  NDL_CHECK(status.error == static_cast<int8_t>(ErrorCode::TIMEOUT));
+
+  printf("PASS\n");
+  Finish(0);
+}
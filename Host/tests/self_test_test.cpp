@@ -0,0 +1,118 @@
+#include "test_device.hpp"
+
+// 自测的两种回环：uart1 由测试把写出的数据接回输入，uart2 的上行由主机原样
+// 回显；两次都必须零错误、收发字节相等。被抓取的端口拒绝主机回显自测
+// Both self-test loopbacks: the test wires uart1's output back to its input,
+// and the host echoes uart2's uplink as is. Both runs must end with no
+// errors and as many bytes received as sent. Host echo is refused on a
+// tapped port
+
+using namespace NetDebugLinkTest;
+using Command = NetDebugLink::Command;
+
+static constexpr uint32_t RATE = 20000;
+static constexpr uint32_t DURATION_MS = 1000;
+static constexpr uint32_t REPORT_WAIT_MS =
+    DURATION_MS + SelfTest::DRAIN_MS + 2000;
+
+/**
+ * @brief 启动一次自测 / Start one self test
+ */
+static void StartSelfTest(TestHost &host, uint8_t uart_index,
+                          SelfTest::Target target) {
+  Command cmd{};
+  cmd.type = Command::Type::SELF_TEST;
+  cmd.data.self_test = {uart_index, target, SelfTest::Pattern::PRBS15, RATE,
+                        DURATION_MS};
+  host.SendCommand(cmd);
+}
+
+/**
+ * @brief 运行到收到报告或超时，期间执行 loop / Run loop until the report
+ *        arrives or the wait times out
+ */
+template <typename Loop>
+static bool WaitReport(TestHost &host, uint32_t timeout_ms, Loop &&loop,
+                       SelfTest::Result &result) {
+  uint32_t command_key = TestHost::Key("command");
+  bool found = false;
+  uint64_t deadline = NowMs() + timeout_ms;
+  while (!found && NowMs() < deadline) {
+    NDL_CHECK(host.Poll(5, [&](uint32_t key, const uint8_t *data,
+                               size_t size) {
+      if (key == command_key && size == sizeof(Command)) {
+        Command report;
+        memcpy(&report, data, sizeof(report));
+        if (report.type == Command::Type::SELF_TEST_REPORT) {
+          result = report.data.self_test_report;
+          found = true;
+        }
+        return;
+      }
+      loop(key, data, size);
+    }));
+    loop(0, nullptr, 0);
+  }
+  return found;
+}
+
+static void Print(const char *name, const SelfTest::Result &result) {
+  printf("%s: tx %u rx %u errors %u, %u B/s, latency avg %u us max %u us\n",
+         name, result.tx_bytes, result.rx_bytes, result.errors,
+         result.throughput, result.latency_avg_us, result.latency_max_us);
+}
+
+int main() {
+  TestHost host;
+  auto dev = StartAttached(host);
+
+  int flags = fcntl(dev.uart1, F_GETFL);
+  fcntl(dev.uart1, F_SETFL, flags | O_NONBLOCK);
+
+  // uart1：写出的数据接回输入 / uart1: output wired back to input
+  SelfTest::Result result{};
+  StartSelfTest(host, 1, SelfTest::Target::UART_TX);
+  NDL_CHECK(WaitReport(
+      host, REPORT_WAIT_MS,
+      [&](uint32_t, const uint8_t *, size_t) {
+        uint8_t buf[1024];
+        ssize_t len;
+        while ((len = read(dev.uart1, buf, sizeof(buf))) > 0) {
+          WriteAll(dev.uart1, buf, len);
+        }
+      },
+      result));
+  Print("uart loopback", result);
+  NDL_CHECK(result.tx_bytes > 0 && result.rx_bytes == result.tx_bytes);
+  NDL_CHECK(result.errors == 0);
+
+  // uart2：主机回显上行 / uart2: the host echoes the uplink
+  uint32_t uart2_key = TestHost::Key("uart2");
+  StartSelfTest(host, 2, SelfTest::Target::NET);
+  NDL_CHECK(WaitReport(
+      host, REPORT_WAIT_MS,
+      [&](uint32_t key, const uint8_t *data, size_t size) {
+        if (key == uart2_key && size > 0) {
+          host.Send("uart2", data, size);
+        }
+      },
+      result));
+  Print("net echo", result);
+  NDL_CHECK(result.tx_bytes > 0 && result.rx_bytes == result.tx_bytes);
+  NDL_CHECK(result.errors == 0);
+
+  // 抓取 uart2 后主机回显自测被拒绝，不会有报告
+  // With uart2 tapped, host echo is refused and no report comes
+  Command cmd{};
+  cmd.type = Command::Type::TAP;
+  cmd.data.tap.port_mask = 1u << 2;
+  Command reply{};
+  NDL_CHECK(host.Request(cmd, Command::Type::TAP, 2000, reply));
+  StartSelfTest(host, 2, SelfTest::Target::NET);
+  NDL_CHECK(!WaitReport(
+      host, REPORT_WAIT_MS, [](uint32_t, const uint8_t *, size_t) {},
+      result));
+
+  printf("PASS\n");
+  Finish(0);
+}
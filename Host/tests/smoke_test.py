@@ -0,0 +1,179 @@
+#!/usr/bin/env python3
+"""End-to-end smoke run of the NetDebugLink host simulation.
+
+Starts ``netdebuglink_host`` on socat pty pairs, attaches over loopback TCP
+the way the desktop tools do (UDP discovery, then the device connects back),
+and checks that bytes travel both ways:
+
+* bytes written to the uart1 peer arrive as ``uart1`` Topic frames on TCP;
+* those frames sent back down the TCP link come out of the uart1 peer.
+
+Echoing the device's own frames avoids re-implementing the Topic CRCs here.
+
+Usage: smoke_test.py <netdebuglink_host binary>
+"""
+
+import os
+import select
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+TCP_PORT = 5000
+UDP_PORT = 5001
+DISCOVERY = b"XRobot Debug Tools Default Message"
+MARKER = b"ndl-smoke-0123456789"
+
+TOPIC_PREFIX = 0xA5
+TOPIC_HEADER = 9  # prefix, name crc32, len u24, header crc8
+TOPIC_OVERHEAD = TOPIC_HEADER + 1
+
+
+def fail(message):
+    print(f"FAIL: {message}", file=sys.stderr)
+    sys.exit(1)
+
+
+def wait_for(predicate, timeout, message):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        if predicate():
+            return
+        time.sleep(0.05)
+    fail(message)
+
+
+def topic_frames(buf):
+    """Split whole Topic frames off the front of buf.
+
+    Returns (frames, rest); each frame is (key, raw frame, data).
+    """
+    frames = []
+    offset = 0
+    while len(buf) - offset >= TOPIC_OVERHEAD:
+        if buf[offset] != TOPIC_PREFIX:
+            offset += 1
+            continue
+        size = int.from_bytes(buf[offset + 5:offset + 8], "little")
+        end = offset + TOPIC_OVERHEAD + size
+        if end > len(buf):
+            break
+        key = bytes(buf[offset + 1:offset + 5])
+        frames.append((key, bytes(buf[offset:end]),
+                       bytes(buf[offset + TOPIC_HEADER:end - 1])))
+        offset = end
+    return frames, buf[offset:]
+
+
+def main():
+    if len(sys.argv) != 2:
+        fail(__doc__.strip().splitlines()[-1])
+    binary = sys.argv[1]
+    if shutil.which("socat") is None:
+        fail("socat not found")
+
+    workdir = tempfile.mkdtemp(prefix="ndl_smoke_")
+    children = []
+
+    def pty_pair(name):
+        link = os.path.join(workdir, name)
+        children.append(subprocess.Popen(
+            ["socat", f"pty,raw,echo=0,link={link}",
+             f"pty,raw,echo=0,link={link}_peer"]))
+        wait_for(lambda: os.path.exists(link) and
+                 os.path.exists(link + "_peer"), 5, f"socat {name}")
+        return link
+
+    try:
+        cdc = pty_pair("cdc")
+        uart1 = pty_pair("uart1")
+        uart2 = pty_pair("uart2")
+
+        server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        server.bind(("127.0.0.1", TCP_PORT))
+        server.listen(1)
+        server.settimeout(0.5)
+
+        env = dict(os.environ,
+                   NDL_CAPTURE_FILE=os.path.join(workdir, "capture.bin"))
+        children.append(subprocess.Popen(
+            [binary, cdc, uart1, uart2, os.path.join(workdir, "db.bin")],
+            env=env, stdout=subprocess.DEVNULL))
+
+        discovery = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        deadline = time.monotonic() + 20
+        link = None
+        while link is None:
+            if time.monotonic() > deadline:
+                fail("device never connected back over TCP")
+            if children[-1].poll() is not None:
+                fail(f"netdebuglink_host exited with {children[-1].returncode}")
+            discovery.sendto(DISCOVERY, ("127.0.0.1", UDP_PORT))
+            try:
+                link, _ = server.accept()
+            except socket.timeout:
+                pass
+        link.setblocking(False)
+        print("device attached over TCP")
+
+        peer = os.open(uart1 + "_peer", os.O_RDWR | os.O_NOCTTY)
+
+        # 目标到主机 / target to host
+        os.write(peer, MARKER)
+        pending = b""
+        by_key = {}
+        found = None
+        deadline = time.monotonic() + 10
+        while found is None:
+            if time.monotonic() > deadline:
+                fail("uart1 bytes never reached the TCP stream")
+            select.select([link], [], [], 0.1)
+            try:
+                chunk = link.recv(65536)
+            except BlockingIOError:
+                continue
+            if not chunk:
+                fail("device closed the TCP link")
+            frames, pending = topic_frames(pending + chunk)
+            for key, raw, data in frames:
+                raws, joined = by_key.get(key, ([], b""))
+                by_key[key] = (raws + [raw], joined + data)
+                if MARKER in by_key[key][1]:
+                    found = key
+        print("uplink ok")
+
+        # 主机到目标：原样回送设备的 uart1 帧 / host to target: send the
+        # device's own uart1 frames back down
+        link.setblocking(True)
+        link.sendall(b"".join(by_key[found][0]))
+        received = b""
+        deadline = time.monotonic() + 10
+        while MARKER not in received:
+            if time.monotonic() > deadline:
+                fail("TCP downlink never reached the uart1 peer")
+            ready, _, _ = select.select([peer], [], [], 0.1)
+            if ready:
+                received += os.read(peer, 4096)
+        print("downlink ok")
+        os.close(peer)
+        link.close()
+    finally:
+        for child in reversed(children):
+            if child.poll() is None:
+                child.send_signal(signal.SIGTERM)
+                try:
+                    child.wait(timeout=5)
+                except subprocess.TimeoutExpired:
+                    child.kill()
+        shutil.rmtree(workdir, ignore_errors=True)
+
+    print("PASS")
+
+
+if __name__ == "__main__":
+    main()
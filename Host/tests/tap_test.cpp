@@ -0,0 +1,137 @@
+#include "test_device.hpp"
+
+// 抓取 uart1，同时让 uart2 持续有普通数据：一次读出的突发与一帧接近 4 KB 的
+// 下行都必须拆成不超过 TAP_DATA_MAX 的记录，抓取通道不得卡住，两个方向的记录
+// 拼起来与原始数据一致
+// Tap uart1 while uart2 keeps plain data flowing: bursts read in one go and
+// a single downlink frame of almost 4 KB must be split into records of at
+// most TAP_DATA_MAX, the tap lane must not stall, and the records of each
+// direction must add up to the original data
+
+using namespace NetDebugLinkTest;
+using Command = NetDebugLink::Command;
+using TapHeader = NetDebugLink::TapHeader;
+
+static constexpr size_t BURST_BYTES = 6 * 1024;
+static constexpr size_t BURSTS = 10;
+static constexpr size_t PLAIN_BYTES = 1024;
+// 超过 TAP_DATA_MAX 但仍是一个下行帧 / Over TAP_DATA_MAX, yet one downlink
+// frame
+static constexpr size_t DOWNLINK_BYTES = 4064;
+static_assert(DOWNLINK_BYTES > NetDebugLink::TAP_DATA_MAX);
+static constexpr uint32_t BURST_GAP_MS = 100;
+
+static uint8_t DownlinkPattern(size_t offset) {
+  return static_cast<uint8_t>(offset * 3 + 1);
+}
+
+int main() {
+  TestHost host;
+  auto dev = StartAttached(host, 8192);
+
+  Command cmd{};
+  cmd.type = Command::Type::TAP;
+  cmd.data.tap.port_mask = 1u << 1;
+  Command reply{};
+  NDL_CHECK(host.Request(cmd, Command::Type::TAP, 2000, reply));
+  NDL_CHECK(reply.data.tap.port_mask == (1u << 1));
+
+  uint32_t tap_key = TestHost::Key("tap");
+  uint32_t uart2_key = TestHost::Key("uart2");
+  uint32_t command_key = TestHost::Key("command");
+  std::vector<uint8_t> tap_rx, tap_tx, plain, target;
+  size_t records = 0;
+  size_t tx_records = 0;
+  size_t longest = 0;
+  uint32_t rx_dropped = 0;
+
+  auto poll = [&]() {
+    NDL_CHECK(host.Poll(20, [&](uint32_t key, const uint8_t *data,
+                                size_t size) {
+      if (key == tap_key) {
+        for (size_t offset = 0; offset < size;) {
+          TapHeader header;
+          NDL_CHECK(size - offset >= sizeof(header));
+          memcpy(&header, data + offset, sizeof(header));
+          offset += sizeof(header);
+          NDL_CHECK(header.port == 1 && header.len <= size - offset);
+          NDL_CHECK(header.len <= NetDebugLink::TAP_DATA_MAX);
+          auto &dst = header.direction == NetDebugLink::TAP_RX ? tap_rx
+                                                                : tap_tx;
+          dst.insert(dst.end(), data + offset, data + offset + header.len);
+          offset += header.len;
+          records++;
+          tx_records += header.direction == NetDebugLink::TAP_TX;
+          longest = LibXR::max<size_t>(longest, header.len);
+        }
+      } else if (key == uart2_key) {
+        plain.insert(plain.end(), data, data + size);
+      } else if (key == command_key && size == sizeof(Command)) {
+        Command report;
+        memcpy(&report, data, sizeof(report));
+        if (report.type == Command::Type::FLOW_CONTROL &&
+            report.data.flow_control.uart_index == 1) {
+          rx_dropped = report.data.flow_control.rx_dropped;
+        }
+      }
+    }));
+    // 目标侧收到的下行数据 / Downlink data reaching the target
+    uint8_t buf[4096];
+    ssize_t len;
+    while ((len = read(dev.uart1, buf, sizeof(buf))) > 0) {
+      target.insert(target.end(), buf, buf + len);
+    }
+  };
+
+  int flags = fcntl(dev.uart1, F_GETFL);
+  fcntl(dev.uart1, F_SETFL, flags | O_NONBLOCK);
+
+  // 每个突发一次写入，设备一次读出整块 / Each burst is written in one go
+  // so the device reads it as a whole block
+  std::vector<uint8_t> chunk(BURST_BYTES);
+  std::vector<uint8_t> plain_chunk(PLAIN_BYTES);
+  for (size_t burst = 0; burst < BURSTS; burst++) {
+    FillPattern(chunk, burst * BURST_BYTES, CountPattern);
+    FillPattern(plain_chunk, burst * PLAIN_BYTES, XorPattern);
+    WriteAll(dev.uart2, plain_chunk.data(), plain_chunk.size());
+    WriteAll(dev.uart1, chunk.data(), chunk.size());
+    uint64_t next_ms = NowMs() + BURST_GAP_MS;
+    while (NowMs() < next_ms) {
+      poll();
+    }
+  }
+
+  std::vector<uint8_t> downlink(DOWNLINK_BYTES);
+  FillPattern(downlink, 0, DownlinkPattern);
+  host.Send("uart1", downlink.data(), downlink.size());
+
+  uint64_t deadline = NowMs() + 10000;
+  while (tap_rx.size() < BURST_BYTES * BURSTS ||
+         plain.size() < PLAIN_BYTES * BURSTS ||
+         tap_tx.size() < DOWNLINK_BYTES || target.size() < DOWNLINK_BYTES) {
+    if (NowMs() > deadline) {
+      break;
+    }
+    poll();
+  }
+
+  printf("tap: %zu records, longest %zu, %zu of %zu bytes in, %zu of %zu "
+         "out; plain %zu of %zu; %u dropped\n",
+         records, longest, tap_rx.size(), BURST_BYTES * BURSTS, tap_tx.size(),
+         DOWNLINK_BYTES, plain.size(), PLAIN_BYTES * BURSTS, rx_dropped);
+  NDL_CHECK(tap_rx.size() == BURST_BYTES * BURSTS);
+  for (size_t i = 0; i < tap_rx.size(); i++) {
+    NDL_CHECK(tap_rx[i] == CountPattern(i));
+  }
+  NDL_CHECK(plain.size() == PLAIN_BYTES * BURSTS);
+  for (size_t i = 0; i < plain.size(); i++) {
+    NDL_CHECK(plain[i] == XorPattern(i));
+  }
+  NDL_CHECK(tap_tx == downlink);
+  NDL_CHECK(tx_records >= 2 && longest == NetDebugLink::TAP_DATA_MAX);
+  NDL_CHECK(target == downlink);
+  NDL_CHECK(rx_dropped == 0);
+
+  printf("PASS\n");
+  Finish(0);
+}
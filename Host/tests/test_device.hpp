@@ -0,0 +1,381 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pty.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "NetDebugLink.hpp"
+#include "host_hardware.hpp"
+#include "libxr.hpp"
+#include "linux_flash.hpp"
+#include "linux_uart.hpp"
+
+/**
+ * @brief 进程内运行设备并在回环 TCP 上扮演主机的测试工具 /
+ *        Test helpers that run the device in process and play the host on
+ *        loopback TCP
+ *
+ * 串口由 openpty 提供，测试直接读写主端。设备线程不会退出，测试结束时用
+ * Finish 直接结束进程。
+ * UARTs are backed by openpty and tests use the master side. The device
+ * threads never return, so tests end the process with Finish.
+ */
+namespace NetDebugLinkTest {
+
+#define NDL_CHECK(cond)                                                  \
+  do {                                                                   \
+    if (!(cond)) {                                                       \
+      fprintf(stderr, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);    \
+      NetDebugLinkTest::Finish(1);                                       \
+    }                                                                    \
+  } while (0)
+
+static constexpr uint16_t TCP_PORT = 5000;
+static constexpr uint16_t UDP_PORT = 5001;
+static constexpr char DISCOVERY[] = "XRobot Debug Tools Default Message";
+static constexpr size_t TOPIC_HEADER = 9; // 前缀、名字 crc32、u24 长度、crc8
+static constexpr size_t TOPIC_OVERHEAD = TOPIC_HEADER + 1;
+static constexpr uint32_t ATTACH_TIMEOUT_MS = 20000;
+
+inline std::string &WorkDir() {
+  static std::string dir;
+  if (dir.empty()) {
+    char path[] = "/tmp/ndl_test_XXXXXX";
+    dir = mkdtemp(path);
+  }
+  return dir;
+}
+
+[[noreturn]] inline void Finish(int code) {
+  std::error_code ec;
+  std::filesystem::remove_all(WorkDir(), ec);
+  fflush(stdout);
+  fflush(stderr);
+  _exit(code);
+}
+
+inline uint64_t NowMs() { return LibXR::Timebase::GetMilliseconds(); }
+
+/**
+ * @brief 打开一对原始模式的 pty / Open a pty pair in raw mode
+ * @return 主端 fd，path 返回从端路径 / Master fd; path receives the slave
+ */
+inline int OpenPty(std::string &path) {
+  int master = -1;
+  int slave = -1;
+  char name[64];
+  NDL_CHECK(openpty(&master, &slave, name, nullptr, nullptr) == 0);
+  termios tio;
+  tcgetattr(slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+  tcgetattr(master, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(master, TCSANOW, &tio);
+  // 保持从端打开，设备重开时主端不会读到 EIO
+  // Keep the slave open so the master never sees EIO while the device
+  // reopens it
+  path = name;
+  return master;
+}
+
+/**
+ * @brief 写满 size 字节 / Write all size bytes
+ */
+inline void WriteAll(int fd, const void *data, size_t size) {
+  auto src = static_cast<const uint8_t *>(data);
+  while (size > 0) {
+    ssize_t ans = write(fd, src, size);
+    NDL_CHECK(ans > 0);
+    src += ans;
+    size -= ans;
+  }
+}
+
+/**
+ * @brief 周期不是 256 的计数序列，错位或丢字节都会被发现 / Counting
+ *        sequence whose period is not 256, so shifted or lost bytes show
+ */
+inline uint8_t CountPattern(size_t offset) {
+  return static_cast<uint8_t>(offset * 7 + offset / 251);
+}
+
+/**
+ * @brief 与 CountPattern 不同的第二路数据 / A second stream distinct from
+ *        CountPattern
+ */
+inline uint8_t XorPattern(size_t offset) {
+  return static_cast<uint8_t>((offset * 13) ^ 0x5a);
+}
+
+/**
+ * @brief 用序列中从 offset 开始的字节填满 buf / Fill buf with the sequence
+ *        starting at offset
+ */
+inline void FillPattern(std::vector<uint8_t> &buf, size_t offset,
+                        uint8_t (*pattern)(size_t)) {
+  for (size_t i = 0; i < buf.size(); i++) {
+    buf[i] = pattern(offset + i);
+  }
+}
+
+/**
+ * @brief 从 pending 中解出完整的 v1 帧，每帧调用一次 on_frame，保留末尾的
+ *        半帧 / Extract every complete v1 frame from pending, calling
+ *        on_frame for each and keeping a trailing partial frame
+ */
+template <typename OnFrame>
+inline void ParseFrames(std::vector<uint8_t> &pending, OnFrame &&on_frame) {
+  size_t offset = 0;
+  while (pending.size() - offset >= TOPIC_OVERHEAD) {
+    if (pending[offset] != 0xa5) {
+      offset++;
+      continue;
+    }
+    size_t size = pending[offset + 5] | (pending[offset + 6] << 8) |
+                  (pending[offset + 7] << 16);
+    if (offset + TOPIC_OVERHEAD + size > pending.size()) {
+      break;
+    }
+    uint32_t key;
+    memcpy(&key, &pending[offset + 1], sizeof(key));
+    on_frame(key, &pending[offset + TOPIC_HEADER], size);
+    offset += TOPIC_OVERHEAD + size;
+  }
+  pending.erase(pending.begin(), pending.begin() + offset);
+}
+
+/**
+ * @brief 在 pty 后面运行的设备 / The device running behind ptys
+ */
+struct Device {
+  int cdc = -1;
+  int uart1 = -1;
+  int uart2 = -1;
+  NetDebugLinkHost::HostWifiClient *wifi = nullptr;
+  NetDebugLink *link = nullptr;
+};
+
+/**
+ * @brief 以 Host/main.cpp 相同的硬件表启动设备 / Start the device with the
+ *        same hardware table as Host/main.cpp
+ */
+inline Device StartDevice(size_t uart_buffer = 2048) {
+  Device dev;
+  std::string cdc_path, uart1_path, uart2_path;
+  dev.cdc = OpenPty(cdc_path);
+  dev.uart1 = OpenPty(uart1_path);
+  dev.uart2 = OpenPty(uart2_path);
+
+  setenv("NDL_CAPTURE_FILE", (WorkDir() + "/capture.bin").c_str(), 1);
+  static std::string db_path = WorkDir() + "/db.bin";
+
+  LibXR::PlatformInit();
+
+  static LibXR::LinuxBinaryFileFlash<64 * 1024> flash(db_path.c_str());
+  static LibXR::DatabaseRaw<1> db(flash);
+
+  static NetDebugLinkHost::HostPWM led_pwm;
+  static NetDebugLinkHost::HostGPIO button_gpio;
+  static NetDebugLinkHost::HostWifiClient wifi;
+
+  static LibXR::LinuxUART uart_cdc(cdc_path.c_str(), 115200,
+                                   LibXR::UART::Parity::NO_PARITY, 8, 1, 4,
+                                   uart_buffer);
+  static LibXR::LinuxUART uart_1(uart1_path.c_str(), 115200,
+                                 LibXR::UART::Parity::NO_PARITY, 8, 1, 4,
+                                 uart_buffer);
+  static LibXR::LinuxUART uart_2(uart2_path.c_str(), 115200,
+                                 LibXR::UART::Parity::NO_PARITY, 8, 1, 4,
+                                 uart_buffer);
+
+  static LibXR::HardwareContainer hw(
+      LibXR::Entry<LibXR::PWM>{.object = led_pwm, .aliases = {"led"}},
+      LibXR::Entry<LibXR::GPIO>{.object = button_gpio, .aliases = {"button"}},
+      LibXR::Entry<LibXR::UART>{.object = uart_1, .aliases = {"uart1"}},
+      LibXR::Entry<LibXR::UART>{.object = uart_2, .aliases = {"uart2"}},
+      LibXR::Entry<LibXR::UART>{.object = uart_cdc, .aliases = {"uart_cdc"}},
+      LibXR::Entry<LibXR::WifiClient>{.object = wifi,
+                                      .aliases = {"wifi_client"}},
+      LibXR::Entry<LibXR::Database>{.object = db, .aliases = {"database"}});
+
+  static LibXR::ApplicationManager appmgr;
+
+  static NetDebugLink netdebuglink(hw, appmgr, TCP_PORT, UDP_PORT, 40000,
+                                   16384, "uart_cdc", {"uart1", "uart2"});
+
+  dev.wifi = &wifi;
+  dev.link = &netdebuglink;
+  return dev;
+}
+
+/**
+ * @brief 回环 TCP 上的主机端 / The host side on loopback TCP
+ */
+class TestHost {
+ public:
+  /**
+   * @brief Topic 名字对应的帧键 / Frame key of a topic name
+   */
+  static uint32_t Key(const char *topic) {
+    return LibXR::CRC32::Calculate(topic, strlen(topic));
+  }
+
+  TestHost() {
+    server_ = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(server_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr = Loopback(TCP_PORT);
+    NDL_CHECK(bind(server_, reinterpret_cast<sockaddr *>(&addr),
+                   sizeof(addr)) == 0);
+    NDL_CHECK(listen(server_, 1) == 0);
+  }
+
+  /**
+   * @brief 发送发现报文直到设备连回 / Send discovery until the device
+   *        connects back
+   */
+  bool Attach(uint32_t timeout_ms) {
+    int udp = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr = Loopback(UDP_PORT);
+    uint64_t deadline = NowMs() + timeout_ms;
+    while (link_ < 0 && NowMs() < deadline) {
+      sendto(udp, DISCOVERY, sizeof(DISCOVERY) - 1, 0,
+             reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+      pollfd pfd = {server_, POLLIN, 0};
+      if (poll(&pfd, 1, 500) > 0) {
+        link_ = accept(server_, nullptr, nullptr);
+      }
+    }
+    close(udp);
+    pending_.clear();
+    return link_ >= 0;
+  }
+
+  /**
+   * @brief 断开当前连接 / Drop the current connection
+   */
+  void Detach() {
+    if (link_ >= 0) {
+      close(link_);
+      link_ = -1;
+    }
+  }
+
+  void SendRaw(const void *data, size_t size) { WriteAll(link_, data, size); }
+
+  void Send(const char *topic, const void *data, size_t size) {
+    std::vector<uint8_t> frame(size + TOPIC_OVERHEAD);
+    LibXR::Topic::PackData(Key(topic), {frame.data(), frame.size()},
+                           {data, size});
+    SendRaw(frame.data(), frame.size());
+  }
+
+  void SendCommand(const NetDebugLink::Command &cmd) {
+    Send("command", &cmd, sizeof(cmd));
+  }
+
+  /**
+   * @brief 读取 TCP 流的原始字节 / Read raw bytes off the TCP stream
+   * @return 连接仍然存活 / Whether the connection is still up
+   */
+  template <typename OnBytes>
+  bool PollRaw(uint32_t timeout_ms, OnBytes &&on_bytes) {
+    pollfd pfd = {link_, POLLIN, 0};
+    if (poll(&pfd, 1, static_cast<int>(timeout_ms)) <= 0) {
+      return true;
+    }
+    uint8_t buf[16384];
+    ssize_t len = recv(link_, buf, sizeof(buf), 0);
+    if (len <= 0) {
+      return false;
+    }
+    on_bytes(buf, static_cast<size_t>(len));
+    return true;
+  }
+
+  /**
+   * @brief 读取 TCP 流，每解出一个 v1 帧调用一次 on_frame /
+   *        Read the TCP stream and call on_frame for every v1 frame
+   * @return 连接仍然存活 / Whether the connection is still up
+   */
+  template <typename OnFrame>
+  bool Poll(uint32_t timeout_ms, OnFrame &&on_frame) {
+    bool alive = PollRaw(timeout_ms, [&](const uint8_t *buf, size_t len) {
+      pending_.insert(pending_.end(), buf, buf + len);
+    });
+    if (!alive) {
+      return false;
+    }
+    ParseFrames(pending_, on_frame);
+    return true;
+  }
+
+  /**
+   * @brief 等待某类命令回复 / Wait for a command reply of one type
+   */
+  bool WaitCommand(NetDebugLink::Command::Type type, uint32_t timeout_ms,
+                   NetDebugLink::Command &out) {
+    bool found = false;
+    uint64_t deadline = NowMs() + timeout_ms;
+    while (!found && NowMs() < deadline) {
+      Poll(50, [&](uint32_t key, const uint8_t *data, size_t size) {
+        if (found || key != Key("command") ||
+            size != sizeof(NetDebugLink::Command)) {
+          return;
+        }
+        memcpy(&out, data, sizeof(out));
+        found = out.type == type;
+      });
+    }
+    return found;
+  }
+
+  /**
+   * @brief 发送命令并等待某类回复 / Send a command and wait for a reply of
+   *        one type
+   */
+  bool Request(const NetDebugLink::Command &cmd,
+               NetDebugLink::Command::Type type, uint32_t timeout_ms,
+               NetDebugLink::Command &out) {
+    SendCommand(cmd);
+    return WaitCommand(type, timeout_ms, out);
+  }
+
+ private:
+  static sockaddr_in Loopback(uint16_t port) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return addr;
+  }
+
+  int server_ = -1;
+  int link_ = -1;
+  std::vector<uint8_t> pending_;
+};
+
+/**
+ * @brief 启动设备并等它连上主机 / Start the device and wait for it to
+ *        attach to the host
+ */
+inline Device StartAttached(TestHost &host, size_t uart_buffer = 2048) {
+  Device dev = StartDevice(uart_buffer);
+  NDL_CHECK(host.Attach(ATTACH_TIMEOUT_MS));
+  return dev;
+}
+
+}  // namespace NetDebugLinkTest
@@ -0,0 +1,311 @@
+#include "test_device.hpp"
+
+// 切换到 v2 紧凑帧后解开超级帧，检查端口、控制、离线与跟踪条目的内容都与
+// 设备端一致，并且 link_stats.payload_bytes 与主机统计的有效字节相符
+// Switch to v2 compact framing and unpack the super-frames, checking that
+// port, control, capture and trace entries carry exactly what the device
+// produced, and that link_stats.payload_bytes matches the useful bytes the
+// host counted
+
+using namespace NetDebugLinkTest;
+using Command = NetDebugLink::Command;
+
+static constexpr size_t CAPTURE_BYTES = 32 * 1024;
+static constexpr size_t LIVE_BYTES = 8 * 1024;
+static constexpr uint64_t REMOTE_PING_T1 = 0x123456789ull;
+
+/**
+ * @brief 同时解析 v1 Topic 帧与 v2 超级帧的上行流 /
+ *        Uplink stream parser for both v1 Topic frames and v2 super-frames
+ *
+ * 切换之前与换链路重发的部分仍是 v1，所以按首字节区分。
+ * Frames sent before the switch, or resent after a link change, are still
+ * v1, so each frame is told apart by its first byte.
+ */
+class UplinkParser {
+ public:
+  struct Counts {
+    size_t control = 0;
+    size_t capture = 0;
+    size_t trace = 0;
+    size_t port = 0;
+  };
+
+  std::vector<uint8_t> live;
+  std::vector<uint8_t> capture;
+  size_t trace_bytes = 0;
+  std::vector<Command> commands;
+  std::vector<uint64_t> useful_before;  // 每条命令之前的有效字节 / useful
+                                        // bytes ahead of each command
+  uint64_t useful_bytes = 0;
+  Counts v2;
+
+  void Feed(const uint8_t *data, size_t size) {
+    pending_.insert(pending_.end(), data, data + size);
+    size_t offset = 0;
+    while (offset < pending_.size()) {
+      size_t used = pending_[offset] == NetDebugLink::V2_MAGIC
+                        ? ParseSuperFrame(offset)
+                        : ParseTopic(&pending_[offset],
+                                     pending_.size() - offset, nullptr);
+      if (used == 0) {
+        break;
+      }
+      offset += used;
+    }
+    pending_.erase(pending_.begin(), pending_.begin() + offset);
+  }
+
+ private:
+  /**
+   * @return 帧长度，不完整时为 0 / Frame length, 0 while incomplete
+   */
+  size_t ParseTopic(const uint8_t *frame, size_t avail, size_t *v2_count) {
+    if (avail < TOPIC_OVERHEAD) {
+      return 0;
+    }
+    NDL_CHECK(frame[0] == 0xa5);
+    size_t size = frame[5] | (frame[6] << 8) | (frame[7] << 16);
+    if (avail < TOPIC_OVERHEAD + size) {
+      return 0;
+    }
+    NDL_CHECK(LibXR::CRC8::Calculate(frame, TOPIC_HEADER - 1) ==
+              frame[TOPIC_HEADER - 1]);
+    NDL_CHECK(LibXR::CRC8::Calculate(frame, TOPIC_OVERHEAD + size - 1) ==
+              frame[TOPIC_OVERHEAD + size - 1]);
+
+    uint32_t key;
+    memcpy(&key, frame + 1, sizeof(key));
+    const uint8_t *data = frame + TOPIC_HEADER;
+    if (key == TestHost::Key("command")) {
+      NDL_CHECK(size == sizeof(Command));
+      Command cmd;
+      memcpy(&cmd, data, sizeof(cmd));
+      commands.push_back(cmd);
+      useful_before.push_back(useful_bytes);
+      useful_bytes += size;
+    } else if (key == TestHost::Key("capture")) {
+      NDL_CHECK(size > NetDebugLink::CAPTURE_RECORD_HEADER);
+      NDL_CHECK(data[0] == 1);
+      capture.insert(capture.end(),
+                     data + NetDebugLink::CAPTURE_RECORD_HEADER, data + size);
+      useful_bytes += size - NetDebugLink::CAPTURE_RECORD_HEADER;
+    } else if (key == TestHost::Key("trace")) {
+      NDL_CHECK(size % sizeof(TraceRing::Event) == 0);
+      trace_bytes += size;
+      useful_bytes += size;
+    } else if (key == TestHost::Key("uart1")) {
+      live.insert(live.end(), data, data + size);
+      useful_bytes += size;
+    }
+    if (v2_count != nullptr) {
+      (*v2_count)++;
+    }
+    return TOPIC_OVERHEAD + size;
+  }
+
+  size_t ParseSuperFrame(size_t offset) {
+    if (pending_.size() - offset < NetDebugLink::V2_HEADER_SIZE) {
+      return 0;
+    }
+    const uint8_t *frame = &pending_[offset];
+    size_t body = frame[1] | (frame[2] << 8);
+    size_t total = NetDebugLink::V2_HEADER_SIZE + body +
+                   NetDebugLink::V2_TRAILER_SIZE;
+    if (pending_.size() - offset < total) {
+      return 0;
+    }
+    const uint8_t *entry = frame + NetDebugLink::V2_HEADER_SIZE;
+    const uint8_t *end = entry + body;
+    uint16_t crc = end[0] | (end[1] << 8);
+    NDL_CHECK(LibXR::CRC16::Calculate(entry, body) == crc);
+
+    while (entry < end) {
+      uint8_t port = *entry++;
+      size_t len = 0;
+      for (int shift = 0;; shift += 7) {
+        NDL_CHECK(entry < end && shift < 21);
+        uint8_t byte = *entry++;
+        len |= static_cast<size_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+          break;
+        }
+      }
+      NDL_CHECK(len > 0 && entry + len <= end);
+
+      if (port >= NetDebugLink::SEGMENT_TAP) {
+        // 控制、离线与跟踪条目内是完整的 Topic 帧 / Control, capture and
+        // trace entries hold whole Topic frames
+        size_t *count = port == NetDebugLink::SEGMENT_CONTROL ? &v2.control
+                        : port == NetDebugLink::SEGMENT_CAPTURE
+                            ? &v2.capture
+                            : &v2.trace;
+        NDL_CHECK(port != NetDebugLink::SEGMENT_TAP);
+        for (size_t used = 0; used < len;) {
+          size_t frame_len = ParseTopic(entry + used, len - used, count);
+          NDL_CHECK(frame_len > 0);
+          used += frame_len;
+        }
+      } else {
+        NDL_CHECK(port == 1);
+        live.insert(live.end(), entry, entry + len);
+        useful_bytes += len;
+        v2.port++;
+      }
+      entry += len;
+    }
+    return total;
+  }
+
+  std::vector<uint8_t> pending_;
+};
+
+/**
+ * @brief 读一轮上行并应答设备心跳 / Read one round of uplink and answer
+ *        device pings
+ */
+static void Pump(TestHost &host, UplinkParser &parser) {
+  size_t seen = parser.commands.size();
+  NDL_CHECK(host.PollRaw(50, [&](const uint8_t *data, size_t size) {
+    parser.Feed(data, size);
+  }));
+  for (size_t i = seen; i < parser.commands.size(); i++) {
+    Command cmd = parser.commands[i];
+    if (cmd.type == Command::Type::PING && cmd.data.ping.t3 == 0) {
+      cmd.data.ping.t2 = LibXR::Timebase::GetMicroseconds();
+      cmd.data.ping.t3 = LibXR::Timebase::GetMicroseconds();
+      host.SendCommand(cmd);
+    }
+  }
+}
+
+template <typename Done>
+static void PumpUntil(TestHost &host, UplinkParser &parser,
+                      uint32_t timeout_ms, Done &&done, const char *what) {
+  uint64_t deadline = NowMs() + timeout_ms;
+  while (!done()) {
+    if (NowMs() > deadline) {
+      fprintf(stderr, "FAIL: timed out waiting for %s\n", what);
+      Finish(1);
+    }
+    Pump(host, parser);
+  }
+}
+
+static const Command *FindCommand(const UplinkParser &parser,
+                                  Command::Type type, size_t from = 0) {
+  for (size_t i = from; i < parser.commands.size(); i++) {
+    if (parser.commands[i].type == type) {
+      return &parser.commands[i];
+    }
+  }
+  return nullptr;
+}
+
+int main() {
+  TestHost host;
+  auto dev = StartAttached(host, 8192);
+
+  // 无主机时写入的数据进入离线存储 / Data written without a host goes to
+  // the capture store
+  host.Detach();
+  uint64_t deadline = NowMs() + 5000;
+  while (dev.link->HostAttached()) {
+    NDL_CHECK(NowMs() < deadline);
+    usleep(10000);
+  }
+  std::vector<uint8_t> chunk(2048);
+  for (size_t offset = 0; offset < CAPTURE_BYTES; offset += chunk.size()) {
+    FillPattern(chunk, offset, CountPattern);
+    WriteAll(dev.uart1, chunk.data(), chunk.size());
+    usleep(20000);
+  }
+  usleep(500000);
+
+  // 连上后立即切换到 v2 并开始跟踪 / Switch to v2 and start tracing right
+  // after attaching
+  NDL_CHECK(host.Attach(ATTACH_TIMEOUT_MS));
+  Command cmd{};
+  cmd.type = Command::Type::FRAMING;
+  cmd.data.framing.version = NetDebugLink::FRAMING_V2;
+  host.SendCommand(cmd);
+  cmd = {};
+  cmd.type = Command::Type::TRACE;
+  cmd.data.trace.action = NetDebugLink::TRACE_START;
+  host.SendCommand(cmd);
+
+  UplinkParser parser;
+  PumpUntil(host, parser, 20000, [&]() {
+    return parser.capture.size() >= CAPTURE_BYTES &&
+           FindCommand(parser, Command::Type::FRAMING) != nullptr;
+  }, "capture backlog");
+  NDL_CHECK(FindCommand(parser, Command::Type::FRAMING)->data.framing.version ==
+            NetDebugLink::FRAMING_V2);
+  NDL_CHECK(parser.capture.size() == CAPTURE_BYTES);
+  for (size_t i = 0; i < CAPTURE_BYTES; i++) {
+    NDL_CHECK(parser.capture[i] == CountPattern(i));
+  }
+
+  // 实时数据与远端心跳 / Live data and a remote ping
+  chunk.resize(LIVE_BYTES);
+  FillPattern(chunk, 0, XorPattern);
+  WriteAll(dev.uart1, chunk.data(), chunk.size());
+  size_t ping_from = parser.commands.size();
+  cmd = {};
+  cmd.type = Command::Type::REMOTE_PING;
+  cmd.data.ping.seq = 7;
+  cmd.data.ping.t1 = REMOTE_PING_T1;
+  host.SendCommand(cmd);
+  PumpUntil(host, parser, 10000, [&]() {
+    return parser.live.size() >= LIVE_BYTES &&
+           FindCommand(parser, Command::Type::REMOTE_PING, ping_from);
+  }, "live data and remote ping");
+  NDL_CHECK(parser.live == chunk);
+  auto pong = FindCommand(parser, Command::Type::REMOTE_PING, ping_from);
+  NDL_CHECK(pong->data.ping.seq == 7 &&
+            pong->data.ping.t1 == REMOTE_PING_T1 && pong->data.ping.t3 != 0);
+
+  // 跟踪导出 / Trace dump
+  size_t trace_from = parser.commands.size();
+  cmd = {};
+  cmd.type = Command::Type::TRACE;
+  cmd.data.trace.action = NetDebugLink::TRACE_DUMP;
+  host.SendCommand(cmd);
+  const Command *dump = nullptr;
+  PumpUntil(host, parser, 10000, [&]() {
+    dump = FindCommand(parser, Command::Type::TRACE, trace_from);
+    return dump != nullptr && parser.trace_bytes >= dump->data.trace.events *
+                                                        sizeof(TraceRing::Event);
+  }, "trace dump");
+  NDL_CHECK(dump->data.trace.events > 0);
+  NDL_CHECK(parser.trace_bytes ==
+            dump->data.trace.events * sizeof(TraceRing::Event));
+
+  printf("v2 entries: %zu control, %zu capture, %zu trace, %zu port\n",
+         parser.v2.control, parser.v2.capture, parser.v2.trace,
+         parser.v2.port);
+  NDL_CHECK(parser.v2.control > 0 && parser.v2.capture > 0 &&
+            parser.v2.trace > 0 && parser.v2.port > 0);
+
+  // 静默后等一次链路统计，有效字节应与主机在它之前收到的一致（允许一条
+  // 命令在途），统计帧本身不在快照内
+  // Once quiet, wait for link stats; the useful byte count must match what
+  // the host received ahead of it, give or take one command in flight. The
+  // stats frame is not part of its own snapshot
+  size_t stats_from = parser.commands.size();
+  const Command *stats = nullptr;
+  PumpUntil(host, parser, 30000, [&]() {
+    stats = FindCommand(parser, Command::Type::LINK_STATS, stats_from);
+    return stats != nullptr;
+  }, "link stats");
+  uint64_t before_stats = parser.useful_before[stats - parser.commands.data()];
+  uint32_t reported = stats->data.link_stats.payload_bytes;
+  printf("payload bytes: device %u, host %llu, wire %u\n", reported,
+         static_cast<unsigned long long>(before_stats),
+         stats->data.link_stats.wire_bytes);
+  NDL_CHECK(reported + sizeof(Command) >= before_stats);
+  NDL_CHECK(reported <= before_stats + sizeof(Command));
+
+  printf("PASS\n");
+  Finish(0);
+}
@@ -0,0 +1,267 @@
+#include "test_device.hpp"
+
+// WebSocket 与原始 TCP 的开销基准及按需鉴权：未设置令牌时浏览器无需令牌即可
+// 接入；同一路 uart2 数据同时经 TCP 与 "/" 端点送达，比较两者的线上字节数；
+// 用 CONFIG_WS_TOKEN 设置令牌后缺少或错误的令牌得到 403，清除后恢复开放
+// WebSocket vs raw TCP overhead benchmark and opt-in authentication: with no
+// token set a browser attaches without one; the same uart2 stream reaches
+// the host over TCP and over the "/" endpoint at once, and the wire bytes of
+// both are compared; once CONFIG_WS_TOKEN sets a token a missing or wrong
+// token gets 403, and clearing it opens the endpoint again
+
+using namespace NetDebugLinkTest;
+using Command = NetDebugLink::Command;
+
+static constexpr uint16_t WS_PORT = TCP_PORT + 2;
+static constexpr size_t STREAM_BYTES = 256 * 1024;
+static constexpr size_t CHUNK_BYTES = 512;
+static constexpr uint32_t CHUNK_GAP_MS = 2;
+// 握手前后在途的批次只出现在一侧 / Batches in flight around the handshake
+// show up on one side only
+static constexpr size_t WIRE_SLACK = 1024;
+
+/**
+ * @brief 最小的 WebSocket 客户端，只统计与解出服务端的二进制消息 /
+ *        Minimal WebSocket client that only counts and unwraps the server's
+ *        binary messages
+ */
+class WsClient {
+ public:
+  ~WsClient() { Close(); }
+
+  /**
+   * @brief 连接并握手 / Connect and handshake
+   * @return HTTP 状态码，连不上时为 -1 / HTTP status code, -1 if the
+   *         connection failed
+   */
+  int Open(const std::string &target) {
+    Close();
+    sock_ = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(WS_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(sock_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) !=
+        0) {
+      Close();
+      return -1;
+    }
+
+    std::string request = "GET " + target +
+                          " HTTP/1.1\r\n"
+                          "Host: 127.0.0.1:" +
+                          std::to_string(WS_PORT) +
+                          "\r\n"
+                          "Upgrade: websocket\r\n"
+                          "Connection: Upgrade\r\n"
+                          "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                          "Sec-WebSocket-Version: 13\r\n\r\n";
+    WriteAll(sock_, request.data(), request.size());
+
+    std::string response;
+    uint64_t deadline = NowMs() + 2000;
+    size_t end = std::string::npos;
+    while ((end = response.find("\r\n\r\n")) == std::string::npos) {
+      if (NowMs() >= deadline) {
+        Close();
+        return -1;
+      }
+      pollfd pfd = {sock_, POLLIN, 0};
+      if (poll(&pfd, 1, 50) <= 0) {
+        continue;
+      }
+      char buf[512];
+      ssize_t len = recv(sock_, buf, sizeof(buf), 0);
+      if (len <= 0) {
+        Close();
+        return -1;
+      }
+      response.append(buf, static_cast<size_t>(len));
+    }
+    // 响应之后的字节已是第一批消息 / Bytes past the response are already
+    // the first messages
+    raw_.assign(response.begin() + end + 4, response.end());
+    wire_bytes = raw_.size();
+    int status = atoi(response.c_str() + strlen("HTTP/1.1 "));
+    if (status != 101) {
+      Close();
+    }
+    return status;
+  }
+
+  void Close() {
+    if (sock_ >= 0) {
+      close(sock_);
+      sock_ = -1;
+    }
+  }
+
+  /**
+   * @brief 读取并解出二进制消息，负载按 v1 帧交给 on_frame /
+   *        Read and unwrap binary messages, handing the payload to on_frame
+   *        as v1 frames
+   */
+  template <typename OnFrame>
+  void Poll(uint32_t timeout_ms, OnFrame &&on_frame) {
+    pollfd pfd = {sock_, POLLIN, 0};
+    if (poll(&pfd, 1, static_cast<int>(timeout_ms)) > 0) {
+      uint8_t buf[16384];
+      ssize_t len = recv(sock_, buf, sizeof(buf), 0);
+      NDL_CHECK(len > 0);
+      raw_.insert(raw_.end(), buf, buf + len);
+      wire_bytes += static_cast<size_t>(len);
+    }
+
+    size_t offset = 0;
+    while (raw_.size() - offset >= 2) {
+      // 服务端的帧不加掩码 / Server frames are unmasked
+      uint8_t opcode = raw_[offset] & 0x0f;
+      size_t header = 2;
+      size_t len = raw_[offset + 1] & 0x7f;
+      if (len == 126) {
+        if (raw_.size() - offset < 4) {
+          break;
+        }
+        header = 4;
+        len = (raw_[offset + 2] << 8) | raw_[offset + 3];
+      }
+      NDL_CHECK(len != 127);
+      if (raw_.size() - offset < header + len) {
+        break;
+      }
+      NDL_CHECK(opcode == 0x2);
+      messages++;
+      header_bytes += header;
+      payload_.insert(payload_.end(), raw_.begin() + offset + header,
+                      raw_.begin() + offset + header + len);
+      offset += header + len;
+    }
+    raw_.erase(raw_.begin(), raw_.begin() + offset);
+    ParseFrames(payload_, on_frame);
+  }
+
+  size_t wire_bytes = 0;
+  size_t header_bytes = 0;
+  size_t messages = 0;
+
+ private:
+  int sock_ = -1;
+  std::vector<uint8_t> raw_;
+  std::vector<uint8_t> payload_;
+};
+
+/**
+ * @brief 反复握手直到得到期望的状态码 / Handshake until the expected
+ *        status comes back
+ */
+static bool WaitStatus(WsClient &ws, const std::string &target, int status) {
+  uint64_t deadline = NowMs() + 5000;
+  while (NowMs() < deadline) {
+    if (ws.Open(target) == status) {
+      return true;
+    }
+    ws.Close();
+    LibXR::Thread::Sleep(50);
+  }
+  return false;
+}
+
+static void SetToken(TestHost &host, const uint8_t *token) {
+  Command cmd{};
+  cmd.type = Command::Type::CONFIG_WS_TOKEN;
+  if (token != nullptr) {
+    memcpy(cmd.data.ws_token.token, token, sizeof(cmd.data.ws_token.token));
+  }
+  host.SendCommand(cmd);
+}
+
+int main() {
+  TestHost host;
+  auto dev = StartAttached(host, 8192);
+
+  // 没有令牌与数据面密钥时不鉴权 / No authentication without a token or a
+  // data plane key
+  WsClient ws;
+  NDL_CHECK(WaitStatus(ws, "/", 101));
+
+  uint32_t uart2_key = TestHost::Key("uart2");
+  std::vector<uint8_t> tcp_data, ws_data, tcp_pending;
+  size_t tcp_wire = 0;
+  // 用 PollRaw 同时统计线上字节并自己解帧 / PollRaw counts the wire bytes
+  // while the frames are parsed here
+  auto poll_both = [&]() {
+    NDL_CHECK(host.PollRaw(1, [&](const uint8_t *buf, size_t len) {
+      tcp_wire += len;
+      tcp_pending.insert(tcp_pending.end(), buf, buf + len);
+    }));
+    ParseFrames(tcp_pending, [&](uint32_t key, const uint8_t *data,
+                                 size_t size) {
+      if (key == uart2_key) {
+        tcp_data.insert(tcp_data.end(), data, data + size);
+      }
+    });
+    ws.Poll(0, [&](uint32_t key, const uint8_t *data, size_t size) {
+      if (key == uart2_key) {
+        ws_data.insert(ws_data.end(), data, data + size);
+      }
+    });
+  };
+
+  std::vector<uint8_t> chunk(CHUNK_BYTES);
+  size_t written = 0;
+  uint64_t next_chunk_ms = NowMs();
+  while (written < STREAM_BYTES) {
+    if (NowMs() >= next_chunk_ms) {
+      FillPattern(chunk, written, CountPattern);
+      WriteAll(dev.uart2, chunk.data(), chunk.size());
+      written += CHUNK_BYTES;
+      next_chunk_ms += CHUNK_GAP_MS;
+    }
+    poll_both();
+  }
+  uint64_t deadline = NowMs() + 3000;
+  while ((tcp_data.size() < written || ws_data.size() < written) &&
+         NowMs() < deadline) {
+    poll_both();
+  }
+
+  size_t ws_wire = ws.wire_bytes;
+  printf("payload %zu bytes\n", written);
+  printf("tcp: %zu wire bytes, overhead %.2f%%\n", tcp_wire,
+         100.0 * (tcp_wire - written) / written);
+  printf("websocket: %zu wire bytes in %zu messages, %zu header bytes, "
+         "overhead %.2f%% (+%.2f%% over tcp)\n",
+         ws_wire, ws.messages, ws.header_bytes,
+         100.0 * (ws_wire - written) / written,
+         100.0 * ws.header_bytes / written);
+
+  NDL_CHECK(tcp_data.size() == written);
+  NDL_CHECK(ws_data.size() == written);
+  for (size_t i = 0; i < written; i++) {
+    NDL_CHECK(tcp_data[i] == CountPattern(i));
+    NDL_CHECK(ws_data[i] == CountPattern(i));
+  }
+  // "/" 上的每条消息就是一个 TCP 批次，只多出消息头
+  // Every message on "/" is one TCP batch, with only the header added
+  NDL_CHECK(ws.header_bytes <= 4 * ws.messages);
+  size_t ws_body = ws_wire - ws.header_bytes;
+  NDL_CHECK(ws_body + WIRE_SLACK >= tcp_wire &&
+            ws_body <= tcp_wire + WIRE_SLACK);
+  ws.Close();
+
+  // 设置令牌后开启鉴权 / Setting a token turns authentication on
+  const uint8_t token[16] = {0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef,
+                             0xfe, 0xdc, 0xba, 0x98, 0x76, 0x54, 0x32, 0x10};
+  SetToken(host, token);
+  NDL_CHECK(WaitStatus(ws, "/", 403));
+  NDL_CHECK(ws.Open("/?token=00000000000000000000000000000000") == 403);
+  NDL_CHECK(WaitStatus(ws, "/?token=0123456789ABCDEFFEDCBA9876543210", 101));
+  ws.Close();
+
+  // 清除后恢复开放 / Clearing it opens the endpoint again
+  SetToken(host, nullptr);
+  NDL_CHECK(WaitStatus(ws, "/port/2", 101));
+
+  printf("PASS\n");
+  Finish(0);
+}
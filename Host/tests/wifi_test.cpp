@@ -0,0 +1,82 @@
+#include "test_device.hpp"
+
+// 先由主机主动断开再重连，reconnect_ms 必须保持为 0；再模拟 WiFi 断线，设备
+// 必须通过 WifiClient 重新连接，reconnect_ms 至少包含一次关联耗时，且重连
+// 必须把缓存的 AP BSSID 与信道交给驱动
+// Disconnect from the host side and attach again: reconnect_ms must stay 0.
+// Then drop the simulated WiFi link: the device must reconnect through the
+// WifiClient and reconnect_ms must cover at least one association. The
+// reconnect must hand the cached BSSID and channel of the AP to the driver
+
+using namespace NetDebugLinkTest;
+using Command = NetDebugLink::Command;
+
+static constexpr uint32_t CONNECT_DELAY_MS = 300;
+
+/**
+ * @brief 应答设备心跳，直到收到一次链路统计 / Answer device pings until a
+ *        link stats report arrives
+ */
+static Command WaitLinkStats(TestHost &host, uint32_t timeout_ms) {
+  uint32_t command_key = TestHost::Key("command");
+  uint64_t deadline = NowMs() + timeout_ms;
+  bool found = false;
+  Command stats{};
+  while (!found && NowMs() < deadline) {
+    NDL_CHECK(host.Poll(50, [&](uint32_t key, const uint8_t *data,
+                                size_t size) {
+      Command cmd;
+      if (found || key != command_key || size != sizeof(cmd)) {
+        return;
+      }
+      memcpy(&cmd, data, sizeof(cmd));
+      if (cmd.type == Command::Type::PING && cmd.data.ping.t3 == 0) {
+        cmd.data.ping.t2 = LibXR::Timebase::GetMicroseconds();
+        cmd.data.ping.t3 = LibXR::Timebase::GetMicroseconds();
+        host.SendCommand(cmd);
+      } else if (cmd.type == Command::Type::LINK_STATS) {
+        stats = cmd;
+        found = true;
+      }
+    }));
+  }
+  NDL_CHECK(found);
+  return stats;
+}
+
+int main() {
+  auto dev = StartDevice();
+  dev.wifi->connect_delay_ms_ = CONNECT_DELAY_MS;
+  TestHost host;
+  NDL_CHECK(host.Attach(ATTACH_TIMEOUT_MS));
+
+  // 主机断开不算链路故障 / A host disconnect is not a link loss
+  host.Detach();
+  NDL_CHECK(host.Attach(ATTACH_TIMEOUT_MS));
+  auto stats = WaitLinkStats(host, 30000).data.link_stats;
+  printf("after host disconnect: reconnect %u ms\n", stats.reconnect_ms);
+  NDL_CHECK(stats.reconnect_ms == 0);
+  NDL_CHECK(dev.wifi->connect_count_ == 0);
+
+  // WiFi 断线后设备关闭连接并自行重连 / After a WiFi loss the device drops
+  // the connection and reconnects on its own
+  dev.wifi->DropLink();
+  uint64_t deadline = NowMs() + 5000;
+  while (host.Poll(50, [](uint32_t, const uint8_t *, size_t) {})) {
+    NDL_CHECK(NowMs() < deadline);
+  }
+  host.Detach();
+  NDL_CHECK(host.Attach(ATTACH_TIMEOUT_MS));
+  NDL_CHECK(dev.wifi->connect_count_ > 0);
+  NDL_CHECK(dev.wifi->last_bssid_set_);
+  NDL_CHECK(memcmp(dev.wifi->last_bssid_, dev.wifi->ap_bssid_,
+                   sizeof(dev.wifi->ap_bssid_)) == 0);
+  NDL_CHECK(dev.wifi->last_channel_ == dev.wifi->ap_channel_);
+  stats = WaitLinkStats(host, 30000).data.link_stats;
+  printf("after WiFi loss: %u connects, reconnect %u ms\n",
+         dev.wifi->connect_count_.load(), stats.reconnect_ms);
+  NDL_CHECK(stats.reconnect_ms >= CONNECT_DELAY_MS);
+
+  printf("PASS\n");
+  Finish(0);
+}
@@ -5,9 +5,14 @@
 #include "esp_event.h"
 #include "esp_log.h"
 #include "esp_netif.h"
+#include "esp_partition.h"
+#include "esp_pm.h"
+#include "esp_random.h"
 #include "esp_smartconfig.h"
 #include "esp_system.h"
 #include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 extern "C" {
 #include "blufi_user.h"
 }
@@ -16,62 +21,68 @@ EventGroupHandle_t s_wifi_event_group;
 
 void NetDebugLink::BlufiInit() { s_wifi_event_group = xEventGroupCreate(); }
 
-void NetDebugLink::PeripheralInit() {
-  void (*led_task_fun)(NetDebugLink *) = [](NetDebugLink *self) {
-    static Mode mode = Mode::Init;
-    if (mode == self->mode_) {
-      return;
-    }
+void NetDebugLink::PowerSaveInit() {
+#if CONFIG_PM_ENABLE
+  // 空闲时自动降频并进入 light sleep / Scale down and light-sleep when idle
+  esp_pm_config_t pm_config = {.max_freq_mhz = 160,
+                               .min_freq_mhz = 40,
+                               .light_sleep_enable = true};
+  esp_pm_configure(&pm_config);
+#endif
+  esp_wifi_set_ps(WIFI_PS_MIN_MODEM);
+}
 
-    static const char *modes[] = {"Init", "SMART_CONFIG", "SCANING",
-                                  "CONNECTED"};
-    UNUSED(modes);
-    XR_LOG_DEBUG("Mode: %s", modes[(int)self->mode_]);
-    switch (self->mode_) {
-      case Mode::Init:
-      case Mode::SMART_CONFIG:
-        self->led_->SetConfig({.frequency = 10});
-        self->led_->SetDutyCycle(0.5f);
-        break;
-      case Mode::SCANING:
-        self->led_->SetConfig({.frequency = 4});
-        self->led_->SetDutyCycle(0.75f);
-        break;
-      case Mode::CONNECTED:
-        self->led_->SetConfig({.frequency = 2});
-        self->led_->SetDutyCycle(0.25f);
-        break;
-    }
-    mode = self->mode_;
-  };
+uint32_t NetDebugLink::StackHeadroom() {
+  return uxTaskGetStackHighWaterMark(nullptr) * sizeof(StackType_t);
+}
 
-  auto led_task = LibXR::Timer::CreateTask(led_task_fun, this, 50);
-  LibXR::Timer::Add(led_task);
-  LibXR::Timer::Start(led_task);
+// WiFi 开启后 esp_fill_random 来自硬件熵源 / With WiFi on, esp_fill_random
+// draws from the hardware entropy source
+void NetDebugLink::FillRandom(uint8_t *buf, size_t len) {
+  esp_fill_random(buf, len);
+}
 
-  void (*cb_fun)(bool, NetDebugLink *) = [](bool in_isr, NetDebugLink *self) {
-    self->OnButton();
-  };
+/**
+ * @brief 基于数据分区的离线存储后端 / Capture backend on a data partition
+ */
+class PartitionCaptureFlash : public CaptureFlash {
+ public:
+  explicit PartitionCaptureFlash(const esp_partition_t *partition)
+      : partition_(partition) {}
 
-  auto cb = LibXR::GPIO::Callback::Create(cb_fun, this);
-  button_->RegisterCallback(cb);
+  size_t Size() const override { return partition_->size; }
 
-  button_->SetConfig({.direction = LibXR::GPIO::Direction::FALL_INTERRUPT,
-                      .pull = LibXR::GPIO::Pull::UP});
+  ErrorCode Erase(size_t offset, size_t size) override {
+    return esp_partition_erase_range(partition_, offset, size) == ESP_OK
+               ? ErrorCode::OK
+               : ErrorCode::FAILED;
+  }
 
-  button_->EnableInterrupt();
+  ErrorCode Write(size_t offset, const void *data, size_t size) override {
+    return esp_partition_write(partition_, offset, data, size) == ESP_OK
+               ? ErrorCode::OK
+               : ErrorCode::FAILED;
+  }
 
-  wifi_->Enable();
+  ErrorCode Read(size_t offset, void *data, size_t size) override {
+    return esp_partition_read(partition_, offset, data, size) == ESP_OK
+               ? ErrorCode::OK
+               : ErrorCode::FAILED;
+  }
 
-  auto mac = wifi_->GetMACAddress();
-  LibXR::MACAddressStr mac_str = LibXR::MACAddressStr::FromRaw(mac);
-  XR_LOG_INFO("MAC address: %s", mac_str);
+ private:
+  const esp_partition_t *partition_;
+};
 
-  if (!wifi_->IsConnected()) {
-    smartconfig_requested_ = true;
-  } else {
-    mode_ = Mode::SCANING;
+CaptureFlash *NetDebugLink::OpenCaptureFlash() {
+  auto partition = esp_partition_find_first(
+      ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "capture");
+  if (partition == nullptr) {
+    XR_LOG_INFO("No capture partition, offline capture disabled");
+    return nullptr;
   }
+  static PartitionCaptureFlash flash(partition);
+  return &flash;
 }
 
 void BlufiEventCallback(esp_blufi_cb_event_t event,
@@ -111,6 +122,12 @@ void BlufiEventCallback(esp_blufi_cb_event_t event,
 
     case ESP_BLUFI_EVENT_REQ_CONNECT_TO_AP: {
       XR_LOG_INFO("BLUFI requests connect to AP");
+      // 配网协商密钥此时仍有效，据此派生数据面密钥
+      // The negotiated PSK is still alive here; derive the data key from it
+      uint8_t psk[16];
+      if (blufi_security_get_psk(psk, sizeof(psk)) > 0) {
+        self->SetDataKey(psk, sizeof(psk));
+      }
       xEventGroupSetBits(s_wifi_event_group, NetDebugLink::GOT_CREDENTIAL_BIT);
       break;
     }
@@ -144,7 +161,10 @@ void BlufiEventCallback(esp_blufi_cb_event_t event,
   }
 }
 
-ErrorCode NetDebugLink::StartBlufiBlocking(uint32_t timeout_ms) {
+static TickType_t s_blufi_start;
+static bool s_blufi_associating;
+
+void NetDebugLink::BlufiStart() {
   XR_LOG_INFO("Starting BLUFI...");
 
   wifi_->Disconnect();
@@ -157,45 +177,112 @@ ErrorCode NetDebugLink::StartBlufiBlocking(uint32_t timeout_ms) {
       .checksum_func = blufi_crc_checksum,
   };
 
+  xEventGroupClearBits(s_wifi_event_group, GOT_CREDENTIAL_BIT);
   ESP_ERROR_CHECK(esp_blufi_controller_init());
   ESP_ERROR_CHECK(esp_blufi_host_and_cb_init(&cbs));
 
-  TickType_t start = xTaskGetTickCount();
-  TickType_t timeout_ticks = pdMS_TO_TICKS(timeout_ms);
+  s_blufi_start = xTaskGetTickCount();
+  s_blufi_associating = false;
 
   XR_LOG_INFO("Waiting for credentials...");
+}
 
-  while (true) {
-    EventBits_t bits =
-        xEventGroupWaitBits(s_wifi_event_group, GOT_CREDENTIAL_BIT, pdTRUE,
-                            pdFALSE, pdMS_TO_TICKS(500));
-
-    if (bits & GOT_CREDENTIAL_BIT) {
-      XR_LOG_INFO("Received WiFi SSID: %s", sta_cfg_.ssid);
-      XR_LOG_INFO("Received WiFi PASS: %s", sta_cfg_.password);
-      esp_blufi_disconnect();
-      wifi_->Connect(sta_cfg_);
-      esp_blufi_host_deinit();
-      esp_blufi_controller_deinit();
-
+ErrorCode NetDebugLink::BlufiPoll(uint32_t timeout_ms) {
+  // 收到凭据后只发起关联，之后每次轮询检查结果，不阻塞网络线程
+  // Once credentials arrive only start associating, then check on every
+  // poll without blocking the network thread
+  if (s_blufi_associating) {
+    if (wifi_->IsConnected()) {
+      s_blufi_associating = false;
       static LibXR::Topic::PackedData<LibXR::WifiClient::Config> buf;
-      if (wifi_->IsConnected()) {
-        LibXR::Topic::PackData(
-            LibXR::Topic::TopicHandle(wifi_config_topic_)->data_.crc32, buf,
-            sta_cfg_);
-        to_cdc_data_queue_mutex_.Lock();
-        to_cdc_data_queue_.PushBatch(&buf, sizeof(buf));
-        to_cdc_data_queue_mutex_.Unlock();
-      }
+      LibXR::Topic::PackData(
+          LibXR::Topic::TopicHandle(wifi_config_topic_)->data_.crc32, buf,
+          sta_cfg_);
+      to_cdc_data_queue_mutex_.Lock();
+      to_cdc_data_queue_.PushBatch(&buf, sizeof(buf));
+      to_cdc_data_queue_mutex_.Unlock();
       return ErrorCode::OK;
     }
+    if ((xTaskGetTickCount() - s_blufi_start) >
+        pdMS_TO_TICKS(RECONNECT_ATTEMPT_MS)) {
+      s_blufi_associating = false;
+      return ErrorCode::FAILED;
+    }
+    return ErrorCode::BUSY;
+  }
 
-    if ((xTaskGetTickCount() - start) > timeout_ticks) {
-      XR_LOG_WARN("BLUFI credential timeout.");
-      esp_blufi_disconnect();
-      esp_blufi_host_deinit();
-      esp_blufi_controller_deinit();
-      return ErrorCode::TIMEOUT;
+  EventBits_t bits = xEventGroupClearBits(s_wifi_event_group,
+                                          GOT_CREDENTIAL_BIT);
+
+  if (bits & GOT_CREDENTIAL_BIT) {
+    XR_LOG_INFO("Received WiFi SSID: %s", sta_cfg_.ssid);
+    esp_blufi_disconnect();
+    esp_blufi_host_deinit();
+    esp_blufi_controller_deinit();
+
+    KnownAp ap{};
+    strncpy(ap.ssid, reinterpret_cast<const char *>(sta_cfg_.ssid),
+            sizeof(ap.ssid) - 1);
+    strncpy(ap.password, reinterpret_cast<const char *>(sta_cfg_.password),
+            sizeof(ap.password) - 1);
+    if (FastConnect(ap) != ErrorCode::OK) {
+      return ErrorCode::FAILED;
     }
+    s_blufi_associating = true;
+    s_blufi_start = xTaskGetTickCount();
+    return ErrorCode::BUSY;
+  }
+
+  if ((xTaskGetTickCount() - s_blufi_start) > pdMS_TO_TICKS(timeout_ms)) {
+    XR_LOG_WARN("BLUFI credential timeout.");
+    esp_blufi_disconnect();
+    esp_blufi_host_deinit();
+    esp_blufi_controller_deinit();
+    return ErrorCode::TIMEOUT;
   }
+
+  return ErrorCode::BUSY;
+}
+
+// 直接设置 STA 配置后 esp_wifi_connect 立即返回，关联结果由 IsConnected
+// 反映；有缓存的 BSSID 与信道时只在该信道上找这一个 AP
+// esp_wifi_connect returns at once after the STA config is set, and
+// IsConnected reflects the outcome; with a cached BSSID and channel only
+// that AP is looked for, on that channel only
+ErrorCode NetDebugLink::FastConnect(const KnownAp &ap) {
+  wifi_config_t cfg = {};
+  strncpy(reinterpret_cast<char *>(cfg.sta.ssid), ap.ssid,
+          sizeof(cfg.sta.ssid));
+  strncpy(reinterpret_cast<char *>(cfg.sta.password), ap.password,
+          sizeof(cfg.sta.password));
+  if (ap.channel != 0) {
+    memcpy(cfg.sta.bssid, ap.bssid, sizeof(cfg.sta.bssid));
+    cfg.sta.bssid_set = true;
+    cfg.sta.channel = ap.channel;
+    cfg.sta.scan_method = WIFI_FAST_SCAN;
+  }
+
+  esp_wifi_disconnect();
+  if (esp_wifi_set_config(WIFI_IF_STA, &cfg) != ESP_OK ||
+      esp_wifi_connect() != ESP_OK) {
+    return ErrorCode::FAILED;
+  }
+  return ErrorCode::OK;
+}
+
+bool NetDebugLink::QueryApInfo(KnownAp &ap) {
+  wifi_config_t cfg = {};
+  wifi_ap_record_t info = {};
+  if (esp_wifi_get_config(WIFI_IF_STA, &cfg) != ESP_OK ||
+      esp_wifi_sta_get_ap_info(&info) != ESP_OK) {
+    return false;
+  }
+
+  memcpy(ap.ssid, info.ssid, sizeof(info.ssid));
+  ap.ssid[sizeof(ap.ssid) - 1] = '\0';
+  memcpy(ap.password, cfg.sta.password, sizeof(cfg.sta.password));
+  ap.password[sizeof(ap.password) - 1] = '\0';
+  memcpy(ap.bssid, info.bssid, sizeof(ap.bssid));
+  ap.channel = info.primary;
+  return true;
 }
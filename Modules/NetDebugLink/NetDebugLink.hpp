@@ -9,6 +9,7 @@ constructor_args:
   - tcp_port: 5000                # TCP 端口 / TCP port
   - udp_port: 5001                # UDP 端口 / UDP port
   - thread_stack_size: 8192
+  - rx_stack_size: 16384
   - usb: uart_cdc
   - uarts:
     - UART0
@@ -22,15 +23,37 @@ repository: https://github.com/xrobot-org/NetDebugLink
 === END MANIFEST === */
 // clang-format on
 
+#if defined(ESP_PLATFORM)
 #include <lwip/sockets.h>
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
 
 #include "app_framework.hpp"
+#include "capture_store.hpp"
+#include "data_cipher.hpp"
 #include "gpio.hpp"
 #include "libxr.hpp"
 #include "logger.hpp"
 #include "net/wifi_client.hpp"
+#include "net_transport.hpp"
+#include "packet_framer.hpp"
 #include "pwm.hpp"
+#include "self_test.hpp"
+#include "slip_flasher.hpp"
+#include "trace_ring.hpp"
 #include "uart.hpp"
+#include "websocket_server.hpp"
 
 class NetDebugLink : public LibXR::Application {
 public:
@@ -44,33 +67,457 @@ public:
       REBOOT = 2,
       RENAME = 3,
       CONFIG_UART = 4,
+      CONFIG_ROUTE = 5,
+      CONFIG_SCHED = 6,
+      LINK_STATS = 7,
+      SELF_TEST = 8,
+      SELF_TEST_REPORT = 9,
+      FLASH_BEGIN = 10,
+      FLASH_STATUS = 11,
+      CONFIG_UART_BATCH = 12,
+      CONFIG_ACK = 13,
+      POWER_STATS = 14,
+      CONFIG_CIPHER = 15,
+      FRAMING = 16,
+      FLOW_CONTROL = 17,
+      TRACE = 18,
+      TAP = 19,
+      TASK_STATS = 20,
+      CONFIG_WS_TOKEN = 21,
+    };
+
+    struct UartConfig {
+      uint8_t uart_index;
+      LibXR::UART::Configuration uart_config;
+      PacketFramer::Config framing; // 全零为 RAW / all zero means RAW
     };
 
+    static constexpr uint8_t MAX_BATCH_SIZE = 4;
+
     Type type;
     union {
       char device_name[32];
+      UartConfig uart_config;
+      struct {
+        uint8_t seq;
+        uint8_t count;
+        UartConfig entries[MAX_BATCH_SIZE];
+      } uart_batch;
+      struct {
+        uint8_t seq;
+        int8_t status; // ErrorCode
+      } config_ack;
+      struct {
+        uint16_t wakeups_per_sec;
+        uint16_t duty_permille; // 忙碌时间占比 / busy time, 1/1000
+        uint16_t service_period_ms;
+        uint16_t net_idle_ms;
+        uint16_t cipher_duty_permille; // 加解密时间占比 / cipher time, 1/1000
+        uint32_t cipher_kbps; // 加解密吞吐能力 / cipher capacity, KB/s
+      } power_stats;
+      struct {
+        uint8_t enable; // 下次连接生效 / applies from the next connection
+      } cipher_config;
+      struct {
+        uint8_t version; // FRAMING_V1 / FRAMING_V2
+      } framing;
+      struct {
+        uint8_t uart_index;
+        uint8_t flags;        // FLOW_* 位 / FLOW_* bits
+        uint32_t rx_dropped;  // 上行丢弃字节 / uplink bytes dropped
+        uint32_t tx_dropped;  // 下行丢弃字节 / downlink bytes dropped
+      } flow_control;
+      struct {
+        uint8_t action;  // TRACE_STOP / TRACE_START / TRACE_DUMP
+        uint32_t events; // 回复：待导出事件数 / reply: events to dump
+        uint32_t lost;   // 回复：被覆盖的事件数 / reply: events overwritten
+      } trace;
+      struct {
+        uint8_t port_mask; // bit n: 抓取端口 n 双向数据 / tap port n both ways
+        uint32_t tx_dropped; // 回复：丢弃的下行记录字节 / reply: TX bytes lost
+      } tap;
+      struct {
+        uint16_t rx_stack_free;   // 接收任务栈最低余量 / RX stack low water
+        uint16_t tx_stack_free;   // 发送任务栈最低余量 / TX stack low water
+        uint32_t rx_busy_max_us;  // 最长一次接收处理 / longest RX pass
+        uint32_t tx_flush_max_us; // 批次就绪到发完 / batch ready to sent
+      } task_stats;
+      struct {
+        uint8_t token[16]; // 全零清除 / all zero clears
+      } ws_token;
       struct {
         uint8_t uart_index;
-        LibXR::UART::Configuration uart_config;
-      } uart_config;
+        uint8_t sink_mask; // bit n: 转发到端口 n / forward to port n
+      } route_config;
+      struct {
+        uint8_t uart_index;
+        uint8_t weight;      // 调度权重 / scheduling weight
+        uint16_t latency_ms; // 最大排队时延 / max queueing latency, 0: none
+      } sched_config;
+      struct {
+        uint32_t seq;
+        uint64_t t1; // 发起方发送时间 / originator send time, us
+        uint64_t t2; // 应答方接收时间 / responder receive time, us
+        uint64_t t3; // 应答方发送时间 / responder send time, us
+      } ping;
+      struct {
+        uint32_t rtt_p50_us;
+        uint32_t rtt_p90_us;
+        uint32_t rtt_p99_us;
+        int64_t offset_us; // 主机时钟 - 设备时钟 / host clock - device clock
+        uint16_t keepalive_ms;
+        uint16_t lost;
+        uint32_t reconnect_ms; // 上次断线到恢复传输 / last link loss to streaming
+        uint32_t wire_bytes;    // 本连接发出的字节 / bytes sent this connection
+        uint32_t payload_bytes; // 其中的有效负载 / useful payload among them
+      } link_stats;
+      SelfTest::Config self_test;
+      SelfTest::Result self_test_report;
+      SlipFlasher::Config flash_begin;
+      SlipFlasher::Status flash_status;
     } data;
   };
 
+  /**
+   * @brief 排队字节的到达时间，用于求最旧字节的等待时长 /
+   *        Arrival times of queued bytes, to age the oldest one
+   *
+   * 每个标记覆盖一段同一毫秒到达的字节；标记用完时新字节并入最后一段，因此
+   * 年龄只会被高估，不会被低估。
+   * Each mark covers a run of bytes that arrived in the same millisecond.
+   * Once the marks run out new bytes join the last run, so an age can only be
+   * overestimated, never underestimated.
+   */
+  struct QueueAge {
+    static constexpr uint8_t MARKS = 8;
+
+    struct Mark {
+      uint32_t end;      // 该段之后的累计入队字节 / pushed total after the run
+      uint32_t since_ms; // 该段首字节到达时刻 / arrival of its first byte
+    };
+
+    std::array<Mark, MARKS> marks{};
+    uint8_t head = 0;
+    uint8_t num = 0;
+    uint32_t pushed = 0;
+    uint32_t popped = 0;
+
+    void Push(size_t len, uint32_t now_ms) {
+      pushed += len;
+      if (num > 0) {
+        auto &last = marks[(head + num - 1) % MARKS];
+        if (last.since_ms == now_ms || num == MARKS) {
+          last.end = pushed;
+          return;
+        }
+      }
+      marks[(head + num++) % MARKS] = {pushed, now_ms};
+    }
+
+    void Pop(size_t len) {
+      popped += len;
+      while (num > 0 && static_cast<int32_t>(marks[head].end - popped) <= 0) {
+        head = (head + 1) % MARKS;
+        num--;
+      }
+    }
+
+    /**
+     * @brief 丢弃最新的 len 字节 / Forget the newest len bytes
+     */
+    void DropNewest(size_t len) {
+      pushed -= len;
+      for (auto &mark : marks) {
+        if (static_cast<int32_t>(mark.end - pushed) > 0) {
+          mark.end = pushed;
+        }
+      }
+      Pop(0);
+    }
+
+    uint32_t OldestMs(uint32_t now_ms) const {
+      return num > 0 ? marks[head].since_ms : now_ms;
+    }
+
+    /**
+     * @brief 到达时刻不晚于 deadline_ms 的排队字节数 /
+     *        Queued bytes that arrived no later than deadline_ms
+     */
+    size_t BytesSince(uint32_t deadline_ms) const {
+      uint32_t end = popped;
+      for (uint8_t i = 0; i < num; i++) {
+        auto &mark = marks[(head + i) % MARKS];
+        if (static_cast<int32_t>(mark.since_ms - deadline_ms) > 0) {
+          break;
+        }
+        end = mark.end;
+      }
+      return end - popped;
+    }
+  };
+
   typedef struct {
     LibXR::UART *uart;
     LibXR::Topic topic;
     uint8_t uart_index;
+    uint8_t route_mask;
+    LibXR::UART::Configuration config;
+    LibXR::BaseQueue *net_queue;
+    uint8_t weight;
+    uint16_t latency_ms;
+    uint32_t deficit;
+    QueueAge age;
+    LibXR::GPIO *rts;  // 可选，低电平允许目标发送 / optional, low lets target send
+    LibXR::GPIO *cts;  // 可选，低电平目标可接收 / optional, low: target ready
+    uint8_t flow_flags;
+    uint8_t reported_flags;
+    uint32_t rx_dropped;
+    uint32_t tx_dropped;
+    uint32_t reported_dropped;
+    PacketFramer *framer; // 首次启用分帧时创建 / created on first use
+    LibXR::Mutex *write_mutex; // 串行化该端口的所有写者 / serializes writers
   } UartInfo;
 
+  static constexpr uint8_t MAX_PORT_NUM = 7;
+  static constexpr uint8_t ROUTE_NET = 1 << MAX_PORT_NUM;
+  static constexpr uint32_t SCHED_QUANTUM = 256;
+  static constexpr uint8_t DEFAULT_WEIGHT = 4;
+  static constexpr uint16_t DEFAULT_LATENCY_MS = 50;
+
+  static constexpr LibXR::UART::Configuration DEFAULT_UART_CONFIG = {
+      115200, LibXR::UART::Parity::NO_PARITY, 8, 1};
+  static constexpr uint32_t MAX_BAUDRATE = 5000000;
+  static constexpr size_t NET_QUEUE_BUDGET = 32 * 1024; // 所有端口共享 / shared
+  // 不低于原先共享队列的 4 KB / Never below the former 4 KB shared queue
+  static constexpr size_t NET_QUEUE_MIN_SIZE = 4096;
+  static constexpr uint32_t NET_QUEUE_HOLD_MS = 100; // 需缓冲的断流时长
+  static_assert(NET_QUEUE_MIN_SIZE * MAX_PORT_NUM <= NET_QUEUE_BUDGET);
+  static constexpr uint32_t CONFIG_DRAIN_TIMEOUT_MS = 200;
+  static constexpr uint32_t DOWNLINK_WRITE_TIMEOUT_MS = 20; // 下行等待写空间
+  static constexpr size_t CTS_WRITE_AHEAD = 64; // 有 CTS 时写队列最多积压
+
+  static constexpr uint32_t PING_MIN_MS = 125;
+  static constexpr uint32_t PING_MAX_MS = 1000;
+  static constexpr uint8_t PING_DEGRADED_LOST = 3;
+  static constexpr size_t RTT_WINDOW = 64;
+  static constexpr uint32_t LINK_STATS_PERIOD = 16; // 每 N 次应答上报一次
+
+  static constexpr uint32_t SERVICE_MIN_MS = 2;
+  static constexpr uint32_t SERVICE_MAX_MS = 32;
+  static constexpr uint32_t SERVICE_IDLE_TICKS = 50; // 空闲多少次后退避
+  static constexpr size_t SERVICE_IDLE_BUFFER = 1024; // 退避期间允许积压的字节
+  static constexpr uint32_t NET_IDLE_MAX_MS = 20;
+  static constexpr uint32_t LED_PERIOD_MS = 50;
+  static constexpr uint32_t POWER_STATS_PERIOD_MS = 1000;
+
+  static constexpr uint8_t FLOW_PAUSE = 1 << 0; // 建议暂停下发 / host should hold
+  static constexpr uint8_t FLOW_CTS = 1 << 1;   // 目标 CTS 有效 / target CTS on
+  static constexpr uint8_t FLOW_RTS = 1 << 2;   // 设备 RTS 有效 / device RTS on
+  static constexpr uint8_t FLOW_HAS_RTS = 1 << 3;
+  static constexpr uint8_t FLOW_HAS_CTS = 1 << 4;
+  static constexpr uint32_t FLOW_REPORT_MS = 1000; // 丢弃计数上报间隔
+
+  static constexpr size_t KNOWN_AP_NUM = 3;
+  static constexpr uint32_t WIFI_POLL_MS = 100;
+  static constexpr uint32_t DISCOVERY_TIMEOUT_MS = 200;
+  static constexpr char DISCOVERY_MSG_DEFAULT[] =
+      "XRobot Debug Tools Default Message";
+  static constexpr char DISCOVERY_MSG_FILTERED[] =
+      "XRobot Debug Tools Message Filtered:";
+  static constexpr uint32_t RECONNECT_ATTEMPT_MS = 3000; // 单个 AP 的等待时间
+  static constexpr uint32_t PROVISION_TIMEOUT_MS = 30000;
+  static constexpr uint32_t SESSION_HELLO_TIMEOUT_MS = 3000; // 交换会话随机数
+
+  static constexpr size_t CAPTURE_STAGING = 16384; // 等待写入闪存的数据
+  static constexpr size_t CAPTURE_RECORD_HEADER = 11; // 端口 + 启动计数 + 时间戳
+
+  static constexpr uint16_t WEBSOCKET_PORT_OFFSET = 2; // 相对 tcp_port
+  static constexpr size_t MAX_NET_SEGMENTS = 2 * MAX_PORT_NUM + 2;
+  static constexpr uint8_t SEGMENT_CONTROL = 0xff;
+  static constexpr uint8_t SEGMENT_CAPTURE = 0xfe;
+  static constexpr uint8_t SEGMENT_TRACE = 0xfd;
+  static constexpr uint8_t SEGMENT_TAP = 0xfc;
+
+  static constexpr uint8_t TRACE_STOP = 0;
+  static constexpr uint8_t TRACE_START = 1;
+  static constexpr uint8_t TRACE_DUMP = 2;
+  static constexpr size_t TRACE_CHUNK_EVENTS = 64; // 每帧事件数 / per frame
+
+  static constexpr uint8_t FRAMING_V1 = 1; // 每段一个 Topic 帧 / Topic frames
+  static constexpr uint8_t FRAMING_V2 = 2; // 紧凑超级帧 / compact super-frame
+  static constexpr uint8_t V2_MAGIC = 0xa6;
+  static constexpr size_t V2_HEADER_SIZE = 3;  // 魔数 + 长度 / magic + length
+  static constexpr size_t V2_TRAILER_SIZE = 2; // CRC16
+  static constexpr size_t V2_ENTRY_MAX_HEADER = 3; // 端口 + 2 字节 varint
+
+  /**
+   * @brief 发送批次中的一段：v1 为连续的 Topic 帧，v2 为一个条目 /
+   *        A segment of a batch: a run of Topic frames in v1, one entry in v2
+   */
+  struct NetSegment {
+    uint16_t offset;
+    uint16_t len;
+    uint16_t data_offset; // v2 条目负载 / v2 entry payload
+    uint16_t data_len;
+    uint8_t port; // 端口号或 SEGMENT_* / port index or SEGMENT_*
+  };
+
+  static constexpr size_t NET_BATCH_SIZE = 4096;
+  // 换链路时 v2 条目逐条重新打包为 Topic 帧，最多多出每段一个帧头
+  // Switching links repacks v2 entries into Topic frames, adding at most one
+  // frame header per segment
+  static constexpr size_t NET_HOLD_SIZE =
+      NET_BATCH_SIZE + MAX_NET_SEGMENTS * LibXR::Topic::PACK_BASE_SIZE;
+
+  /**
+   * @brief 正在发送的批次，发完前不组装新批次 /
+   *        Batch in flight; no new batch is built until it is sent
+   */
+  struct PendingBatch {
+    size_t len = 0;      // 明文长度 / plaintext length
+    size_t wire_len = 0; // 线路上的长度，0 表示尚未封装 / 0 until sealed
+    size_t sent = 0;     // 已交给链路的字节 / bytes handed to the link
+    uint8_t framing = FRAMING_V1;
+    uint64_t ready_us = 0; // 批次就绪时刻 / when the batch became ready
+    size_t segment_num = 0;
+    std::array<NetSegment, MAX_NET_SEGMENTS> segments{};
+  };
+
+  /**
+   * @brief 线路开销统计 / Wire overhead accounting
+   *
+   * 有效负载为串口、抓取与离线数据、跟踪事件和命令本身，不含 Topic 帧头、
+   * 离线记录头与 v2 条目头。
+   * Useful payload is UART, tap and capture data, trace events and the
+   * commands themselves, without Topic headers, capture record headers or
+   * v2 entry headers.
+   */
+  struct FramingStats {
+    uint32_t wire_bytes = 0;
+    uint32_t payload_bytes = 0;
+  };
+  using CommandFrame = LibXR::Topic::PackedData<Command>;
+  static constexpr uint32_t CAPTURE_SYNC_MS = 1000;
+
+  /**
+   * @brief 暂存区中每段数据的头部 / Header of each chunk in the staging queue
+   */
+  struct CaptureStage {
+    uint64_t timestamp_us;
+    uint16_t len;
+    uint8_t port;
+  };
+
+  /**
+   * @brief 分帧模式下上行数据中每个包的头部 /
+   *        Header of every packet in the uplink stream in framing mode
+   */
+#pragma pack(push, 1)
+  struct PacketRecord {
+    uint64_t timestamp_us; // 包最后一字节被读出的时刻 / last byte read time
+    uint16_t len;
+  };
+#pragma pack(pop)
+
+  static constexpr size_t TAP_QUEUE_SIZE = 8192;
+  static constexpr uint8_t TAP_RX = 0; // 目标发往设备 / target to device
+  static constexpr uint8_t TAP_TX = 1; // 设备写往目标 / device to target
+
+  /**
+   * @brief 抓取记录头，同时也是 tap Topic 上的线路格式 /
+   *        Tap record header, also the wire format on the tap topic
+   */
+#pragma pack(push, 1)
+  struct TapHeader {
+    uint64_t timestamp_us;
+    uint16_t len;
+    uint8_t port;
+    uint8_t direction; // TAP_RX / TAP_TX
+  };
+#pragma pack(pop)
+
+  // 一条抓取记录打包后必须放得进一个空批次（加密与 v2 开销都算上），否则
+  // 永远取不出来
+  // A packed tap record must fit an empty batch, cipher and v2 overhead
+  // included, or it could never be taken off the queue
+  static constexpr size_t TAP_PAYLOAD_SIZE =
+      NET_BATCH_SIZE - DataCipher::OVERHEAD - V2_HEADER_SIZE -
+      V2_TRAILER_SIZE - V2_ENTRY_MAX_HEADER - LibXR::Topic::PACK_BASE_SIZE;
+  static constexpr size_t TAP_DATA_MAX = TAP_PAYLOAD_SIZE - sizeof(TapHeader);
+
+  enum class WifiState : uint8_t { ONLINE, RECONNECTING, PROVISIONING };
+
+  /**
+   * @brief 已知 AP，记录 BSSID 与信道以跳过扫描 /
+   *        Known AP with BSSID and channel cached to skip scanning
+   *
+   * 注意：密码以明文保存在数据库 known_ap 中，与 WiFi 驱动自身保存的 STA
+   * 配置一样没有加密；能读出闪存的人可以得到最近 3 个 AP 的密码。
+   * Note: passwords are kept in plaintext in the known_ap database key,
+   * just as unencrypted as the STA config the WiFi driver persists itself;
+   * anyone who can read the flash gets the passwords of the last 3 APs.
+   */
+  struct KnownAp {
+    char ssid[33];
+    char password[65];
+    uint8_t bssid[6];
+    uint8_t channel; // 0: 未知，需扫描 / unknown, needs a scan
+  };
+
+  /**
+   * @brief 唤醒次数与忙碌时间统计 / Wakeup and busy time accounting
+   */
+  struct PowerStats {
+    uint32_t wakeups = 0;
+    uint64_t busy_us = 0;
+    uint64_t window_start_us = 0;
+  };
+
+  /**
+   * @brief 收发任务统计，每秒随 TASK_STATS 上报 /
+   *        RX/TX task statistics, reported once a second in TASK_STATS
+   *
+   * 两个任务都会访问，字段均为原子量。
+   * Both tasks touch these, so every field is atomic.
+   */
+  struct TaskStats {
+    std::atomic<uint32_t> rx_stack_free = 0;
+    std::atomic<uint32_t> rx_busy_max_us = 0;
+    std::atomic<uint32_t> tx_flush_max_us = 0;
+    std::atomic<uint32_t> rx_stack_check_ms = 0;
+    std::atomic<uint32_t> window_start_ms = 0;
+  };
+
+  /**
+   * @brief 链路质量统计，由 link_mutex_ 保护 /
+   *        Link health statistics, guarded by link_mutex_
+   */
+  struct LinkHealth {
+    std::array<uint32_t, RTT_WINDOW> rtt_us{};
+    std::array<int64_t, RTT_WINDOW> offset_us{};
+    size_t samples = 0;
+    uint32_t seq = 0;
+    uint32_t acked_seq = 0;
+    uint32_t interval_ms = PING_MIN_MS;
+    uint8_t lost_in_row = 0;
+    uint16_t lost = 0;
+  };
+
   NetDebugLink(LibXR::HardwareContainer &hw, LibXR::ApplicationManager &app,
                uint32_t tcp_port, uint32_t udp_port, uint32_t thread_stack_size,
-               const char *usb,
+               uint32_t rx_stack_size, const char *usb,
                const std::initializer_list<const char *> &uarts)
       : tcp_port_(tcp_port), udp_port_(udp_port),
         uart_cdc_topic_(LibXR::Topic("uart_cdc", 4096)),
         wifi_config_topic_("wifi_config", sizeof(LibXR::WifiClient::Config)),
-        command_topic_("command", sizeof(Command)), to_net_data_queue_(1, 4096),
-        to_cdc_data_queue_(1, 4096), from_net_server_(4096) {
+        command_topic_("command", sizeof(Command)),
+        flash_topic_("flash", 4096), capture_topic_("capture", 4096),
+        trace_topic_("trace", TRACE_CHUNK_EVENTS * sizeof(TraceRing::Event)),
+        tap_topic_("tap", 4096),
+        to_net_ctrl_queue_(1, 1024), to_cdc_data_queue_(1, 4096),
+        capture_queue_(1, CAPTURE_STAGING), tap_queue_(1, TAP_QUEUE_SIZE),
+        from_net_server_(4096),
+        ws_net_server_(4096) {
     instance_ = this;
 
     BlufiInit();
@@ -79,6 +526,7 @@ public:
     button_ = hw.template FindOrExit<LibXR::GPIO>({"button"});
     wifi_ = hw.template FindOrExit<LibXR::WifiClient>({"wifi_client"});
     uart_cdc_ = hw.template FindOrExit<LibXR::UART>({usb});
+    cdc_transport_ = new CdcTransport(uart_cdc_);
     db_ = hw.template FindOrExit<LibXR::Database>({"database"});
     static constexpr std::array<char, 32> default_device_name = {
         "XRobot NetDebugLink ESP32-C3"};
@@ -87,49 +535,102 @@ public:
 
     XR_LOG_INFO("Device name: %s", &(device_name_key_->data_[0]));
 
+    std::array<uint8_t, MAX_PORT_NUM> default_route;
+    default_route.fill(ROUTE_NET);
+    route_key_ = new LibXR::Database::Key<std::array<uint8_t, MAX_PORT_NUM>>(
+        *db_, "route", default_route);
+
+    data_key_ =
+        new LibXR::Database::Key<std::array<uint8_t, DataCipher::KEY_SIZE>>(
+            *db_, "data_key", std::array<uint8_t, DataCipher::KEY_SIZE>{});
+    cipher_enable_key_ =
+        new LibXR::Database::Key<uint8_t>(*db_, "cipher", uint8_t(0));
+    ws_token_db_ = new LibXR::Database::Key<
+        std::array<uint8_t, WebSocketServer::TOKEN_SIZE>>(
+        *db_, "ws_token", std::array<uint8_t, WebSocketServer::TOKEN_SIZE>{});
+
+    known_ap_key_ =
+        new LibXR::Database::Key<std::array<KnownAp, KNOWN_AP_NUM>>(
+            *db_, "known_ap", std::array<KnownAp, KNOWN_AP_NUM>{});
+
     void (*from_net_data_cb_fun)(
         bool in_isr, LibXR::Topic::TopicHandle tp,
         LibXR::RawData &data) = [](bool in_isr, LibXR::Topic::TopicHandle tp,
                                    LibXR::RawData &data) {
       auto foreach_fun = [&](UartInfo &info) {
         XR_LOG_DEBUG("uart topic recv data");
-        if (info.topic.GetKey() == instance_->uart_cdc_topic_.GetKey()) {
-          LibXR::Mutex::LockGuard guard(instance_->to_cdc_data_queue_mutex_);
-          instance_->to_cdc_data_queue_.PushBatch(data.addr_, data.size_);
+        if (info.topic.GetKey() != tp->data_.crc32) {
+          return ErrorCode::OK;
+        }
+        TraceScope trace(instance_->trace_, instance_->downlink_task_,
+                         TraceRing::Stage::NET_WRITE_CB, info.uart_index,
+                         data.size_);
+
+        // 主机回显的自测数据 / Self-test pattern echoed by the host
+        if (instance_->self_test_.Match(info.uart_index) &&
+            instance_->self_test_.GetConfig().target ==
+                SelfTest::Target::NET) {
+          instance_->self_test_.Check(static_cast<uint8_t *>(data.addr_),
+                                      data.size_,
+                                      LibXR::Timebase::GetMicroseconds());
           return ErrorCode::FAILED;
         }
 
-        if (info.topic.GetKey() == tp->data_.crc32) {
-          LibXR::WriteOperation write_op(instance_->write_sem_, 20);
-          info.uart->Write(data, write_op);
-          return ErrorCode::FAILED;
+        if (instance_->Tapped(info)) {
+          instance_->PushTap(info, TAP_TX, data);
         }
-        return ErrorCode::OK;
+
+        if (info.uart == instance_->uart_cdc_) {
+          LibXR::Mutex::LockGuard guard(instance_->to_cdc_data_queue_mutex_);
+          if (instance_->to_cdc_data_queue_.PushBatch(data.addr_, data.size_) !=
+              ErrorCode::OK) {
+            info.tx_dropped += data.size_;
+          }
+        } else {
+          TraceScope write_trace(instance_->trace_, instance_->downlink_task_,
+                                 TraceRing::Stage::UART_WRITE, info.uart_index,
+                                 data.size_);
+          instance_->WriteDownlink(info, data);
+        }
+        return ErrorCode::FAILED;
       };
 
       instance_->uarts_.Foreach<UartInfo>(foreach_fun);
     };
 
     auto cdc_node = new LibXR::LockFreeList::Node<UartInfo>(
-        {uart_cdc_, uart_cdc_topic_, 0});
+        {uart_cdc_, uart_cdc_topic_, 0, route_key_->data_[0],
+         DEFAULT_UART_CONFIG,
+         nullptr, DEFAULT_WEIGHT, DEFAULT_LATENCY_MS});
+    cdc_node->data_.write_mutex = new LibXR::Mutex();
     from_net_server_.Register(cdc_node->data_.topic);
+    ws_net_server_.Register(cdc_node->data_.topic);
     auto from_net_data_cb_cdc = LibXR::Topic::Callback::Create(
         from_net_data_cb_fun, LibXR::Topic::TopicHandle(cdc_node->data_.topic));
     cdc_node->data_.topic.RegisterCallback(from_net_data_cb_cdc);
     uarts_.Add(*cdc_node);
+    ports_[port_num_++] = &cdc_node->data_;
 
     uint8_t uart_index = 1;
 
+    ASSERT(uarts.size() < MAX_PORT_NUM);
+
     for (auto uart_name : uarts) {
       auto node = new LibXR::LockFreeList::Node<UartInfo>(
           {hw.template FindOrExit<LibXR::UART>({uart_name}),
-           LibXR::Topic(uart_name, 4096), uart_index});
+           LibXR::Topic(uart_name, 4096), uart_index,
+           route_key_->data_[uart_index], DEFAULT_UART_CONFIG, nullptr,
+           DEFAULT_WEIGHT, DEFAULT_LATENCY_MS});
+      node->data_.write_mutex = new LibXR::Mutex();
       uart_index++;
+      FindFlowPins(hw, uart_name, node->data_);
       from_net_server_.Register(node->data_.topic);
+      ws_net_server_.Register(node->data_.topic);
       auto from_net_data_cb = LibXR::Topic::Callback::Create(
           from_net_data_cb_fun, LibXR::Topic::TopicHandle(node->data_.topic));
       node->data_.topic.RegisterCallback(from_net_data_cb);
       uarts_.Add(*node);
+      ports_[port_num_++] = &node->data_;
     }
 
     void (*commnd_topic_cb_fun)(
@@ -139,9 +640,18 @@ public:
       Command *cmd = reinterpret_cast<Command *>(data.addr_);
       switch (cmd->type) {
       case Command::Type::PING:
+        // 主机对设备心跳的应答 / Host reply to a device ping
+        if (cmd->data.ping.t3 != 0) {
+          self->OnPong(*cmd, LibXR::Timebase::GetMicroseconds());
+        }
         break;
-      case Command::Type::REMOTE_PING:
+      case Command::Type::REMOTE_PING: {
+        Command reply = *cmd;
+        reply.data.ping.t2 = LibXR::Timebase::GetMicroseconds();
+        reply.data.ping.t3 = LibXR::Timebase::GetMicroseconds();
+        self->PushCommand(reply);
         break;
+      }
       case Command::Type::REBOOT:
         break;
       case Command::Type::RENAME:
@@ -150,13 +660,140 @@ public:
         self->device_name_key_->Set(self->device_name_key_->data_);
         XR_LOG_INFO("Device name changed: %s", self->device_name_key_->data_);
         break;
-      case Command::Type::CONFIG_UART: {
+      case Command::Type::CONFIG_UART:
+        self->RequestUartConfig(0, &cmd->data.uart_config, 1);
+        break;
+      case Command::Type::CONFIG_UART_BATCH:
+        self->RequestUartConfig(
+            cmd->data.uart_batch.seq, cmd->data.uart_batch.entries,
+            LibXR::min(cmd->data.uart_batch.count, Command::MAX_BATCH_SIZE));
+        break;
+      case Command::Type::CONFIG_SCHED: {
+        auto index = cmd->data.sched_config.uart_index;
+        if (index >= self->port_num_) {
+          break;
+        }
+        LibXR::Mutex::LockGuard guard(self->to_net_data_queue_mutex_);
+        auto port = self->ports_[index];
+        port->weight = LibXR::max<uint8_t>(cmd->data.sched_config.weight, 1);
+        port->latency_ms = cmd->data.sched_config.latency_ms;
+        XR_LOG_INFO("Port %d weight %d latency %d ms", index, port->weight,
+                    port->latency_ms);
+        break;
+      }
+      case Command::Type::SELF_TEST:
+        if (cmd->data.self_test.uart_index >= self->port_num_ ||
+            cmd->data.self_test.rate == 0) {
+          break;
+        }
+        // 上行中的自测数据不是记录，分帧或被抓取的端口会被误解析
+        // Uplink pattern bytes are not records, and a framed or tapped port
+        // would misparse them
+        if (cmd->data.self_test.target == SelfTest::Target::NET &&
+            !self->SelfTestFitsNet(
+                *self->ports_[cmd->data.self_test.uart_index])) {
+          XR_LOG_WARN("Self test refused: port %d is framed or tapped",
+                      cmd->data.self_test.uart_index);
+          break;
+        }
+        XR_LOG_INFO("Self test on port %d: %d B/s for %d ms",
+                    cmd->data.self_test.uart_index, cmd->data.self_test.rate,
+                    cmd->data.self_test.duration_ms);
+        self->self_test_.Start(cmd->data.self_test,
+                               LibXR::Timebase::GetMicroseconds());
+        break;
+      case Command::Type::FLASH_BEGIN: {
+        auto &config = cmd->data.flash_begin;
+        if (config.uart_index == 0 || config.uart_index >= self->port_num_ ||
+            config.baudrate > MAX_BAUDRATE) {
+          break;
+        }
+        auto ans = self->flasher_.Start(
+            config, self->ports_[config.uart_index]->uart,
+            self->route_write_sem_, LibXR::Timebase::GetMilliseconds());
+        XR_LOG_INFO("Flashing port %d: %d bytes at 0x%x, %d",
+                    config.uart_index, config.compressed_size, config.offset,
+                    ans);
+        UNUSED(ans);
+        break;
+      }
+      case Command::Type::LINK_STATS:
+      case Command::Type::SELF_TEST_REPORT:
+      case Command::Type::FLASH_STATUS:
+      case Command::Type::CONFIG_ACK:
+      case Command::Type::POWER_STATS:
+      case Command::Type::FLOW_CONTROL:
+      case Command::Type::TASK_STATS:
+        break;
+      case Command::Type::TAP: {
+        self->tap_mask_ = cmd->data.tap.port_mask;
+        Command ans{};
+        ans.type = Command::Type::TAP;
+        ans.data.tap.port_mask = cmd->data.tap.port_mask;
+        ans.data.tap.tx_dropped = self->tap_dropped_;
+        self->PushCommand(ans);
+        XR_LOG_INFO("Tap ports 0x%02x", cmd->data.tap.port_mask);
+        break;
+      }
+      case Command::Type::TRACE: {
+        Command ans{};
+        ans.type = Command::Type::TRACE;
+        ans.data.trace.action = cmd->data.trace.action;
+        ans.data.trace.lost = self->trace_.Lost();
+        if (!TraceRing::COMPILED) {
+          XR_LOG_WARN("Tracing compiled out");
+        } else if (cmd->data.trace.action == TRACE_DUMP) {
+          ans.data.trace.events = self->trace_.BeginDump();
+        } else if (!self->trace_.Dumping()) {
+          self->trace_.SetEnabled(cmd->data.trace.action == TRACE_START);
+        }
+        self->PushCommand(ans);
+        break;
+      }
+      case Command::Type::CONFIG_CIPHER:
+        if (cmd->data.cipher_config.enable && !self->HasDataKey()) {
+          XR_LOG_WARN("No data key provisioned, cipher stays disabled");
+          break;
+        }
+        self->cipher_enable_key_->Set(cmd->data.cipher_config.enable ? 1 : 0);
+        XR_LOG_INFO("Data cipher %s from next connection",
+                    cmd->data.cipher_config.enable ? "enabled" : "disabled");
+        break;
+      case Command::Type::CONFIG_WS_TOKEN: {
+        std::array<uint8_t, WebSocketServer::TOKEN_SIZE> token;
+        memcpy(token.data(), cmd->data.ws_token.token, token.size());
+        self->ws_token_db_->Set(token);
+        XR_LOG_INFO("WebSocket token %s",
+                    self->HasWsToken() ? "set" : "cleared");
+        break;
+      }
+      case Command::Type::FRAMING: {
+        uint8_t version = cmd->data.framing.version == FRAMING_V2
+                              ? FRAMING_V2
+                              : FRAMING_V1;
+        if (self->mode_ == Mode::CONNECTED) {
+          self->framing_ = version;
+        }
+        Command ans{};
+        ans.type = Command::Type::FRAMING;
+        ans.data.framing.version = self->framing_.load();
+        self->PushCommand(ans);
+        XR_LOG_INFO("Uplink framing v%d", ans.data.framing.version);
+        break;
+      }
+      case Command::Type::CONFIG_ROUTE: {
+        auto index = cmd->data.route_config.uart_index;
+        if (index >= MAX_PORT_NUM) {
+          break;
+        }
         self->uarts_.Foreach<UartInfo>([&](UartInfo &info) {
-          if (info.uart_index == cmd->data.uart_config.uart_index) {
-            info.uart->SetConfig(cmd->data.uart_config.uart_config);
-            info.uart->read_port_->Reset();
-            info.uart->write_port_->Reset();
-            XR_LOG_INFO("UART config changed");
+          if (info.uart_index == index) {
+            info.route_mask = cmd->data.route_config.sink_mask &
+                              ~static_cast<uint8_t>(1u << index);
+            self->route_key_->data_[index] = info.route_mask;
+            self->route_key_->Set(self->route_key_->data_);
+            XR_LOG_INFO("Port %d route changed: 0x%02x", index,
+                        info.route_mask);
             return ErrorCode::FAILED;
           }
           return ErrorCode::OK;
@@ -171,276 +808,2574 @@ public:
     command_topic_.RegisterCallback(command_topic_cb);
 
     from_net_server_.Register(command_topic_);
+    ws_net_server_.Register(command_topic_);
+
+    void (*flash_topic_cb_fun)(
+        bool in_isr, NetDebugLink *self,
+        LibXR::RawData &data) = [](bool in_isr, NetDebugLink *self,
+                                   LibXR::RawData &data) {
+      if (self->flasher_.PushImage(data.addr_, data.size_) != ErrorCode::OK) {
+        XR_LOG_WARN("Flash image data dropped: %d bytes", data.size_);
+      }
+    };
+
+    auto flash_topic_cb =
+        LibXR::Topic::Callback::Create(flash_topic_cb_fun, this);
+    flash_topic_.RegisterCallback(flash_topic_cb);
+
+    from_net_server_.Register(flash_topic_);
+    ws_net_server_.Register(flash_topic_);
+
+    RebalanceBuffers();
+
+    auto capture_flash = OpenCaptureFlash();
+    if (capture_flash != nullptr &&
+        capture_.Init(capture_flash) == ErrorCode::OK) {
+      XR_LOG_INFO("Capture store: %d sectors, max erase count %d, boot %d",
+                  capture_.GetStats().sectors,
+                  capture_.GetStats().max_erase_count, capture_.Boot());
+      capture_backlog_ = !capture_.Empty();
+    }
 
     PeripheralInit();
 
+    // 发送任务优先于接收任务，慢速解析或串口写入不会推迟上行
+    // TX outranks RX so a slow parse or UART write never holds back uplink
     thread_.Create(this, ThreadFun, "NetDebugLink", thread_stack_size,
-                   LibXR::Thread::Priority::MEDIUM);
+                   LibXR::Thread::Priority::HIGH);
+    rx_thread_.Create(this, RxThreadFun, "NetDebugLinkRx", rx_stack_size,
+                      LibXR::Thread::Priority::MEDIUM);
 
     InitDataLink();
 
-    InitPingTask();
-
     app.Register(*this);
   }
 
-  void InitPingTask() {
-    void (*ping_task_fun)(NetDebugLink *) = [](NetDebugLink *self) {
-      LibXR::Topic::PackedData<Command::Type> ping;
-      Command::Type cmd = Command::Type::PING;
-      LibXR::Topic::PackData(self->command_topic_.GetKey(), ping, cmd);
-      self->to_cdc_data_queue_mutex_.Lock();
-      self->to_cdc_data_queue_.PushBatch(&ping, sizeof(ping));
-      self->to_cdc_data_queue_mutex_.Unlock();
-      self->to_net_data_queue_mutex_.Lock();
-      self->to_net_data_queue_.PushBatch(&ping, sizeof(ping));
-      self->to_net_data_queue_mutex_.Unlock();
-    };
+  /**
+   * @brief 心跳间隔到期时发送心跳 / Send a ping once the keepalive interval
+   *        is due
+   *
+   * 由服务定时器调用，而 OnPong 在接收任务中更新同一份 LinkHealth，
+   * 两者都在 link_mutex_ 内访问。
+   * Runs on the service timer while OnPong updates the same LinkHealth on
+   * the RX task, so both access it under link_mutex_.
+   */
+  void SendPing(uint32_t now_ms) {
+    Command cmd{};
+    {
+      LibXR::Mutex::LockGuard guard(link_mutex_);
+      auto &link = link_;
+      if (now_ms - last_ping_ms_ < link.interval_ms) {
+        return;
+      }
+      last_ping_ms_ = now_ms;
+
+      if (mode_ != Mode::CONNECTED) {
+        link.acked_seq = link.seq;
+      } else if (link.seq != link.acked_seq) {
+        link.lost++;
+        link.lost_in_row++;
+        // 丢包时加快心跳以尽早确认链路状态
+        // Probe faster on loss to confirm link state early
+        link.interval_ms = PING_MIN_MS;
+        if (link.lost_in_row == PING_DEGRADED_LOST) {
+          XR_LOG_WARN("Link degraded: %d pings lost", link.lost_in_row);
+        }
+      }
 
-    auto ping_task = LibXR::Timer::CreateTask(ping_task_fun, this, 125);
-    LibXR::Timer::Add(ping_task);
-    LibXR::Timer::Start(ping_task);
+      cmd.type = Command::Type::PING;
+      cmd.data.ping.seq = ++link.seq;
+      cmd.data.ping.t1 = LibXR::Timebase::GetMicroseconds();
+    }
+
+    CommandFrame ping;
+    LibXR::Topic::PackData(command_topic_.GetKey(), ping, cmd);
+    to_cdc_data_queue_mutex_.Lock();
+    to_cdc_data_queue_.PushBatch(&ping, sizeof(ping));
+    to_cdc_data_queue_mutex_.Unlock();
+    PushControl(ping);
   }
 
-  void InitDataLink() {
-    static uint8_t read_buf[4096];
-    static uint8_t pack_buf[4096 + LibXR::Topic::PACK_BASE_SIZE];
-    void (*push_uart_data_task_fun)(NetDebugLink *) = [](NetDebugLink *self) {
-      LibXR::ReadOperation read_op(self->read_sem_, 20);
-      self->uarts_.Foreach<UartInfo>([&](UartInfo &info) {
-        auto &uart = info.uart;
-        auto topic = LibXR::Topic::TopicHandle(info.topic);
-        auto read_able_size =
-            LibXR::min(uart->read_port_->Size(), sizeof(read_buf));
-        if (read_able_size > 0) {
-          uart->Read({read_buf, read_able_size}, read_op);
-          if (uart != self->uart_cdc_) {
-            LibXR::Topic::PackData(topic->data_.crc32, pack_buf,
-                                   {read_buf, read_able_size});
+  /**
+   * @brief 处理心跳应答，估计往返时延与时钟偏差 /
+   *        Handle a ping reply and estimate RTT and clock offset
+   *
+   * 与 NTP 相同：rtt = (t4 - t1) - (t3 - t2)，
+   * offset = ((t2 - t1) + (t3 - t4)) / 2。
+   * Same as NTP: rtt = (t4 - t1) - (t3 - t2),
+   * offset = ((t2 - t1) + (t3 - t4)) / 2.
+   */
+  void OnPong(const Command &pong, uint64_t t4) {
+    LibXR::Mutex::LockGuard guard(link_mutex_);
+    auto &link = link_;
+    auto &ping = pong.data.ping;
+    if (ping.seq != link.seq || ping.t1 == 0 || t4 < ping.t1) {
+      return;
+    }
 
-            LibXR::Mutex::LockGuard guard(self->to_net_data_queue_mutex_);
-            self->to_net_data_queue_.PushBatch(
-                pack_buf, read_able_size + LibXR::Topic::PACK_BASE_SIZE);
-          } else {
-            LibXR::Mutex::LockGuard guard(self->to_cdc_data_queue_mutex_);
-            self->to_net_data_queue_.PushBatch(read_buf, read_able_size);
-          }
-        }
+    int64_t rtt = static_cast<int64_t>(t4 - ping.t1) -
+                  static_cast<int64_t>(ping.t3 - ping.t2);
+    int64_t offset = (static_cast<int64_t>(ping.t2 - ping.t1) +
+                      static_cast<int64_t>(ping.t3 - t4)) /
+                     2;
+
+    auto slot = link.samples % RTT_WINDOW;
+    link.rtt_us[slot] = static_cast<uint32_t>(LibXR::max<int64_t>(rtt, 0));
+    link.offset_us[slot] = offset;
+    link.samples++;
+    link.acked_seq = ping.seq;
+    link.lost_in_row = 0;
+
+    // 链路稳定时逐步放慢心跳 / Back off keepalive while the link is stable
+    if (link.interval_ms < PING_MAX_MS) {
+      link.interval_ms = LibXR::min(link.interval_ms * 5 / 4, PING_MAX_MS);
+    }
 
-        return ErrorCode::OK;
-      });
-    };
+    if (link.samples % LINK_STATS_PERIOD == 0) {
+      PublishLinkStats();
+    }
+  }
 
-    auto push_uart_data_task =
-        LibXR::Timer::CreateTask(push_uart_data_task_fun, this, 2);
-    LibXR::Timer::Add(push_uart_data_task);
-    LibXR::Timer::Start(push_uart_data_task);
-
-    void (*write_cdc_task_fun)(NetDebugLink *) = [](NetDebugLink *self) {
-      static uint8_t buf[4096];
-      LibXR::WriteOperation write_op(self->write_sem_, 20);
-      LibXR::Mutex::LockGuard guard(self->to_cdc_data_queue_mutex_);
-      auto write_able_size = self->to_cdc_data_queue_.Size();
-      if (write_able_size > 0) {
-        XR_LOG_DEBUG("write to uart %d bytes", write_able_size);
-        self->to_cdc_data_queue_.PopBatch(buf, write_able_size);
-        self->uart_cdc_->Write({buf, write_able_size}, write_op);
+  /**
+   * @brief 上报 RTT 分位数与时钟偏差 / Publish RTT percentiles and clock offset
+   *
+   * 时钟偏差取窗口内 RTT 最小样本的估计值，其受排队时延影响最小。
+   * The offset comes from the lowest-RTT sample in the window, which is the
+   * one least skewed by queueing delay.
+   *
+   * 调用方持有 link_mutex_ / The caller holds link_mutex_.
+   */
+  void PublishLinkStats() {
+    auto &link = link_;
+    size_t n = LibXR::min(link.samples, RTT_WINDOW);
+    if (n == 0) {
+      return;
+    }
+
+    std::array<uint32_t, RTT_WINDOW> sorted;
+    size_t best = 0;
+    for (size_t i = 0; i < n; i++) {
+      sorted[i] = link.rtt_us[i];
+      if (link.rtt_us[i] < link.rtt_us[best]) {
+        best = i;
       }
+    }
+    std::sort(sorted.begin(), sorted.begin() + n);
+
+    Command cmd{};
+    cmd.type = Command::Type::LINK_STATS;
+    cmd.data.link_stats.rtt_p50_us = sorted[n * 50 / 100];
+    cmd.data.link_stats.rtt_p90_us = sorted[n * 90 / 100];
+    cmd.data.link_stats.rtt_p99_us = sorted[n * 99 / 100];
+    cmd.data.link_stats.offset_us = link.offset_us[best];
+    cmd.data.link_stats.keepalive_ms = link.interval_ms;
+    cmd.data.link_stats.lost = link.lost;
+    cmd.data.link_stats.reconnect_ms = reconnect_ms_;
+    cmd.data.link_stats.wire_bytes = framing_stats_.wire_bytes;
+    cmd.data.link_stats.payload_bytes = framing_stats_.payload_bytes;
+    PushCommand(cmd);
+
+    XR_LOG_DEBUG("RTT p50 %d us p99 %d us, offset %lld us",
+                 cmd.data.link_stats.rtt_p50_us,
+                 cmd.data.link_stats.rtt_p99_us,
+                 static_cast<long long>(cmd.data.link_stats.offset_us));
+  }
+
+  /**
+   * @brief 创建合并后的服务定时任务 / Create the coalesced service timer task
+   *
+   * 串口轮询、CDC 写出、LED 与心跳共用一个定时任务。端口空闲时周期逐步加倍到
+   * SERVICE_MAX_MS，一旦有数据立即回到 SERVICE_MIN_MS，给 WiFi modem sleep
+   * 和 light sleep 留出空闲窗口。
+   * UART polling, CDC output, the LED and keepalive pings share one timer.
+   * While ports are idle its period doubles up to SERVICE_MAX_MS and snaps
+   * back to SERVICE_MIN_MS on the first byte, leaving idle windows for WiFi
+   * modem sleep and light sleep.
+   */
+  void InitDataLink() {
+    void (*service_task_fun)(NetDebugLink *) = [](NetDebugLink *self) {
+      self->ServiceTick();
     };
 
-    auto write_cdc_task = LibXR::Timer::CreateTask(write_cdc_task_fun, this, 2);
-    LibXR::Timer::Add(write_cdc_task);
-    LibXR::Timer::Start(write_cdc_task);
+    service_task_ =
+        LibXR::Timer::CreateTask(service_task_fun, this, SERVICE_MIN_MS);
+    LibXR::Timer::Add(service_task_);
+    LibXR::Timer::Start(service_task_);
   }
 
-  static void ThreadFun(NetDebugLink *self) {
-    static uint8_t buf[8192];
+  void ServiceTick() {
+    TraceScope trace(trace_, TraceRing::Task::SERVICE,
+                     TraceRing::Stage::SERVICE_TICK);
+    uint64_t start_us = LibXR::Timebase::GetMicroseconds();
+    uint32_t now_ms = LibXR::Timebase::GetMilliseconds();
 
-    while (true) {
-      self->mode_ = Mode::SCANING;
+    bool busy = PollPorts();
+    busy |= self_test_.Active() || flasher_.Active() || pending_config_.active;
 
-      struct sockaddr_in addr{};
-      addr.sin_family = AF_INET;
-      addr.sin_port = htons(self->udp_port_);
-      addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    busy |= FlushCdc();
+    UpdateFlow(now_ms);
 
-      int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
-      if (sock < 0) {
-        XR_LOG_ERROR("socket failed");
-        continue;
-      }
+    if (now_ms - last_led_ms_ >= LED_PERIOD_MS) {
+      last_led_ms_ = now_ms;
+      UpdateLed();
+    }
 
-      if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        XR_LOG_ERROR("bind failed");
-        close(sock);
-        continue;
-      }
+    SendPing(now_ms);
 
-      struct timeval timeout = {.tv_sec = 1, .tv_usec = 0};
-      setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (busy) {
+      idle_ticks_ = 0;
+      if (service_period_ms_ != SERVICE_MIN_MS) {
+        service_period_ms_ = SERVICE_MIN_MS;
+        LibXR::Timer::SetCycle(service_task_, service_period_ms_);
+      }
+    } else if (++idle_ticks_ >= SERVICE_IDLE_TICKS &&
+               service_period_ms_ < service_max_ms_) {
+      idle_ticks_ = 0;
+      service_period_ms_ = LibXR::min(service_period_ms_ * 2, service_max_ms_);
+      LibXR::Timer::SetCycle(service_task_, service_period_ms_);
+    }
 
-      while (true) {
-        if (self->smartconfig_requested_ || !self->wifi_->IsConnected()) {
-          self->smartconfig_requested_ = false;
-          self->mode_ = Mode::SMART_CONFIG;
-
-          auto result = self->StartBlufiBlocking(30000);
-          if (result != ErrorCode::OK) {
-            XR_LOG_WARN("BLUFI failed or timed out: %d", result);
-            self->mode_ = Mode::SMART_CONFIG;
-          } else {
-            XR_LOG_PASS("BLUFI success");
-            self->mode_ = Mode::SCANING;
-          }
-        }
+    AccountWakeup(LibXR::Timebase::GetMicroseconds() - start_us);
+  }
 
-        struct sockaddr_in sender;
-        socklen_t sender_len = sizeof(sender);
-        int len = recvfrom(sock, buf, sizeof(buf) - 1, 0,
-                           (struct sockaddr *)&sender, &sender_len);
-        if (len >= 0) {
-          buf[len] = 0;
-          static constexpr char msg_default[] =
-              "XRobot Debug Tools Default Message";
-          static constexpr char msg_filtered[] =
-              "XRobot Debug Tools Message Filtered:";
-          XR_LOG_INFO("Received from %s: %s", inet_ntoa(sender.sin_addr), buf);
+  /**
+   * @brief 读取各端口数据并分发 / Read every port and dispatch its data
+   * @return 是否有数据 / Whether any data moved
+   */
+  bool PollPorts() {
+    static uint8_t read_buf[4096];
+    LibXR::ReadOperation read_op(read_sem_, 20);
+    bool busy = false;
 
-          bool filter_match = false;
+    if (self_test_.Active()) {
+      PollSelfTest();
+    }
 
-          if (strncmp(reinterpret_cast<char *>(buf), msg_filtered,
-                      sizeof(msg_filtered) - 1) == 0) {
-            if (strstr(&self->device_name_key_->data_[0],
-                       reinterpret_cast<char *>(&buf[sizeof(msg_filtered)])) !=
-                nullptr) {
-              filter_match = true;
-            }
-          } else if (strncmp(reinterpret_cast<char *>(buf), msg_default,
-                             sizeof(msg_default) - 1) == 0) {
-            filter_match = true;
-          }
+    PollFlasher();
 
-          if (filter_match) {
-            self->mode_ = Mode::CONNECTED;
-            self->OnConnected(&sender);
+    uarts_.Foreach<UartInfo>([&](UartInfo &info) {
+      auto &uart = info.uart;
+      // CDC 承载会话时由网络任务读取 / The net task reads CDC while it
+      // carries the session
+      if (cdc_host_ && uart == uart_cdc_) {
+        return ErrorCode::OK;
+      }
+      auto read_able_size =
+          LibXR::min(uart->read_port_->Size(), sizeof(read_buf));
+      // 有 RTS 时只取上行放得下的部分，其余留在驱动缓冲区，由 RTS 挡住目标
+      // With RTS only take what the uplink can hold; the rest waits in the
+      // driver buffer while RTS holds the target off
+      if (info.rts && (info.route_mask & ROUTE_NET)) {
+        read_able_size = LibXR::min(read_able_size, UplinkRoom(info));
+      }
+      if (read_able_size > 0) {
+        busy = true;
+        {
+          TraceScope trace(trace_, TraceRing::Task::SERVICE,
+                           TraceRing::Stage::UART_READ, info.uart_index,
+                           read_able_size);
+          uart->Read({read_buf, read_able_size}, read_op);
+        }
+        // 发现报文之前仍是端口 0 的数据，之后的字节属于 CDC 会话
+        // Bytes before a discovery message are still port 0 data; the ones
+        // after it belong to the CDC session
+        size_t port_size = read_able_size;
+        if (uart == uart_cdc_) {
+          port_size = FindCdcHost(read_buf, read_able_size);
+        }
+        if (port_size > 0) {
+          if (flasher_.Match(info.uart_index)) {
+            flasher_.Feed(read_buf, port_size);
+          } else if (self_test_.Match(info.uart_index) &&
+                     self_test_.GetConfig().target ==
+                         SelfTest::Target::UART_TX) {
+            self_test_.Check(read_buf, port_size,
+                             LibXR::Timebase::GetMicroseconds());
           } else {
-            self->mode_ = Mode::SCANING;
+            RouteData(info, {read_buf, port_size});
           }
-        } else {
-          XR_LOG_WARN("recvfrom timed out");
-          self->mode_ = Mode::SCANING;
+        }
+        if (port_size < read_able_size) {
+          size_t session = port_size + sizeof(DISCOVERY_MSG_DEFAULT) - 1;
+          AttachCdcHost(read_buf + session, read_able_size - session);
+          return ErrorCode::OK;
         }
       }
+      busy |= UpdateRts(info);
 
-      close(sock);
+      return ErrorCode::OK;
+    });
+
+    if (pending_config_.active) {
+      ApplyPendingConfig();
     }
+
+    return busy;
   }
 
-  void OnConnected(struct sockaddr_in *addr) {
-    int tcp_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
-    if (tcp_sock < 0) {
-      XR_LOG_ERROR("TCP socket creation failed");
-      return;
-    } else {
-      XR_LOG_INFO("TCP socket created");
+  /**
+   * @brief 在 CDC 数据中查找 USB 主机的发现报文 /
+   *        Look for a USB host's discovery message in CDC data
+   * @return 报文的偏移，没有时为 size / Offset of the message, size if none
+   */
+  size_t FindCdcHost(const uint8_t *data, size_t size) const {
+    auto msg = reinterpret_cast<const uint8_t *>(DISCOVERY_MSG_DEFAULT);
+    return std::search(data, data + size, msg,
+                       msg + sizeof(DISCOVERY_MSG_DEFAULT) - 1) -
+           data;
+  }
+
+  /**
+   * @brief 让 CDC 转为会话链路 / Turn CDC into the session link
+   *
+   * 网络任务随即从 TCP 或发现循环切换过去；同批读出、位于报文之后的字节
+   * 交给 CdcTransport，作为会话最先收到的数据。
+   * The net task switches over from TCP or the discovery loop right away;
+   * bytes read in the same pass after the message go to CdcTransport as the
+   * first data the session receives.
+   *
+   * 标准输出绑定在 CDC 上时先将其静音，以免日志混入会话字节流。
+   * If standard output is bound to CDC it is muted first, so log lines do not
+   * end up inside the session byte stream.
+   */
+  void AttachCdcHost(const uint8_t *session, size_t size) {
+    cdc_transport_->Preload(session, size);
+    if (LibXR::STDIO::write_ == uart_cdc_->write_port_) {
+      muted_stdio_ = LibXR::STDIO::write_;
+      LibXR::STDIO::write_ = nullptr;
     }
+    cdc_host_ = true;
+    WakeNet();
+  }
 
-    // 设置非阻塞模式
-    int flags = fcntl(tcp_sock, F_GETFL, 0);
-    if (flags == -1) {
-      XR_LOG_ERROR("fcntl get flags failed");
-      close(tcp_sock);
-      return;
+  bool FlushCdc() {
+    static uint8_t buf[4096];
+    LibXR::WriteOperation write_op(write_sem_, 20);
+    LibXR::Mutex::LockGuard guard(to_cdc_data_queue_mutex_);
+    if (cdc_host_) {
+      // 端口 0 的下行与本地转发在 CDC 承载会话期间丢弃
+      // Port 0 downlink and local forwarding are dropped while CDC carries
+      // the session
+      ports_[0]->tx_dropped += to_cdc_data_queue_.Size();
+      to_cdc_data_queue_.Reset();
+      return false;
     }
-    fcntl(tcp_sock, F_SETFL, flags | O_NONBLOCK);
+    auto write_able_size = to_cdc_data_queue_.Size();
+    if (write_able_size > 0) {
+      XR_LOG_DEBUG("write to uart %d bytes", write_able_size);
+      to_cdc_data_queue_.PopBatch(buf, write_able_size);
+      uart_cdc_->Write({buf, write_able_size}, write_op);
+      return true;
+    }
+    return false;
+  }
 
-    addr->sin_family = AF_INET;
-    addr->sin_port = htons(tcp_port_);
+  /**
+   * @brief 唤醒发送任务，未被消费的唤醒只保留一次 /
+   *        Wake the TX task, keeping at most one unconsumed wakeup
+   *
+   * 每个数据块都 Post 会让信号量计数累积，发送任务随后空转多次。
+   * Posting per chunk would pile up semaphore counts and make the TX task
+   * spin through that many empty passes.
+   */
+  void WakeNet() {
+    if (!net_wakeup_pending_.exchange(true)) {
+      net_wakeup_sem_.Post();
+    }
+  }
 
-    XR_LOG_INFO("Connecting to TCP server %s:%d", inet_ntoa(addr->sin_addr),
-                tcp_port_);
+  /**
+   * @brief 发送任务等待唤醒或超时 / TX task waits for a wakeup or timeout
+   *
+   * 醒来后才清除标志：此前入队的数据会在本轮处理，之后的入队会再次 Post。
+   * The flag clears only after waking: data queued before that is handled
+   * in this pass, and anything queued later posts again.
+   */
+  void WaitNet(uint32_t timeout_ms) {
+    net_wakeup_sem_.Wait(timeout_ms);
+    net_wakeup_pending_ = false;
+  }
 
-    if (connect(tcp_sock, (struct sockaddr *)addr, sizeof(*addr)) != 0) {
-      if (errno != EINPROGRESS) {
-        XR_LOG_ERROR("TCP connect failed: %d", errno);
-        close(tcp_sock);
+  /**
+   * @brief 统计一次唤醒，每秒上报一次 / Account one wakeup, report once a
+   *        second
+   *
+   * 服务定时器、发送与接收任务都会调用，统计在 power_mutex_ 内更新。
+   * Called from the service timer and both the TX and RX tasks, so the
+   * statistics are updated under power_mutex_.
+   */
+  void AccountWakeup(uint64_t busy_us) {
+    Command cmd{};
+    {
+      LibXR::Mutex::LockGuard guard(power_mutex_);
+      if (!TakePowerStats(busy_us, cmd)) {
         return;
       }
     }
 
-    struct tcp_keepalive {
-      uint32_t keep_idle;  // 空闲时间
-      uint32_t keep_intvl; // Keep Alive 间隔
-      uint32_t keep_count; // 最大重试次数
-    };
-
-    tcp_keepalive ka = {.keep_idle = 5, .keep_intvl = 1, .keep_count = 5};
-    setsockopt(tcp_sock, IPPROTO_TCP, TCP_KEEPALIVE, &ka, sizeof(ka));
+    if (mode_ == Mode::CONNECTED) {
+      PushCommand(cmd);
+    }
+  }
 
-    while (!smartconfig_requested_) {
-      // 处理接收数据
-      static char buf[4096];
-      ssize_t bytes_received = recv(tcp_sock, buf, sizeof(buf), 0);
-      if (bytes_received < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-          // 没有数据可读，继续轮询
-        } else {
-          XR_LOG_ERROR("TCP recv failed: %d", errno);
-          close(tcp_sock);
-          return;
-        }
-      } else if (bytes_received == 0) {
-        // 连接关闭
-        XR_LOG_ERROR("Connection closed by server");
-        close(tcp_sock);
-        return;
-      } else {
-        from_net_server_.ParseData(
-            {(uint8_t *)buf, static_cast<size_t>(bytes_received)});
-        XR_LOG_PASS("Received %d bytes", bytes_received);
-      }
+  /**
+   * @brief 累计唤醒，窗口满时生成 POWER_STATS / Accumulate a wakeup and
+   *        build POWER_STATS once the window is full
+   * @return 是否生成了报告 / Whether a report was built
+   */
+  bool TakePowerStats(uint64_t busy_us, Command &cmd) {
+    auto &stats = power_stats_;
+    stats.wakeups++;
+    stats.busy_us += busy_us;
+
+    uint64_t now = LibXR::Timebase::GetMicroseconds();
+    uint64_t window_us = now - stats.window_start_us;
+    if (window_us < POWER_STATS_PERIOD_MS * 1000ull) {
+      return false;
+    }
 
-      // 处理发送数据
-      static uint8_t send_buf[4096];
-      to_net_data_queue_mutex_.Lock();
-      auto len = to_net_data_queue_.Size();
-      if (len > 0) {
-        to_net_data_queue_.PopBatch(send_buf, len);
-        to_net_data_queue_mutex_.Unlock();
-        ssize_t ans = send(tcp_sock, send_buf, len, 0);
-        if (ans < 0) {
-          if (errno == EAGAIN || errno == EWOULDBLOCK || EINPROGRESS) {
-            // 套接字不可用，继续轮询
-          } else {
-            XR_LOG_ERROR("TCP send failed: %d", errno);
-            close(tcp_sock);
-            return;
-          }
-        }
-      } else {
-        to_net_data_queue_mutex_.Unlock();
-      }
+    cmd.type = Command::Type::POWER_STATS;
+    cmd.data.power_stats.wakeups_per_sec =
+        static_cast<uint16_t>(stats.wakeups * 1000000ull / window_us);
+    cmd.data.power_stats.duty_permille =
+        static_cast<uint16_t>(stats.busy_us * 1000 / window_us);
+    cmd.data.power_stats.service_period_ms = service_period_ms_;
+    cmd.data.power_stats.net_idle_ms = net_idle_ms_;
+    auto cipher = cipher_.TakeStats();
+    cmd.data.power_stats.cipher_duty_permille =
+        static_cast<uint16_t>(cipher.busy_us * 1000 / window_us);
+    cmd.data.power_stats.cipher_kbps =
+        cipher.busy_us > 0
+            ? static_cast<uint32_t>(cipher.bytes * 1000 / cipher.busy_us)
+            : 0;
+    stats = {0, 0, now};
+    return true;
+  }
 
-      LibXR::Thread::Sleep(1);
+  /**
+   * @brief 将端口数据或一个完整的包送往网络 / Send port data or one complete
+   *        packet towards the network
+   *
+   * 分帧模式下普通上行为每个包加 PacketRecord 头；离线暂存和抓取记录本身
+   * 已带时间戳，直接以包为单位写入。
+   * In framing mode the plain uplink prefixes every packet with a
+   * PacketRecord; capture staging and tap records already carry a timestamp
+   * and take the packet as one record.
+   */
+  void RouteNet(UartInfo &src, LibXR::ConstRawData data,
+                uint64_t packet_us = 0) {
+    if (StageCapture(src, data)) {
+      return;
+    }
+    if (Tapped(src)) {
+      PushTap(src, TAP_RX, data);
+      return;
     }
 
-    close(tcp_sock);
+    TraceScope trace(trace_, TraceRing::Task::SERVICE,
+                     TraceRing::Stage::QUEUE_PUSH, src.uart_index, data.size_);
+    LibXR::Mutex::LockGuard guard(to_net_data_queue_mutex_);
+    PacketRecord record{packet_us, static_cast<uint16_t>(data.size_)};
+    bool framed = src.framer && src.framer->Active();
+    size_t header = framed ? sizeof(record) : 0;
+    if (src.net_queue->EmptySize() < header + data.size_) {
+      src.rx_dropped += data.size_;
+    } else {
+      if (framed) {
+        src.net_queue->PushBatch(&record, sizeof(record));
+      }
+      src.net_queue->PushBatch(data.addr_, data.size_);
+      src.age.Push(header + data.size_, LibXR::Timebase::GetMilliseconds());
+    }
+    if (net_idle_ms_ > 1) {
+      WakeNet();
+    }
   }
 
-  void OnMonitor() override {}
-
-  void OnButton() { smartconfig_requested_ = true; }
+  /**
+   * @brief 按路由表将端口数据转发到网络和本地端口 /
+   *        Forward port data to the network and local ports by route mask
+   *
+   * 本地转发不经过 WiFi：UART 之间直接写入原始数据，转发到 CDC 的数据按源端口
+   * 的 Topic 打包，便于 USB 主机区分来源。
+   * Local forwarding never touches WiFi: UART sinks get raw bytes, while CDC
+   * sinks get frames packed with the source topic so a USB host can demux.
+   */
+  void RouteData(UartInfo &src, LibXR::ConstRawData data) {
+    static uint8_t pack_buf[4096 + LibXR::Topic::PACK_BASE_SIZE];
+    auto key = LibXR::Topic::TopicHandle(src.topic)->data_.crc32;
+    bool packed = false;
 
-  void BlufiInit();
+    auto pack = [&]() {
+      if (!packed) {
+        LibXR::Topic::PackData(key, {pack_buf, sizeof(pack_buf)}, data);
+        packed = true;
+      }
+      return LibXR::ConstRawData(pack_buf,
+                                 data.size_ + LibXR::Topic::PACK_BASE_SIZE);
+    };
 
-  void PeripheralInit();
+    if (src.route_mask & ROUTE_NET) {
+      if (src.framer && src.framer->Active()) {
+        uint64_t now_us = LibXR::Timebase::GetMicroseconds();
+        src.rx_dropped += src.framer->Feed(
+            static_cast<const uint8_t *>(data.addr_), data.size_,
+            [&](const uint8_t *packet, size_t len) {
+              RouteNet(src, {packet, len}, now_us);
+            });
+      } else {
+        RouteNet(src, data);
+      }
+    }
 
-  ErrorCode StartBlufiBlocking(uint32_t timeout_ms);
+    if ((src.route_mask & ~ROUTE_NET) == 0) {
+      return;
+    }
 
-  static inline NetDebugLink *instance_ = nullptr;
+    uarts_.Foreach<UartInfo>([&](UartInfo &dst) {
+      if (&dst == &src || !(src.route_mask & (1u << dst.uart_index))) {
+        return ErrorCode::OK;
+      }
 
-  Mode mode_ = Mode::Init;
-  bool smartconfig_requested_ = false;
+      if (dst.uart == uart_cdc_) {
+        auto frame = pack();
+        LibXR::Mutex::LockGuard guard(to_cdc_data_queue_mutex_);
+        to_cdc_data_queue_.PushBatch(frame.addr_, frame.size_);
+      } else {
+        TraceScope trace(trace_, TraceRing::Task::SERVICE,
+                         TraceRing::Stage::UART_WRITE, dst.uart_index,
+                         data.size_);
+        dst.tx_dropped +=
+            data.size_ - WritePort(dst, static_cast<const uint8_t *>(data.addr_),
+                                   data.size_);
+      }
+      return ErrorCode::OK;
+    });
+  }
+
+  /**
+   * @brief 不阻塞地把数据放进端口的写队列 / Queue data on a port's write
+   *        port without blocking
+   *
+   * 同一串口可能同时被服务任务（本地转发、自测）与接收任务（下行）写入，
+   * 所有写者经 write_mutex 串行，且持锁期间从不等待。只写入队列放得下的
+   * 部分。
+   * The service task (local routing, self test) and the RX task (downlink)
+   * may write the same UART; every writer goes through write_mutex and never
+   * waits while holding it. Only what fits in the write queue is taken.
+   *
+   * 有 CTS 时目标撤销 CTS 后不再写入，且写队列最多积压 CTS_WRITE_AHEAD 字节，
+   * 因为驱动发送已入队的数据时不看 CTS。
+   * With CTS nothing is queued while the target holds it off, and at most
+   * CTS_WRITE_AHEAD bytes wait in the write queue, since the driver sends
+   * whatever is queued without looking at CTS.
+   *
+   * @return 已写入的字节数 / Bytes queued
+   */
+  size_t WritePort(UartInfo &port, const uint8_t *data, size_t size) {
+    if (CtsHeld(port)) {
+      return 0;
+    }
+    LibXR::Mutex::LockGuard guard(*port.write_mutex);
+    size_t len = LibXR::min(port.uart->write_port_->EmptySize(), size);
+    if (port.cts) {
+      size_t queued = port.uart->write_port_->Size();
+      len = LibXR::min(len, queued < CTS_WRITE_AHEAD
+                                ? CTS_WRITE_AHEAD - queued
+                                : static_cast<size_t>(0));
+    }
+    if (len == 0) {
+      return 0;
+    }
+    LibXR::WriteOperation write_op;
+    return port.uart->Write({data, len}, write_op) == ErrorCode::OK ? len : 0;
+  }
+
+  /**
+   * @brief 写入下行数据，写队列满时在锁外等待 / Write downlink data, waiting
+   *        outside the lock while the write queue is full
+   *
+   * 只在接收任务中调用；超过 DOWNLINK_WRITE_TIMEOUT_MS 仍无进展时丢弃剩余部分
+   * 并计入 tx_dropped。
+   * RX task only. Once DOWNLINK_WRITE_TIMEOUT_MS pass without progress the
+   * rest is dropped and counted in tx_dropped.
+   */
+  void WriteDownlink(UartInfo &port, LibXR::ConstRawData data) {
+    auto src = static_cast<const uint8_t *>(data.addr_);
+    size_t left = data.size_;
+    uint32_t stalled_ms = 0;
+    while (left > 0 && stalled_ms < DOWNLINK_WRITE_TIMEOUT_MS) {
+      size_t len = WritePort(port, src, left);
+      if (len == 0) {
+        LibXR::Thread::Sleep(1);
+        stalled_ms++;
+        continue;
+      }
+      src += len;
+      left -= len;
+      stalled_ms = 0;
+    }
+    port.tx_dropped += left;
+  }
+
+  /**
+   * @brief 查找端口的可选 RTS/CTS 引脚，别名为 "<端口名>_rts"/"<端口名>_cts" /
+   *        Look up the optional RTS/CTS pins aliased "<port>_rts"/"<port>_cts"
+   */
+  static void FindFlowPins(LibXR::HardwareContainer &hw, const char *uart_name,
+                           UartInfo &info) {
+    char alias[48];
+    snprintf(alias, sizeof(alias), "%s_rts", uart_name);
+    info.rts = hw.template Find<LibXR::GPIO>({alias});
+    snprintf(alias, sizeof(alias), "%s_cts", uart_name);
+    info.cts = hw.template Find<LibXR::GPIO>({alias});
+
+    if (info.rts) {
+      info.rts->SetConfig({.direction = LibXR::GPIO::Direction::OUTPUT_PUSH_PULL,
+                           .pull = LibXR::GPIO::Pull::NONE});
+      info.rts->Write(false);
+      info.flow_flags |= FLOW_RTS;
+    }
+    if (info.cts) {
+      info.cts->SetConfig({.direction = LibXR::GPIO::Direction::INPUT,
+                           .pull = LibXR::GPIO::Pull::UP});
+    }
+  }
+
+  /**
+   * @brief 端口上行方向的剩余空间：离线或积压时为暂存区，否则为网络队列 /
+   *        Room left on a port's uplink: the capture staging queue while
+   *        offline or draining a backlog, the network queue otherwise
+   */
+  size_t UplinkRoom(UartInfo &port, size_t *capacity = nullptr) {
+    if (capture_.Ready()) {
+      LibXR::Mutex::LockGuard guard(capture_mutex_);
+      if (!HostAttached() || capture_backlog_) {
+        size_t room = capture_queue_.EmptySize();
+        if (capacity) {
+          *capacity = CAPTURE_STAGING;
+        }
+        return room > sizeof(CaptureStage) ? room - sizeof(CaptureStage) : 0;
+      }
+    }
+    if (Tapped(port)) {
+      LibXR::Mutex::LockGuard guard(tap_mutex_);
+      size_t room = tap_queue_.EmptySize();
+      if (capacity) {
+        *capacity = TAP_QUEUE_SIZE;
+      }
+      return room > sizeof(TapHeader) ? room - sizeof(TapHeader) : 0;
+    }
+    LibXR::Mutex::LockGuard guard(to_net_data_queue_mutex_);
+    size_t room = port.net_queue->EmptySize();
+    if (capacity) {
+      *capacity = port.net_queue->Size() + room;
+    }
+    return room;
+  }
+
+  bool Tapped(const UartInfo &port) const {
+    return tap_mask_ & (1u << port.uart_index);
+  }
+
+  /**
+   * @brief 记录一段带方向和时间戳的端口数据 /
+   *        Record a run of port data with direction and timestamp
+   *
+   * 被抓取端口的上行数据只走抓取通道，不再重复经端口 Topic 发送。超过
+   * TAP_DATA_MAX 的数据拆成多条同一时间戳的记录。
+   * Uplink data of a tapped port only travels in the tap lane and is not
+   * sent again on the port topic. Data over TAP_DATA_MAX is split into
+   * several records with the same timestamp.
+   *
+   * 队列放不下全部记录时整段丢弃并计数 / Dropped as a whole and counted
+   * when the queue cannot take every record
+   */
+  void PushTap(UartInfo &port, uint8_t direction, LibXR::ConstRawData data) {
+    uint64_t now_us = LibXR::Timebase::GetMicroseconds();
+    size_t records = (data.size_ + TAP_DATA_MAX - 1) / TAP_DATA_MAX;
+    LibXR::Mutex::LockGuard guard(tap_mutex_);
+    if (tap_queue_.EmptySize() < records * sizeof(TapHeader) + data.size_) {
+      if (direction == TAP_RX) {
+        port.rx_dropped += data.size_;
+      } else {
+        tap_dropped_ += data.size_;
+      }
+      return;
+    }
+    auto src = static_cast<const uint8_t *>(data.addr_);
+    for (size_t offset = 0; offset < data.size_; offset += TAP_DATA_MAX) {
+      size_t len = LibXR::min(TAP_DATA_MAX, data.size_ - offset);
+      TapHeader header{now_us, static_cast<uint16_t>(len), port.uart_index,
+                       direction};
+      tap_queue_.PushBatch(&header, sizeof(header));
+      tap_queue_.PushBatch(src + offset, len);
+    }
+    if (net_idle_ms_ > 1) {
+      WakeNet();
+    }
+  }
+
+  /**
+   * @brief 在读路径上按上行剩余空间驱动 RTS / Drive RTS from the room left
+   *        on the uplink, on the read path
+   *
+   * 每次读取端口后立即评估：剩余不足 1/4 时拉高 RTS，恢复到 1/2 以上再拉低。
+   * Evaluated right after each read of the port: RTS goes high once less
+   * than a quarter of the uplink is free and low again above half.
+   *
+   * @return RTS 是否正挡住目标，此时服务任务不应退避 / Whether RTS is
+   *         holding the target off, in which case the service task must not
+   *         back off
+   */
+  bool UpdateRts(UartInfo &port) {
+    if (!port.rts) {
+      return false;
+    }
+    size_t capacity = 0;
+    size_t room = UplinkRoom(port, &capacity);
+    if ((port.flow_flags & FLOW_RTS) && room < capacity / 4) {
+      port.flow_flags &= ~FLOW_RTS;
+      port.rts->Write(true);
+    } else if (!(port.flow_flags & FLOW_RTS) && room > capacity / 2) {
+      port.flow_flags |= FLOW_RTS;
+      port.rts->Write(false);
+    }
+    return !(port.flow_flags & FLOW_RTS);
+  }
+
+  /**
+   * @brief 目标是否撤销了 CTS / Whether the target has dropped CTS
+   */
+  static bool CtsHeld(const UartInfo &port) {
+    return port.cts && port.cts->Read();
+  }
+
+  /**
+   * @brief 更新各端口的下行信用，状态变化时通知主机 /
+   *        Update downlink credit per port, notify the host on change
+   *
+   * 下行写队列剩余不足 1/4 或目标撤销 CTS 时建议主机暂停该端口，队列排空到
+   * 1/2 以下再恢复。RTS 由读路径驱动，这里只上报其状态。
+   * The host is advised to pause a port when less than a quarter of its
+   * write queue is free or the target drops CTS, and to resume once the
+   * queue is back under half full. RTS is driven from the read path and only
+   * reported here.
+   */
+  void UpdateFlow(uint32_t now_ms) {
+    bool resync = flow_resync_;
+    flow_resync_ = false;
+    bool report_drops = now_ms - flow_report_ms_ >= FLOW_REPORT_MS;
+    if (report_drops) {
+      flow_report_ms_ = now_ms;
+    }
+
+    uarts_.Foreach<UartInfo>([&](UartInfo &port) {
+      uint8_t flags = port.flow_flags & (FLOW_PAUSE | FLOW_RTS);
+      if (port.rts) {
+        flags |= FLOW_HAS_RTS;
+      }
+
+      bool cts_ready = !CtsHeld(port);
+      if (port.cts) {
+        flags |= FLOW_HAS_CTS | (cts_ready ? FLOW_CTS : 0);
+      }
+
+      size_t used = 0, capacity = 0;
+      if (port.uart == uart_cdc_) {
+        LibXR::Mutex::LockGuard guard(to_cdc_data_queue_mutex_);
+        used = to_cdc_data_queue_.Size();
+        capacity = used + to_cdc_data_queue_.EmptySize();
+      } else {
+        used = port.uart->write_port_->Size();
+        capacity = used + port.uart->write_port_->EmptySize();
+      }
+      if (!cts_ready || capacity - used < capacity / 4) {
+        flags |= FLOW_PAUSE;
+      } else if (used < capacity / 2) {
+        flags &= ~FLOW_PAUSE;
+      }
+
+      uint32_t dropped = port.rx_dropped + port.tx_dropped;
+      bool changed = flags != port.reported_flags;
+      port.flow_flags = (port.flow_flags & ~FLOW_PAUSE) | (flags & FLOW_PAUSE);
+      port.reported_flags = flags;
+      if (mode_ != Mode::CONNECTED ||
+          !(changed || resync ||
+            (report_drops && dropped != port.reported_dropped))) {
+        return ErrorCode::OK;
+      }
+
+      port.reported_dropped = dropped;
+      Command cmd{};
+      cmd.type = Command::Type::FLOW_CONTROL;
+      cmd.data.flow_control.uart_index = port.uart_index;
+      cmd.data.flow_control.flags = flags;
+      cmd.data.flow_control.rx_dropped = port.rx_dropped;
+      cmd.data.flow_control.tx_dropped = port.tx_dropped;
+      PushCommand(cmd);
+      return ErrorCode::OK;
+    });
+  }
+
+  /**
+   * @brief 推进本地烧录并上报进度 / Advance local flashing and report progress
+   */
+  void PollFlasher() {
+    flasher_.Poll(LibXR::Timebase::GetMilliseconds());
+
+    Command status{};
+    if (!flasher_.TakeProgress(status.data.flash_status)) {
+      return;
+    }
+    status.type = Command::Type::FLASH_STATUS;
+    PushCommand(status);
+
+    auto &flash_status = status.data.flash_status;
+    if (flash_status.state == SlipFlasher::State::DONE ||
+        flash_status.state == SlipFlasher::State::FAILED) {
+      // 恢复端口原有配置 / Restore the port's own configuration
+      auto &port = *ports_[flash_status.uart_index];
+      port.uart->SetConfig(port.config);
+      XR_LOG_INFO("Flashing port %d finished: state %d error %d",
+                  flash_status.uart_index, flash_status.state,
+                  flash_status.error);
+    }
+  }
+
+  /**
+   * @brief 端口上行能否承载未分帧的自测数据 / Whether a port's uplink can
+   *        carry the unframed self-test pattern
+   */
+  bool SelfTestFitsNet(const UartInfo &port) const {
+    return !(port.framer && port.framer->Active()) && !Tapped(port);
+  }
+
+  /**
+   * @brief 按速率发送自测数据，结束后上报结果 /
+   *        Emit self-test traffic at the requested rate and report when done
+   */
+  void PollSelfTest() {
+    static uint8_t pattern_buf[1024];
+    uint64_t now = LibXR::Timebase::GetMicroseconds();
+    auto config = self_test_.GetConfig();
+    auto &port = *ports_[config.uart_index];
+
+    bool to_uart = config.target == SelfTest::Target::UART_TX;
+    // 只生成写队列放得下的数据，不阻塞服务任务 / Only generate what the write
+    // queue can take, so the service task never blocks
+    size_t room = to_uart ? LibXR::min(port.uart->write_port_->EmptySize(),
+                                       sizeof(pattern_buf))
+                          : sizeof(pattern_buf);
+    size_t len = self_test_.Generate(pattern_buf, room, now);
+    if (len > 0) {
+      if (to_uart) {
+        port.tx_dropped += len - WritePort(port, pattern_buf, len);
+      } else if (SelfTestFitsNet(port)) {
+        LibXR::Mutex::LockGuard guard(to_net_data_queue_mutex_);
+        if (port.net_queue->PushBatch(pattern_buf, len) == ErrorCode::OK) {
+          port.age.Push(len, LibXR::Timebase::GetMilliseconds());
+        }
+      }
+    }
+
+    if (self_test_.Finished(now)) {
+      Command report{};
+      report.type = Command::Type::SELF_TEST_REPORT;
+      report.data.self_test_report = self_test_.Stop();
+      PushCommand(report);
+      XR_LOG_INFO("Self test done: tx %d rx %d errors %d, %d B/s",
+                  report.data.self_test_report.tx_bytes,
+                  report.data.self_test_report.rx_bytes,
+                  report.data.self_test_report.errors,
+                  report.data.self_test_report.throughput);
+    }
+  }
+
+  /**
+   * @brief 校验并登记一组串口配置，等待静默点统一生效 /
+   *        Validate and queue a set of UART configs to apply at a quiescent
+   *        point
+   */
+  void RequestUartConfig(uint8_t seq, const Command::UartConfig *entries,
+                         uint8_t count) {
+    auto ack = [&](ErrorCode status) {
+      Command reply{};
+      reply.type = Command::Type::CONFIG_ACK;
+      reply.data.config_ack.seq = seq;
+      reply.data.config_ack.status = static_cast<int8_t>(status);
+      PushCommand(reply);
+    };
+
+    if (pending_config_.active) {
+      ack(ErrorCode::BUSY);
+      return;
+    }
+
+    for (uint8_t i = 0; i < count; i++) {
+      auto &entry = entries[i];
+      if (entry.uart_index >= port_num_ || entry.uart_config.baudrate == 0 ||
+          entry.uart_config.baudrate > MAX_BAUDRATE) {
+        XR_LOG_WARN("Invalid UART config: port %d, %d baud", entry.uart_index,
+                    entry.uart_config.baudrate);
+        ack(ErrorCode::ARG_ERR);
+        return;
+      }
+      if (!PacketFramer::Valid(entry.framing)) {
+        XR_LOG_WARN("Invalid framing on port %d", entry.uart_index);
+        ack(ErrorCode::ARG_ERR);
+        return;
+      }
+    }
+
+    memcpy(pending_config_.entries, entries, sizeof(entries[0]) * count);
+    pending_config_.seq = seq;
+    pending_config_.count = count;
+    pending_config_.since = LibXR::Timebase::GetMilliseconds();
+    pending_config_.active = true;
+  }
+
+  /**
+   * @brief 在途数据排空后应用串口配置 / Apply UART configs once in-flight
+   *        data has drained
+   *
+   * 先等待相关端口接收数据被转发、发送队列写空，再一次性切换，不复位读写端口，
+   * 因此切换后以新波特率到达的首批字节不会丢失。超时后仍会应用并回复 TIMEOUT。
+   * Waits until received bytes of every affected port were forwarded and
+   * their TX queues are empty, then switches all of them together without
+   * resetting the ports, so the first bytes at the new rate survive. After
+   * CONFIG_DRAIN_TIMEOUT_MS the configs are applied anyway and TIMEOUT is
+   * reported.
+   *
+   * 开关分帧会改变上行队列的格式（原始字节与带 PacketRecord 头的记录），
+   * 因此这类端口还要等上行队列发空；超时仍未发空的部分丢弃并计入
+   * rx_dropped，两种格式不会混在一个队列里。
+   * Turning framing on or off changes the uplink queue format (raw bytes
+   * versus records with a PacketRecord header), so such ports also wait for
+   * the uplink queue to empty; whatever is left at the timeout is dropped
+   * and counted in rx_dropped, so the two formats never share a queue.
+   */
+  void ApplyPendingConfig() {
+    auto &pending = pending_config_;
+    bool drained = true;
+    for (uint8_t i = 0; i < pending.count; i++) {
+      auto &entry = pending.entries[i];
+      auto &port = *ports_[entry.uart_index];
+      auto uart = port.uart;
+      if (uart->read_port_->Size() > 0 || uart->write_port_->Size() > 0) {
+        drained = false;
+      }
+      if (FramingToggles(port, entry.framing)) {
+        LibXR::Mutex::LockGuard guard(to_net_data_queue_mutex_);
+        if (port.net_queue->Size() > 0) {
+          drained = false;
+        }
+      }
+    }
+
+    bool timeout = LibXR::Timebase::GetMilliseconds() - pending.since >=
+                   CONFIG_DRAIN_TIMEOUT_MS;
+    if (!drained && !timeout) {
+      return;
+    }
+
+    for (uint8_t i = 0; i < pending.count; i++) {
+      auto &entry = pending.entries[i];
+      auto &port = *ports_[entry.uart_index];
+      if (FramingToggles(port, entry.framing)) {
+        LibXR::Mutex::LockGuard guard(to_net_data_queue_mutex_);
+        size_t held = port.net_queue->Size();
+        port.net_queue->Reset();
+        port.age.Pop(held);
+        port.rx_dropped += held;
+      }
+      port.uart->SetConfig(entry.uart_config);
+      port.config = entry.uart_config;
+      if (entry.framing.mode != PacketFramer::Mode::RAW && !port.framer) {
+        port.framer = new PacketFramer();
+      }
+      if (port.framer) {
+        port.framer->Configure(entry.framing);
+      }
+      XR_LOG_INFO("UART %d config changed: %d baud", entry.uart_index,
+                  entry.uart_config.baudrate);
+    }
+    RebalanceBuffers();
+
+    Command reply{};
+    reply.type = Command::Type::CONFIG_ACK;
+    reply.data.config_ack.seq = pending.seq;
+    reply.data.config_ack.status =
+        static_cast<int8_t>(drained ? ErrorCode::OK : ErrorCode::TIMEOUT);
+    PushCommand(reply);
+    pending.active = false;
+  }
+
+  /**
+   * @brief 新配置是否开启或关闭分帧 / Whether the new config turns framing
+   *        on or off
+   */
+  static bool FramingToggles(const UartInfo &port,
+                             const PacketFramer::Config &framing) {
+    bool active = port.framer && port.framer->Active();
+    return active != (framing.mode != PacketFramer::Mode::RAW);
+  }
+
+  /**
+   * @brief 按波特率从共享预算重新分配各端口发送缓冲 /
+   *        Redistribute the shared send buffer budget by port baud rate
+   *
+   * 每个端口需要缓冲 NET_QUEUE_HOLD_MS 内的线速数据；预算不足时按比例缩减，
+   * 但不少于 NET_QUEUE_MIN_SIZE。已缓冲的数据会迁移到新队列，新队列放不下的
+   * 最新部分计入 rx_dropped；分帧端口只保留整条记录，不会截断半条。
+   * Each port wants NET_QUEUE_HOLD_MS worth of line-rate data. When the
+   * budget is short every share is scaled down proportionally, but never
+   * below NET_QUEUE_MIN_SIZE. Buffered bytes are carried over; the newest
+   * bytes that no longer fit are counted in rx_dropped. Framed ports only
+   * keep whole records, never half of one.
+   *
+   * 容量不变的队列原样保留；其余经栈上小块搬运，不需要整份预算大小的中转区。
+   * A queue whose capacity is unchanged is kept as is; the others are moved
+   * through a small stack chunk, with no staging area the size of the whole
+   * budget.
+   */
+  void RebalanceBuffers() {
+    LibXR::Mutex::LockGuard guard(to_net_data_queue_mutex_);
+
+    uint64_t total_want = 0;
+    for (uint8_t i = 0; i < port_num_; i++) {
+      // 8N1 下每字节 10 bit / 10 bits per byte at 8N1
+      total_want += ports_[i]->config.baudrate / 10 * NET_QUEUE_HOLD_MS / 1000;
+    }
+
+    // 退避周期内驱动缓冲积压不超过 SERVICE_IDLE_BUFFER
+    // Keep the idle backlog in driver buffers below SERVICE_IDLE_BUFFER
+    service_max_ms_ = SERVICE_MAX_MS;
+    for (uint8_t i = 0; i < port_num_; i++) {
+      uint32_t bytes_per_sec = ports_[i]->config.baudrate / 10;
+      service_max_ms_ = LibXR::min<uint32_t>(
+          service_max_ms_, LibXR::max<uint32_t>(
+                               SERVICE_IDLE_BUFFER * 1000 / bytes_per_sec,
+                               SERVICE_MIN_MS));
+    }
+
+    size_t floor = NET_QUEUE_MIN_SIZE * port_num_;
+    size_t spare = NET_QUEUE_BUDGET > floor ? NET_QUEUE_BUDGET - floor : 0;
+    for (uint8_t i = 0; i < port_num_; i++) {
+      auto &port = *ports_[i];
+      uint64_t want = port.config.baudrate / 10 * NET_QUEUE_HOLD_MS / 1000;
+      size_t share =
+          NET_QUEUE_MIN_SIZE +
+          static_cast<size_t>(LibXR::min<uint64_t>(
+              want, total_want ? spare * want / total_want : 0));
+
+      auto old_queue = port.net_queue;
+      if (old_queue != nullptr &&
+          old_queue->Size() + old_queue->EmptySize() == share) {
+        continue;
+      }
+      port.net_queue = new LibXR::BaseQueue(1, share);
+      if (old_queue != nullptr) {
+        size_t held = old_queue->Size();
+        size_t keep = MoveQueued(*old_queue, *port.net_queue,
+                                 port.framer && port.framer->Active());
+        port.age.DropNewest(held - keep);
+        port.rx_dropped += held - keep;
+        delete old_queue;
+      }
+      XR_LOG_INFO("Port %d buffer: %d bytes @ %d baud", port.uart_index, share,
+                  port.config.baudrate);
+    }
+  }
+
+  /**
+   * @brief 把旧队列最早的数据搬进新队列，放不下的留在旧队列 /
+   *        Move the oldest data of one queue into another, leaving what does
+   *        not fit behind
+   *
+   * 分帧端口逐条搬运整条记录。
+   * Framed ports move whole records one at a time.
+   *
+   * @return 搬过去的字节数 / Bytes moved
+   */
+  static size_t MoveQueued(LibXR::BaseQueue &from, LibXR::BaseQueue &to,
+                           bool framed) {
+    uint8_t chunk[256];
+    size_t moved = 0;
+    while (true) {
+      size_t take = LibXR::min(from.Size(), to.EmptySize());
+      if (framed) {
+        PacketRecord record;
+        if (from.Size() < sizeof(record)) {
+          break;
+        }
+        from.PeekBatch(&record, sizeof(record));
+        if (sizeof(record) + record.len > take) {
+          break;
+        }
+        take = sizeof(record) + record.len;
+      }
+      if (take == 0) {
+        break;
+      }
+      for (size_t left = take; left > 0;) {
+        size_t len = LibXR::min(left, sizeof(chunk));
+        from.PopBatch(chunk, len);
+        to.PushBatch(chunk, len);
+        left -= len;
+      }
+      moved += take;
+    }
+    return moved;
+  }
+
+  /**
+   * @brief 推送控制帧（命令回复、心跳）到优先通道 /
+   *        Push a control frame (command reply, ping) to the priority lane
+   */
+  void PushControl(const CommandFrame &frame) {
+    LibXR::Mutex::LockGuard guard(to_net_data_queue_mutex_);
+    to_net_ctrl_queue_.PushBatch(&frame, sizeof(frame));
+    // 应答由接收任务产生，唤醒发送任务以免等满退避时间
+    // Replies come from the RX task; wake TX instead of waiting out its
+    // backoff
+    if (net_idle_ms_ > 1) {
+      WakeNet();
+    }
+  }
+
+  /**
+   * @brief 打包命令帧并推送到优先通道 / Pack a command and push it to the
+   *        priority lane
+   */
+  void PushCommand(const Command &cmd) {
+    CommandFrame frame;
+    LibXR::Topic::PackData(command_topic_.GetKey(), frame, cmd);
+    PushControl(frame);
+  }
+
+  /**
+   * @brief 组装一批待发送的网络数据 / Build one batch of outbound network data
+   *
+   * 控制通道严格优先；随后先服务超过时延上限的端口，再按权重做差额轮询
+   * （DRR），每个端口每轮最多打包 weight * SCHED_QUANTUM 字节。
+   * The control lane has strict priority. Ports whose oldest byte exceeded
+   * their latency bound are served next, then the rest share the remaining
+   * space by deficit round robin with weight * SCHED_QUANTUM bytes per round.
+   *
+   * @return 写入 buf 的字节数 / Bytes written to buf
+   */
+  size_t BuildNetBatch(uint8_t *buf, size_t size) {
+    static uint8_t chunk[4096];
+    LibXR::Mutex::LockGuard guard(to_net_data_queue_mutex_);
+
+    segment_num_ = 0;
+    batch_framing_ = framing_;
+    bool v2 = batch_framing_ == FRAMING_V2;
+
+    // v2 超级帧：[0xA6][长度 u16 LE][条目...][CRC16 LE]
+    // v2 super-frame: [0xA6][length u16 LE][entries...][CRC16 LE]
+    size_t used = v2 ? V2_HEADER_SIZE : 0;
+    size_t limit = v2 ? size - V2_TRAILER_SIZE : size;
+    size_t overhead = v2 ? V2_ENTRY_MAX_HEADER : LibXR::Topic::PACK_BASE_SIZE;
+
+    size_t ctrl_len = to_net_ctrl_queue_.Size();
+    if (v2) {
+      ctrl_len = limit > used + overhead
+                     ? LibXR::min(ctrl_len, limit - used - overhead)
+                     : 0;
+    } else {
+      ctrl_len = LibXR::min(ctrl_len, limit);
+    }
+    if (ctrl_len > 0) {
+      to_net_ctrl_queue_.PopBatch(buf + used + (v2 ? overhead : 0), ctrl_len);
+      // 控制通道只有命令帧，每发完一帧计入一条命令
+      // The control lane only holds command frames; each finished frame
+      // counts one command
+      ctrl_popped_ += ctrl_len;
+      framing_stats_.payload_bytes +=
+          ctrl_popped_ / sizeof(CommandFrame) * sizeof(Command);
+      ctrl_popped_ %= sizeof(CommandFrame);
+      used = v2 ? FinishEntry(buf, used, ctrl_len, SEGMENT_CONTROL)
+                : AddSegment(used, ctrl_len, SEGMENT_CONTROL);
+    }
+
+    // 控制帧未发完时不插入数据帧，避免打断帧
+    // Never interleave data into an unfinished control frame
+    if (to_net_ctrl_queue_.Size() > 0) {
+      return SealBatch(buf, used);
+    }
+
+    // 跟踪导出期间暂停数据，避免数据通路本身干扰 / Data waits while the trace
+    // dump runs, so the data path does not disturb it
+    if (trace_.Dumping()) {
+      size_t reserve = v2 ? overhead : 0;
+      if (limit > used + reserve) {
+        size_t drained = DrainTrace(buf + used + reserve, limit - used - reserve);
+        if (drained > 0) {
+          used = v2 ? FinishEntry(buf, used, drained, SEGMENT_TRACE)
+                    : AddSegment(used, drained, SEGMENT_TRACE);
+        }
+      }
+      return SealBatch(buf, used);
+    }
+
+    // 离线数据先于实时数据发送 / Offline capture drains ahead of live data
+    if (!capture_.Empty()) {
+      size_t reserve = v2 ? overhead : 0;
+      if (limit > used + reserve) {
+        size_t drained =
+            DrainCapture(buf + used + reserve, limit - used - reserve);
+        if (drained > 0) {
+          used = v2 ? FinishEntry(buf, used, drained, SEGMENT_CAPTURE)
+                    : AddSegment(used, drained, SEGMENT_CAPTURE);
+        }
+      }
+      return SealBatch(buf, used);
+    }
+
+    auto serve = [&](UartInfo &port, size_t quota) -> size_t {
+      if (used + overhead >= limit) {
+        return 0;
+      }
+      size_t room = LibXR::min(limit - used - overhead, sizeof(chunk));
+      uint8_t *dst = v2 ? buf + used + overhead : chunk;
+      size_t len = 0;
+      size_t payload = 0;
+      {
+        TraceScope trace(trace_, TraceRing::Task::TX,
+                         TraceRing::Stage::QUEUE_POP, port.uart_index);
+        if (port.framer && port.framer->Active()) {
+          len = PopRecords(*port.net_queue, dst, quota, room, payload);
+        } else {
+          len = LibXR::min(LibXR::min(port.net_queue->Size(), quota), room);
+          port.net_queue->PopBatch(dst, len);
+          payload = len;
+        }
+        if (len == 0) {
+          trace.Cancel();
+          return 0;
+        }
+        trace.Finish(port.uart_index, len);
+      }
+      if (v2) {
+        used = FinishEntry(buf, used, len, port.uart_index);
+      } else {
+        TraceScope trace(trace_, TraceRing::Task::TX, TraceRing::Stage::PACK,
+                         port.uart_index, len);
+        LibXR::Topic::PackData(
+            LibXR::Topic::TopicHandle(port.topic)->data_.crc32,
+            {buf + used, size - used}, {chunk, len});
+        used = AddSegment(used, len + LibXR::Topic::PACK_BASE_SIZE,
+                          port.uart_index);
+      }
+      framing_stats_.payload_bytes += payload;
+      port.age.Pop(len);
+      return len;
+    };
+
+    // 抓取通道与普通端口各占一半，没有普通数据时独占；一半放不下队首记录
+    // 时让给它，以免抓取通道在端口持续有数据时卡住
+    // The tap lane gets half the batch, or all of it with no plain port data;
+    // if half cannot hold the head record it gets that much, so the lane
+    // never stalls behind busy ports
+    if (tap_queue_.Size() > 0) {
+      size_t reserve = v2 ? overhead : 0;
+      size_t budget = limit - LibXR::min(limit, used + reserve);
+      for (uint8_t i = 0; i < port_num_; i++) {
+        if (ports_[i]->net_queue->Size() > 0) {
+          budget = LibXR::min(budget, LibXR::max(budget / 2, TapHeadSize()));
+          break;
+        }
+      }
+      size_t drained = DrainTap(buf + used + reserve, budget);
+      if (drained > 0) {
+        used = v2 ? FinishEntry(buf, used, drained, SEGMENT_TAP)
+                  : AddSegment(used, drained, SEGMENT_TAP);
+      }
+    }
+
+    // 超时的端口只补发已超时的字节，每批最多一个配额，按等待时长从久到新
+    // Overdue ports only get their overdue bytes, at most one quantum each
+    // per batch, oldest first
+    uint32_t now = LibXR::Timebase::GetMilliseconds();
+    uint32_t overdue_mask = 0;
+    while (true) {
+      UartInfo *oldest = nullptr;
+      for (uint8_t i = 0; i < port_num_; i++) {
+        auto &port = *ports_[i];
+        if (port.latency_ms == 0 || (overdue_mask & (1u << i)) ||
+            port.net_queue->Size() == 0 ||
+            now - port.age.OldestMs(now) < port.latency_ms) {
+          continue;
+        }
+        if (!oldest || static_cast<int32_t>(port.age.OldestMs(now) -
+                                            oldest->age.OldestMs(now)) < 0) {
+          oldest = &port;
+        }
+      }
+      if (!oldest) {
+        break;
+      }
+      overdue_mask |= 1u << oldest->uart_index;
+      size_t overdue = oldest->age.BytesSince(now - oldest->latency_ms);
+      serve(*oldest, LibXR::min<size_t>(overdue,
+                                        oldest->weight * SCHED_QUANTUM));
+    }
+
+    // 差额轮询：每个端口轮到时只加一次配额，批次装满时停在当前端口，下一批
+    // 从这里继续，因此差额不超过一个配额
+    // Deficit round robin: a port earns its quantum once per visit; when the
+    // batch fills up the cursor stays on it and the next batch resumes
+    // there, so a deficit never exceeds one quantum
+    for (uint8_t n = 0; n < port_num_ && used + overhead < limit; n++) {
+      auto &port = *ports_[sched_cursor_];
+      if (port.net_queue->Size() > 0) {
+        if (!sched_visited_) {
+          port.deficit += port.weight * SCHED_QUANTUM;
+          sched_visited_ = true;
+        }
+        size_t sent = serve(port, port.deficit);
+        port.deficit -= LibXR::min<uint32_t>(port.deficit, sent);
+        if (port.deficit > 0 && port.net_queue->Size() > 0) {
+          break;
+        }
+      }
+      if (port.net_queue->Size() == 0) {
+        port.deficit = 0;
+      }
+      sched_cursor_ = (sched_cursor_ + 1) % port_num_;
+      sched_visited_ = false;
+    }
+
+    return SealBatch(buf, used);
+  }
+
+  /**
+   * @brief 从分帧端口的上行队列取出整条记录 / Pop whole records off a
+   *        framed port's uplink queue
+   *
+   * 在 quota 内尽量多取；队首记录超过 quota 但放得进 room 时也取这一条，
+   * 否则配额小的端口上的大记录永远轮不到。
+   * Takes as many as fit in quota; a head record larger than quota is still
+   * taken when it fits in room, or a big record on a port with a small
+   * quota would never be served.
+   *
+   * @param payload 去掉记录头后的字节数 / Bytes without record headers
+   * @return 取出的字节数 / Bytes popped
+   */
+  static size_t PopRecords(LibXR::BaseQueue &queue, uint8_t *dst,
+                           size_t quota, size_t room, size_t &payload) {
+    size_t len = 0;
+    payload = 0;
+    while (queue.Size() >= sizeof(PacketRecord)) {
+      PacketRecord record;
+      queue.PeekBatch(&record, sizeof(record));
+      size_t size = sizeof(record) + record.len;
+      if (len + size > (len == 0 ? room : LibXR::min(quota, room))) {
+        break;
+      }
+      queue.PopBatch(dst + len, size);
+      len += size;
+      payload += record.len;
+    }
+    return len;
+  }
+
+  /**
+   * @brief 记录一段 v1 帧 / Record a run of v1 frames
+   * @return 段结束位置 / End offset of the segment
+   */
+  size_t AddSegment(size_t offset, size_t len, uint8_t port) {
+    if (len > 0 && segment_num_ < MAX_NET_SEGMENTS) {
+      size_t data_len = port < MAX_PORT_NUM
+                            ? len - LibXR::Topic::PACK_BASE_SIZE
+                            : len;
+      segments_[segment_num_++] = {
+          static_cast<uint16_t>(offset), static_cast<uint16_t>(len),
+          static_cast<uint16_t>(offset), static_cast<uint16_t>(data_len),
+          port};
+    }
+    return offset + len;
+  }
+
+  /**
+   * @brief 写入 v2 条目头 [端口][varint 长度]，负载已位于预留头之后 /
+   *        Write a v2 entry header [port][varint length]; the payload
+   *        already sits behind the reserved header
+   *
+   * 头部不足预留长度时前移负载，只有小于 128 字节的负载会被移动。
+   * When the header is shorter than reserved the payload moves forward,
+   * which only happens for payloads under 128 bytes.
+   *
+   * @return 条目结束位置 / End offset of the entry
+   */
+  size_t FinishEntry(uint8_t *buf, size_t offset, size_t len, uint8_t port) {
+    uint8_t header[V2_ENTRY_MAX_HEADER];
+    size_t header_len = 0;
+    header[header_len++] = port;
+    size_t value = len;
+    do {
+      uint8_t byte = value & 0x7f;
+      value >>= 7;
+      header[header_len++] = value ? (byte | 0x80) : byte;
+    } while (value);
+
+    if (header_len < V2_ENTRY_MAX_HEADER) {
+      memmove(buf + offset + header_len,
+              buf + offset + V2_ENTRY_MAX_HEADER, len);
+    }
+    memcpy(buf + offset, header, header_len);
+
+    if (segment_num_ < MAX_NET_SEGMENTS) {
+      segments_[segment_num_++] = {
+          static_cast<uint16_t>(offset),
+          static_cast<uint16_t>(header_len + len),
+          static_cast<uint16_t>(offset + header_len),
+          static_cast<uint16_t>(len), port};
+    }
+    return offset + header_len + len;
+  }
+
+  /**
+   * @brief 补全 v2 超级帧头尾，v1 原样返回 /
+   *        Complete the v2 super-frame header and trailer; v1 is returned as
+   *        is
+   */
+  size_t SealBatch(uint8_t *buf, size_t used) {
+    if (batch_framing_ != FRAMING_V2) {
+      return used;
+    }
+    size_t body = used - V2_HEADER_SIZE;
+    if (body == 0) {
+      return 0;
+    }
+    buf[0] = V2_MAGIC;
+    buf[1] = static_cast<uint8_t>(body);
+    buf[2] = static_cast<uint8_t>(body >> 8);
+    uint16_t crc = LibXR::CRC16::Calculate(buf + V2_HEADER_SIZE, body);
+    buf[used++] = static_cast<uint8_t>(crc);
+    buf[used++] = static_cast<uint8_t>(crc >> 8);
+    return used;
+  }
+
+  /**
+   * @brief 处理 WebSocket 连接与下行数据 / Service the WebSocket connection
+   *        and its downlink data
+   *
+   * 使用独立的 Topic::Server，避免与 TCP 流的半帧交错。握手令牌优先取
+   * CONFIG_WS_TOKEN 设置的值，其次由数据面密钥派生；两者都没有时与原始
+   * TCP 一样不鉴权。启用数据面加密后只在有令牌时提供端点。
+   * Uses its own Topic::Server so partial frames never interleave with the
+   * TCP stream. The handshake token is the one set by CONFIG_WS_TOKEN, else
+   * the one derived from the data plane key; with neither, clients are not
+   * authenticated, just like raw TCP. With the data plane cipher on, the
+   * endpoint is only served while a token is in effect.
+   *
+   * 会话期间由接收任务调用，下行解析与 TCP 一样不占用发送任务；没有会话时
+   * 接收任务空闲，由发送任务调用。
+   * During a session the RX task calls this, so the downlink is parsed off
+   * the TX task just like TCP; without a session the RX task is idle and the
+   * TX task calls it instead.
+   *
+   * @param task 调用本函数的任务 / Task calling this function
+   * @return 本次收到的字节数 / Bytes received by this call
+   */
+  size_t PollWebSocket(TraceRing::Task task) {
+    // 令牌来源变化时刷新握手令牌 / Refresh the handshake token whenever
+    // its source changes
+    if (ws_token_key_ != data_key_->data_ ||
+        ws_token_set_ != ws_token_db_->data_) {
+      ws_token_key_ = data_key_->data_;
+      ws_token_set_ = ws_token_db_->data_;
+      uint8_t token[WebSocketServer::TOKEN_SIZE];
+      const uint8_t *active = nullptr;
+      if (HasWsToken()) {
+        active = ws_token_set_.data();
+      } else if (HasDataKey() && DataCipher::DeriveWebSocketToken(
+                                     ws_token_key_.data(), token) ==
+                                     ErrorCode::OK) {
+        active = token;
+      }
+      ws_token_active_ = active != nullptr;
+      websocket_.SetToken(active);
+    }
+    // 启用加密后不提供免鉴权的明文端点 / No unauthenticated plaintext
+    // endpoint once the cipher is on
+    if (cipher_enable_key_->data_ && !ws_token_active_) {
+      websocket_.Close();
+      return 0;
+    }
+    if (!websocket_.Listening() &&
+        websocket_.Start(tcp_port_ + WEBSOCKET_PORT_OFFSET) != ErrorCode::OK) {
+      return 0;
+    }
+    return websocket_.Poll([&](const uint8_t *data, size_t len) {
+      LibXR::Mutex::LockGuard guard(downlink_mutex_);
+      downlink_task_ = task;
+      ws_net_server_.ParseData({data, len});
+    });
+  }
+
+  /**
+   * @brief 将刚组装的批次镜像到 WebSocket，直接引用 buf 不拷贝 /
+   *        Mirror the batch just built to the WebSocket, sent from buf
+   *        without a copy
+   */
+  void ServeWebSocket(const uint8_t *buf, size_t len) {
+    if (!websocket_.Streaming() || len == 0) {
+      return;
+    }
+
+    auto filter = websocket_.PortFilter();
+    if (batch_framing_ == FRAMING_V1 && filter == WebSocketServer::ALL_PORTS) {
+      websocket_.SendMessage(buf, len);
+      return;
+    }
+
+    for (size_t i = 0; i < segment_num_; i++) {
+      auto &seg = segments_[i];
+      if (filter != WebSocketServer::ALL_PORTS && seg.port != filter) {
+        continue;
+      }
+      if (batch_framing_ == FRAMING_V1) {
+        websocket_.SendMessage(buf + seg.offset, seg.len);
+      } else if (seg.port >= MAX_PORT_NUM) {
+        // 控制与离线数据本身就是 Topic 帧 / Already Topic frames
+        websocket_.SendMessage(buf + seg.data_offset, seg.data_len);
+      } else {
+        // 浏览器只懂 v1，逐条目重新打包 / Browsers speak v1 only, repack
+        static uint8_t frame[4096 + LibXR::Topic::PACK_BASE_SIZE];
+        LibXR::Topic::PackData(
+            LibXR::Topic::TopicHandle(ports_[seg.port]->topic)->data_.crc32,
+            {frame, sizeof(frame)}, {buf + seg.data_offset, seg.data_len});
+        websocket_.SendMessage(frame,
+                               seg.data_len + LibXR::Topic::PACK_BASE_SIZE);
+      }
+    }
+  }
+
+  /**
+   * @brief 没有 TCP 主机时单独服务 WebSocket / Serve the WebSocket alone
+   *        while no TCP host is connected
+   * @return 是否有浏览器连接 / Whether a browser is attached
+   */
+  bool ServeWebSocketOnly() {
+    uint64_t loop_start_us = LibXR::Timebase::GetMicroseconds();
+    size_t received = PollWebSocket(TraceRing::Task::TX);
+    if (!websocket_.Streaming()) {
+      return false;
+    }
+
+    static uint8_t send_buf[4096];
+    auto len = BuildNetBatch(send_buf, sizeof(send_buf));
+    ServeWebSocket(send_buf, len);
+
+    if (received > 0 || len > 0) {
+      net_idle_ms_ = 1;
+    } else {
+      net_idle_ms_ = LibXR::min(net_idle_ms_ * 2, NET_IDLE_MAX_MS);
+    }
+    AccountWakeup(LibXR::Timebase::GetMicroseconds() - loop_start_us);
+    WaitNet(net_idle_ms_);
+    return true;
+  }
+
+  bool HostAttached() const {
+    return mode_ == Mode::CONNECTED || websocket_.Streaming();
+  }
+
+  /**
+   * @brief 无主机连接或离线数据未发完时，将网络方向数据转入离线存储 /
+   *        Divert network-bound data to the capture store while no host is
+   *        connected or the backlog has not drained
+   *
+   * 积压期间实时数据也追加到存储末尾，保证每个端口的数据按时间顺序送达。
+   * Live data is appended behind the backlog meanwhile, so every port's data
+   * still arrives in order.
+   *
+   * @return 是否已转入存储 / Whether the data was diverted
+   */
+  bool StageCapture(UartInfo &src, LibXR::ConstRawData data) {
+    if (!capture_.Ready()) {
+      return false;
+    }
+
+    LibXR::Mutex::LockGuard guard(capture_mutex_);
+    if (HostAttached() && !capture_backlog_) {
+      return false;
+    }
+
+    capture_backlog_ = true;
+    CaptureStage stage{LibXR::Timebase::GetMicroseconds(),
+                       static_cast<uint16_t>(data.size_), src.uart_index};
+    if (capture_queue_.EmptySize() < sizeof(stage) + data.size_) {
+      capture_dropped_ += data.size_;
+      return true;
+    }
+    capture_queue_.PushBatch(&stage, sizeof(stage));
+    capture_queue_.PushBatch(data.addr_, data.size_);
+    return true;
+  }
+
+  /**
+   * @brief 将暂存数据写入闪存，只在网络线程调用 /
+   *        Move staged data into flash; network thread only
+   */
+  void ServiceCapture() {
+    static uint8_t buf[4096];
+    if (!capture_.Ready()) {
+      return;
+    }
+
+    bool appended = false;
+    while (true) {
+      CaptureStage stage;
+      {
+        LibXR::Mutex::LockGuard guard(capture_mutex_);
+        if (capture_queue_.Size() == 0) {
+          if (capture_.Empty()) {
+            capture_backlog_ = false;
+          }
+          if (capture_dropped_ > 0) {
+            XR_LOG_WARN("Capture staging full, %d bytes dropped",
+                        capture_dropped_);
+            capture_dropped_ = 0;
+          }
+          break;
+        }
+        capture_queue_.PopBatch(&stage, sizeof(stage));
+        capture_queue_.PopBatch(buf, stage.len);
+      }
+      capture_.Append(stage.port, stage.timestamp_us, buf, stage.len);
+      appended = true;
+    }
+
+    uint32_t now = LibXR::Timebase::GetMilliseconds();
+    if (appended) {
+      capture_dirty_ = true;
+    } else if (capture_dirty_ && now - capture_sync_ms_ >= CAPTURE_SYNC_MS) {
+      capture_.Sync();
+      capture_dirty_ = false;
+      capture_sync_ms_ = now;
+    }
+  }
+
+  /**
+   * @brief 将离线记录打包到 capture Topic /
+   *        Pack offline records into capture topic frames
+   *
+   * 负载为 [端口 u8][启动计数 u16 LE][时间戳 us u64 LE][数据]。
+   * Payload is [port u8][boot u16 LE][timestamp us u64 LE][data].
+   */
+  size_t DrainCapture(uint8_t *buf, size_t size) {
+    static uint8_t record[CAPTURE_RECORD_HEADER + CaptureStore::MAX_PAYLOAD];
+    size_t used = 0;
+
+    while (true) {
+      size_t len = capture_.PeekSize();
+      size_t frame = LibXR::Topic::PACK_BASE_SIZE + CAPTURE_RECORD_HEADER + len;
+      if (len == 0 || used + frame > size) {
+        break;
+      }
+
+      uint16_t boot = 0;
+      uint64_t timestamp_us = 0;
+      capture_.Read(record[0], boot, timestamp_us,
+                    record + CAPTURE_RECORD_HEADER, CaptureStore::MAX_PAYLOAD);
+      memcpy(record + 1, &boot, sizeof(boot));
+      memcpy(record + 3, &timestamp_us, sizeof(timestamp_us));
+      LibXR::Topic::PackData(
+          LibXR::Topic::TopicHandle(capture_topic_)->data_.crc32,
+          {buf + used, size - used}, {record, CAPTURE_RECORD_HEADER + len});
+      used += frame;
+      framing_stats_.payload_bytes += len;
+    }
+
+    return used;
+  }
+
+  /**
+   * @brief 将跟踪事件打包为 trace Topic 帧 / Pack trace events into trace
+   *        topic frames
+   *
+   * 负载为连续的 TraceRing::Event。
+   * Payload is a run of TraceRing::Event.
+   */
+  size_t DrainTrace(uint8_t *buf, size_t size) {
+    static TraceRing::Event events[TRACE_CHUNK_EVENTS];
+    size_t used = 0;
+
+    while (trace_.Dumping() &&
+           used + LibXR::Topic::PACK_BASE_SIZE + sizeof(events) <= size) {
+      size_t n = trace_.ReadDump(events, TRACE_CHUNK_EVENTS);
+      if (n == 0) {
+        break;
+      }
+      size_t len = n * sizeof(events[0]);
+      LibXR::Topic::PackData(
+          LibXR::Topic::TopicHandle(trace_topic_)->data_.crc32,
+          {buf + used, size - used}, {events, len});
+      used += LibXR::Topic::PACK_BASE_SIZE + len;
+      framing_stats_.payload_bytes += len;
+    }
+
+    return used;
+  }
+
+  /**
+   * @brief 抓取队列队首记录打包后的长度 / Packed size of the record at the
+   *        head of the tap queue
+   */
+  size_t TapHeadSize() {
+    LibXR::Mutex::LockGuard guard(tap_mutex_);
+    if (tap_queue_.Size() == 0) {
+      return 0;
+    }
+    TapHeader header;
+    tap_queue_.PeekBatch(&header, sizeof(header));
+    return LibXR::Topic::PACK_BASE_SIZE + sizeof(header) + header.len;
+  }
+
+  /**
+   * @brief 将抓取记录打包为 tap Topic 帧 / Pack tap records into tap topic
+   *        frames
+   *
+   * 每帧负载为若干条 [TapHeader][数据]，记录不会跨帧拆分。
+   * Each payload is a run of [TapHeader][data] records, never split across
+   * frames.
+   */
+  size_t DrainTap(uint8_t *buf, size_t size) {
+    static uint8_t payload[TAP_PAYLOAD_SIZE];
+    size_t used = 0;
+    LibXR::Mutex::LockGuard guard(tap_mutex_);
+
+    while (tap_queue_.Size() > 0) {
+      size_t len = 0;
+      while (tap_queue_.Size() > 0) {
+        TapHeader header;
+        tap_queue_.PeekBatch(&header, sizeof(header));
+        size_t record = sizeof(header) + header.len;
+        if (len + record > sizeof(payload) ||
+            used + LibXR::Topic::PACK_BASE_SIZE + len + record > size) {
+          break;
+        }
+        tap_queue_.PopBatch(payload + len, record);
+        len += record;
+        framing_stats_.payload_bytes += header.len;
+      }
+      if (len == 0) {
+        break;
+      }
+      LibXR::Topic::PackData(
+          LibXR::Topic::TopicHandle(tap_topic_)->data_.crc32,
+          {buf + used, size - used}, {payload, len});
+      used += LibXR::Topic::PACK_BASE_SIZE + len;
+    }
+
+    return used;
+  }
+
+  static void ThreadFun(NetDebugLink *self) {
+    static uint8_t buf[8192];
+
+    while (true) {
+      self->mode_ = Mode::SCANING;
+
+      struct sockaddr_in addr{};
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons(self->udp_port_);
+      addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+      int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+      if (sock < 0) {
+        XR_LOG_ERROR("socket failed");
+        continue;
+      }
+
+      if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        XR_LOG_ERROR("bind failed");
+        close(sock);
+        continue;
+      }
+
+      struct timeval timeout = {.tv_sec = 0,
+                                .tv_usec = DISCOVERY_TIMEOUT_MS * 1000};
+      setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+      while (true) {
+        self->ServiceCapture();
+        if (self->cdc_host_) {
+          self->OnCdcAttached();
+          self->mode_ = Mode::SCANING;
+          continue;
+        }
+
+        self->PollWifi();
+        if (self->wifi_state_ != WifiState::ONLINE) {
+          LibXR::Thread::Sleep(WIFI_POLL_MS);
+          continue;
+        }
+
+        // 浏览器直连时不阻塞在发现报文上，按 TCP 路径的节奏服务 WebSocket
+        // With a browser attached, serve the WebSocket at the TCP path's
+        // pace instead of blocking on discovery
+        bool ws_streaming = self->ServeWebSocketOnly();
+
+        struct sockaddr_in sender;
+        socklen_t sender_len = sizeof(sender);
+        int len = recvfrom(sock, buf, sizeof(buf) - 1,
+                           ws_streaming ? MSG_DONTWAIT : 0,
+                           (struct sockaddr *)&sender, &sender_len);
+        if (len < 0 && ws_streaming) {
+          continue;
+        }
+        if (len >= 0) {
+          buf[len] = 0;
+          XR_LOG_INFO("Received from %s: %s", inet_ntoa(sender.sin_addr), buf);
+
+          bool filter_match = false;
+
+          if (strncmp(reinterpret_cast<char *>(buf), DISCOVERY_MSG_FILTERED,
+                      sizeof(DISCOVERY_MSG_FILTERED) - 1) == 0) {
+            if (strstr(&self->device_name_key_->data_[0],
+                       reinterpret_cast<char *>(
+                           &buf[sizeof(DISCOVERY_MSG_FILTERED)])) != nullptr) {
+              filter_match = true;
+            }
+          } else if (strncmp(reinterpret_cast<char *>(buf),
+                             DISCOVERY_MSG_DEFAULT,
+                             sizeof(DISCOVERY_MSG_DEFAULT) - 1) == 0) {
+            filter_match = true;
+          }
+
+          if (filter_match) {
+            self->OnConnected(&sender);
+            self->mode_ = Mode::SCANING;
+          } else {
+            self->mode_ = Mode::SCANING;
+          }
+        } else {
+          XR_LOG_DEBUG("recvfrom timed out");
+          self->mode_ = Mode::SCANING;
+        }
+      }
+
+      close(sock);
+    }
+  }
+
+  /**
+   * @brief 通过 TCP 连接发现报文的发送方并运行会话 /
+   *        Connect to the sender of a discovery message over TCP and run the
+   *        session
+   */
+  void OnConnected(struct sockaddr_in *addr) {
+    TcpTransport tcp;
+    if (tcp.Open(*addr, tcp_port_) != ErrorCode::OK) {
+      return;
+    }
+
+    bool encrypted = cipher_enable_key_->data_ && HasDataKey();
+    if (encrypted && StartCipherSession(tcp) != ErrorCode::OK) {
+      XR_LOG_ERROR("Data cipher session setup failed");
+      return;
+    }
+
+    // USB 主机出现时让出链路 / Hand over as soon as a USB host shows up
+    RunSession(tcp, encrypted, [&]() {
+      return !smartconfig_requested_ && wifi_->IsConnected() && !cdc_host_;
+    });
+
+    // 只有 WiFi 断线计入 reconnect_ms，主机主动断开或换到 CDC 不算
+    // Only a WiFi loss counts towards reconnect_ms, not a host disconnect or
+    // a switch to CDC
+    if (!wifi_->IsConnected()) {
+      MarkLinkDown();
+    }
+  }
+
+  /**
+   * @brief 交换会话随机数并装载本连接的会话密钥 /
+   *        Exchange session nonces and load this connection's session key
+   *
+   * 连接建立后设备先以明文发送 16 字节随机数，主机回复自己的 16 字节随机数，
+   * 之后双方才开始收发加密记录。
+   * Right after connecting the device sends 16 random bytes in the clear and
+   * the host answers with 16 random bytes of its own; only then do both
+   * sides start exchanging cipher records.
+   */
+  ErrorCode StartCipherSession(NetTransport &transport) {
+    uint8_t device_nonce[DataCipher::SESSION_NONCE_SIZE];
+    uint8_t host_nonce[DataCipher::SESSION_NONCE_SIZE];
+    FillRandom(device_nonce, sizeof(device_nonce));
+
+    size_t sent = 0, received = 0;
+    uint32_t start_ms = LibXR::Timebase::GetMilliseconds();
+    while (received < sizeof(host_nonce)) {
+      if (LibXR::Timebase::GetMilliseconds() - start_ms >=
+          SESSION_HELLO_TIMEOUT_MS) {
+        return ErrorCode::TIMEOUT;
+      }
+      int ans = sent < sizeof(device_nonce)
+                    ? transport.Send(device_nonce + sent,
+                                     sizeof(device_nonce) - sent)
+                    : transport.Receive(host_nonce + received,
+                                        sizeof(host_nonce) - received);
+      if (ans < 0) {
+        return ErrorCode::FAILED;
+      }
+      if (ans == 0) {
+        LibXR::Thread::Sleep(1);
+      } else if (sent < sizeof(device_nonce)) {
+        sent += ans;
+      } else {
+        received += ans;
+      }
+    }
+
+    return cipher_.Start(data_key_->data_.data(), device_nonce, host_nonce);
+  }
+
+  /**
+   * @brief USB 主机在 CDC 上发出发现报文后，改由 CDC 承载会话 /
+   *        Carry the session over CDC once a USB host sends the discovery
+   *        message there
+   *
+   * CDC 是本地线缆，不做数据面加密。期间端口 0 不再作为普通桥接端口。
+   * CDC is a local cable and skips the data plane cipher. Port 0 is not
+   * bridged meanwhile, and standard output muted by AttachCdcHost is restored
+   * once the session ends.
+   */
+  void OnCdcAttached() {
+    XR_LOG_INFO("USB host attached, streaming over CDC");
+    cdc_transport_->Open();
+    RunSession(*cdc_transport_, false, []() { return true; });
+    cdc_host_ = false;
+    if (muted_stdio_ != nullptr) {
+      LibXR::STDIO::write_ = muted_stdio_;
+      muted_stdio_ = nullptr;
+    }
+    XR_LOG_INFO("USB host detached");
+  }
+
+  /**
+   * @brief 在一条链路上运行会话，直到链路断开或 keep_running 返回 false /
+   *        Run the session over one link until it drops or keep_running
+   *        returns false
+   *
+   * 本任务只负责上行；接收与解析由接收任务完成，链路断开时由它通知。
+   * 上行队列、离线存储与未送达的批次都不随链路释放，下一条链路从断点继续。
+   * This task only handles the uplink; the RX task receives and parses, and
+   * reports when the link drops. Uplink queues, the capture store and any
+   * undelivered batch outlive the link, so the next link picks up where this
+   * one stopped.
+   */
+  template <typename KeepRunning>
+  void RunSession(NetTransport &transport, bool encrypted,
+                  KeepRunning &&keep_running) {
+    static uint8_t batch_buf[NET_HOLD_SIZE];
+    static uint8_t record_buf[NET_BATCH_SIZE + DataCipher::OVERHEAD];
+
+    // 每条连接从 v1 开始，主机发送 FRAMING 后切换
+    // Every connection starts in v1 until the host sends FRAMING
+    mode_ = Mode::CONNECTED;
+    framing_ = FRAMING_V1;
+    framing_stats_ = {};
+    flow_resync_ = true;
+    {
+      // 新链路的时延与旧链路无关，心跳从最快间隔重新探测
+      // A new link's latency has nothing to do with the old one; probe
+      // again from the fastest keepalive interval
+      LibXR::Mutex::LockGuard guard(link_mutex_);
+      link_ = {};
+    }
+    XR_LOG_INFO("Session over %s", transport.Name());
+
+    session_transport_ = &transport;
+    session_encrypted_ = encrypted;
+    session_lost_ = false;
+    session_active_ = true;
+    rx_start_sem_.Post();
+
+    // 明文批次总给加密留出余量，换到加密链路时暂存的帧也能装进一条记录
+    // Always leave room for the cipher so held frames still fit one record
+    // after switching to an encrypted link
+    static constexpr size_t batch_room = NET_BATCH_SIZE - DataCipher::OVERHEAD;
+
+    while (keep_running() && !session_lost_) {
+      uint64_t loop_start_us = LibXR::Timebase::GetMicroseconds();
+
+      // 处理发送数据：上一条链路留下的帧优先，批次发完前不组装新批次
+      // Frames held from the previous link go first; no new batch is built
+      // until the one in flight is sent
+      ServiceCapture();
+      size_t len = 0;
+      if (pending_.len == 0) {
+        if (hold_num_ > 0) {
+          len = TakeHeldBatch(batch_buf, batch_room);
+        } else {
+          len = BuildNetBatch(batch_buf, batch_room);
+          ServeWebSocket(batch_buf, len);
+          pending_.framing = batch_framing_;
+          pending_.segment_num = segment_num_;
+          std::copy_n(segments_.begin(), segment_num_,
+                      pending_.segments.begin());
+        }
+        pending_.len = len;
+        pending_.ready_us = loop_start_us;
+      }
+
+      const uint8_t *out = encrypted ? record_buf : batch_buf;
+      if (pending_.len > 0 && pending_.wire_len == 0) {
+        if (encrypted) {
+          TraceScope trace(trace_, TraceRing::Task::TX,
+                           TraceRing::Stage::CIPHER, TraceRing::NO_PORT,
+                           pending_.len);
+          pending_.wire_len = cipher_.Seal(batch_buf, pending_.len, record_buf);
+          if (pending_.wire_len == 0) {
+            XR_LOG_ERROR("Data cipher seal failed, dropping %d bytes",
+                         pending_.len);
+            pending_ = {};
+          }
+        } else {
+          pending_.wire_len = pending_.len;
+        }
+      }
+      if (pending_.sent < pending_.wire_len) {
+        int ans;
+        {
+          TraceScope trace(trace_, TraceRing::Task::TX,
+                           TraceRing::Stage::NET_SEND, TraceRing::NO_PORT,
+                           pending_.wire_len - pending_.sent);
+          ans = transport.Send(out + pending_.sent,
+                               pending_.wire_len - pending_.sent);
+        }
+        if (ans < 0) {
+          break;
+        }
+        if (ans > 0) {
+          pending_.sent += ans;
+          framing_stats_.wire_bytes += ans;
+          MarkStreaming();
+        }
+        if (pending_.sent == pending_.wire_len) {
+          uint32_t flush_us = static_cast<uint32_t>(
+              LibXR::Timebase::GetMicroseconds() - pending_.ready_us);
+          task_stats_.tx_flush_max_us =
+              LibXR::max(task_stats_.tx_flush_max_us.load(), flush_us);
+          pending_ = {};
+        }
+      }
+      ReportTaskStats();
+
+      // 空闲时逐步延长等待，有上行数据或下行应答时被唤醒
+      // Back off while idle; outbound data or a downlink reply wakes us
+      if (pending_.len > 0) {
+        net_idle_ms_ = 1;
+      } else {
+        net_idle_ms_ = LibXR::min(net_idle_ms_ * 2, NET_IDLE_MAX_MS);
+      }
+      AccountWakeup(LibXR::Timebase::GetMicroseconds() - loop_start_us);
+      WaitNet(net_idle_ms_);
+    }
+
+    // 等接收任务离开链路后才能释放它 / The link may only go once RX has
+    // let go of it
+    session_active_ = false;
+    rx_done_sem_.Wait();
+    session_transport_ = nullptr;
+
+    HoldPendingBatch(batch_buf, encrypted);
+  }
+
+  /**
+   * @brief 接收任务：等待会话开始，随后持续接收直到会话结束 /
+   *        RX task: wait for a session, then receive until it ends
+   */
+  static void RxThreadFun(NetDebugLink *self) {
+    while (true) {
+      self->rx_start_sem_.Wait();
+      self->RunReceiver();
+      self->rx_done_sem_.Post();
+    }
+  }
+
+  /**
+   * @brief 读取链路并解析下行，串口写入也在本任务中阻塞 /
+   *        Read the link and parse the downlink; UART writes block here too
+   *
+   * 链路断开或认证失败时标记会话丢失并唤醒发送任务。
+   * On link loss or an authentication failure, mark the session lost and
+   * wake the TX task.
+   */
+  void RunReceiver() {
+    static uint8_t recv_buf[4096];
+    uint32_t idle_ms = 1;
+
+    while (session_active_) {
+      uint64_t start_us = LibXR::Timebase::GetMicroseconds();
+
+      size_t ws_received = PollWebSocket(TraceRing::Task::RX);
+
+      int bytes_received;
+      {
+        TraceScope trace(trace_, TraceRing::Task::RX,
+                         TraceRing::Stage::NET_RECV);
+        bytes_received =
+            session_transport_->Receive(recv_buf, sizeof(recv_buf));
+        if (bytes_received > 0) {
+          trace.Finish(TraceRing::NO_PORT, bytes_received);
+        } else {
+          trace.Cancel();
+        }
+      }
+
+      if (bytes_received == 0) {
+        if (ws_received > 0) {
+          idle_ms = 1;
+        } else {
+          idle_ms = LibXR::min(idle_ms * 2, NET_IDLE_MAX_MS);
+          LibXR::Thread::Sleep(idle_ms);
+        }
+        continue;
+      }
+
+      bool ok = bytes_received > 0;
+      if (ok && session_encrypted_) {
+        auto ans = cipher_.Open(
+            recv_buf, static_cast<size_t>(bytes_received),
+            [&](const uint8_t *plain, size_t plain_len) {
+              TraceScope trace(trace_, TraceRing::Task::RX,
+                               TraceRing::Stage::PARSE, TraceRing::NO_PORT,
+                               plain_len);
+              LibXR::Mutex::LockGuard guard(downlink_mutex_);
+              downlink_task_ = TraceRing::Task::RX;
+              from_net_server_.ParseData({plain, plain_len});
+            });
+        if (ans != ErrorCode::OK) {
+          XR_LOG_ERROR("Data cipher authentication failed");
+          ok = false;
+        }
+      } else if (ok) {
+        TraceScope trace(trace_, TraceRing::Task::RX, TraceRing::Stage::PARSE,
+                         TraceRing::NO_PORT, bytes_received);
+        LibXR::Mutex::LockGuard guard(downlink_mutex_);
+        downlink_task_ = TraceRing::Task::RX;
+        from_net_server_.ParseData(
+            {recv_buf, static_cast<size_t>(bytes_received)});
+        XR_LOG_PASS("Received %d bytes", bytes_received);
+      }
+      if (!ok) {
+        session_lost_ = true;
+        WakeNet();
+        return;
+      }
+
+      idle_ms = 1;
+      uint64_t busy_us = LibXR::Timebase::GetMicroseconds() - start_us;
+      // 发送任务会随时清零，用比较交换更新最大值 / The TX task may clear
+      // it at any time, so raise the maximum with a compare-exchange
+      uint32_t busy_max = task_stats_.rx_busy_max_us.load();
+      while (busy_us > busy_max &&
+             !task_stats_.rx_busy_max_us.compare_exchange_weak(
+                 busy_max, static_cast<uint32_t>(busy_us))) {
+      }
+      uint32_t now_ms = LibXR::Timebase::GetMilliseconds();
+      if (now_ms - task_stats_.rx_stack_check_ms >= POWER_STATS_PERIOD_MS) {
+        task_stats_.rx_stack_check_ms = now_ms;
+        task_stats_.rx_stack_free = StackHeadroom();
+      }
+      AccountWakeup(busy_us);
+    }
+  }
+
+  /**
+   * @brief 每秒上报一次收发任务统计并开始新窗口 /
+   *        Report task statistics once a second and start a new window
+   */
+  void ReportTaskStats() {
+    uint32_t now_ms = LibXR::Timebase::GetMilliseconds();
+    if (now_ms - task_stats_.window_start_ms < POWER_STATS_PERIOD_MS) {
+      return;
+    }
+
+    Command cmd{};
+    cmd.type = Command::Type::TASK_STATS;
+    cmd.data.task_stats.rx_stack_free = static_cast<uint16_t>(
+        LibXR::min<uint32_t>(task_stats_.rx_stack_free, UINT16_MAX));
+    cmd.data.task_stats.tx_stack_free = static_cast<uint16_t>(
+        LibXR::min<uint32_t>(StackHeadroom(), UINT16_MAX));
+    cmd.data.task_stats.rx_busy_max_us = task_stats_.rx_busy_max_us.exchange(0);
+    cmd.data.task_stats.tx_flush_max_us =
+        task_stats_.tx_flush_max_us.exchange(0);
+    task_stats_.window_start_ms = now_ms;
+    PushCommand(cmd);
+  }
+
+  /**
+   * @brief 链路断开时把未送达的部分以 v1 帧放回暂存区队首 /
+   *        On link loss, put the undelivered part of the batch in flight back
+   *        at the front of the hold area as v1 frames
+   *
+   * 已完整交给链路的 v1 段不再重发；加密记录和 v2 超级帧只能整体送达，部分发出
+   * 时整批保留。新连接从 v1 开始，因此 v2 条目逐条重新打包为 Topic 帧。
+   * v1 segments handed to the link in full are not resent; a cipher record or
+   * v2 super-frame is only delivered whole, so a partial send keeps the
+   * entire batch. A new connection starts in v1, so v2 entries are repacked
+   * into Topic frames one by one.
+   */
+  void HoldPendingBatch(const uint8_t *batch, bool encrypted) {
+    static uint8_t frames[NET_HOLD_SIZE];
+    std::array<NetSegment, MAX_NET_SEGMENTS> held{};
+    size_t len = 0, num = 0;
+    bool whole = encrypted || pending_.framing != FRAMING_V1;
+
+    for (size_t i = 0; i < pending_.segment_num; i++) {
+      auto &seg = pending_.segments[i];
+      if (!whole && seg.offset + seg.len <= pending_.sent) {
+        continue;
+      }
+
+      size_t frame_len;
+      if (pending_.framing == FRAMING_V1) {
+        frame_len = seg.len;
+        memcpy(frames + len, batch + seg.offset, frame_len);
+      } else if (seg.port >= MAX_PORT_NUM) {
+        // 控制与离线数据本身就是 Topic 帧 / Already Topic frames
+        frame_len = seg.data_len;
+        memcpy(frames + len, batch + seg.data_offset, frame_len);
+      } else {
+        frame_len = seg.data_len + LibXR::Topic::PACK_BASE_SIZE;
+        LibXR::Topic::PackData(
+            LibXR::Topic::TopicHandle(ports_[seg.port]->topic)->data_.crc32,
+            {frames + len, sizeof(frames) - len},
+            {batch + seg.data_offset, seg.data_len});
+      }
+      held[num++] = {static_cast<uint16_t>(len),
+                     static_cast<uint16_t>(frame_len), 0, 0, seg.port};
+      len += frame_len;
+    }
+    pending_ = {};
+    if (num == 0) {
+      return;
+    }
+
+    // 暂存区里更早的帧只可能来自同一批次，总长不会超过 NET_HOLD_SIZE
+    // Older held frames can only come from the same batch, so the total never
+    // exceeds NET_HOLD_SIZE
+    memmove(&hold_buf_[len], &hold_buf_[0], hold_len_);
+    memcpy(&hold_buf_[0], frames, len);
+    for (size_t i = 0; i < hold_num_; i++) {
+      hold_segments_[i].offset += len;
+    }
+    std::move_backward(hold_segments_.begin(),
+                       hold_segments_.begin() + hold_num_,
+                       hold_segments_.begin() + hold_num_ + num);
+    std::copy_n(held.begin(), num, hold_segments_.begin());
+    hold_len_ += len;
+    hold_num_ += num;
+    XR_LOG_INFO("Holding %d bytes for the next link", hold_len_);
+  }
+
+  /**
+   * @brief 从暂存区取出不超过 max 的整帧作为下一批 /
+   *        Take whole held frames up to max bytes as the next batch
+   */
+  size_t TakeHeldBatch(uint8_t *buf, size_t max) {
+    size_t len = 0, num = 0;
+    while (num < hold_num_ &&
+           (num == 0 || len + hold_segments_[num].len <= max)) {
+      len += hold_segments_[num++].len;
+    }
+
+    memcpy(buf, &hold_buf_[0], len);
+    pending_.framing = FRAMING_V1;
+    pending_.segment_num = num;
+    std::copy_n(hold_segments_.begin(), num, pending_.segments.begin());
+
+    memmove(&hold_buf_[0], &hold_buf_[len], hold_len_ - len);
+    std::copy(hold_segments_.begin() + num, hold_segments_.begin() + hold_num_,
+              hold_segments_.begin());
+    hold_len_ -= len;
+    hold_num_ -= num;
+    for (size_t i = 0; i < hold_num_; i++) {
+      hold_segments_[i].offset -= len;
+    }
+    return len;
+  }
+
+  void OnMonitor() override {}
+
+  void OnButton() { smartconfig_requested_ = true; }
+
+  void BlufiInit();
+
+  /**
+   * @brief 由 BLUFI 协商出的 PSK 派生并保存数据面密钥 /
+   *        Derive and store the data plane key from the BLUFI PSK
+   */
+  void SetDataKey(const uint8_t *psk, size_t psk_len) {
+    std::array<uint8_t, DataCipher::KEY_SIZE> key;
+    DataCipher::DeriveKey(psk, psk_len, key.data());
+    if (key != data_key_->data_) {
+      data_key_->Set(key);
+      XR_LOG_INFO("Data key updated from provisioning");
+    }
+  }
+
+  bool HasDataKey() const {
+    return std::any_of(data_key_->data_.begin(), data_key_->data_.end(),
+                       [](uint8_t b) { return b != 0; });
+  }
+
+  bool HasWsToken() const {
+    return std::any_of(ws_token_db_->data_.begin(), ws_token_db_->data_.end(),
+                       [](uint8_t b) { return b != 0; });
+  }
+
+  void UpdateLed() {
+    static Mode mode = Mode::Init;
+    if (mode == mode_) {
+      return;
+    }
+
+    static const char *modes[] = {"Init", "SMART_CONFIG", "SCANING",
+                                  "CONNECTED"};
+    UNUSED(modes);
+    XR_LOG_DEBUG("Mode: %s", modes[(int)mode_]);
+    switch (mode_) {
+      case Mode::Init:
+      case Mode::SMART_CONFIG:
+        led_->SetConfig({.frequency = 10});
+        led_->SetDutyCycle(0.5f);
+        break;
+      case Mode::SCANING:
+        led_->SetConfig({.frequency = 4});
+        led_->SetDutyCycle(0.75f);
+        break;
+      case Mode::CONNECTED:
+        led_->SetConfig({.frequency = 2});
+        led_->SetDutyCycle(0.25f);
+        break;
+    }
+    mode = mode_;
+  }
+
+  void PeripheralInit() {
+    void (*cb_fun)(bool, NetDebugLink *) = [](bool in_isr, NetDebugLink *self) {
+      self->OnButton();
+    };
+
+    auto cb = LibXR::GPIO::Callback::Create(cb_fun, this);
+    button_->RegisterCallback(cb);
+
+    button_->SetConfig({.direction = LibXR::GPIO::Direction::FALL_INTERRUPT,
+                        .pull = LibXR::GPIO::Pull::UP});
+
+    button_->EnableInterrupt();
+
+    wifi_->Enable();
+
+    PowerSaveInit();
+
+    auto mac = wifi_->GetMACAddress();
+    LibXR::MACAddressStr mac_str = LibXR::MACAddressStr::FromRaw(mac);
+    XR_LOG_INFO("MAC address: %s", mac_str);
+
+    if (wifi_->IsConnected()) {
+      OnWifiUp();
+    } else {
+      // 首次轮询时由网络线程发起重连 / Let the first poll start reconnecting
+      wifi_state_ = WifiState::RECONNECTING;
+      wifi_attempt_ms_ =
+          LibXR::Timebase::GetMilliseconds() - RECONNECT_ATTEMPT_MS;
+    }
+  }
+
+  /**
+   * @brief 推进 WiFi 状态机，只在网络线程调用 /
+   *        Advance the WiFi state machine; network thread only
+   *
+   * 断线后依次通过 WifiClient 连接已知 AP，全部失败或按下按钮时进入
+   * BLUFI 配网。任何状态都不阻塞：这里只发起关联，之后的轮询检查 IsConnected。
+   * On link loss, known APs are tried in turn through the WifiClient; when
+   * all fail, or the button is pressed, BLUFI provisioning starts. No state
+   * blocks: an association is only started here and IsConnected is polled
+   * on later passes.
+   */
+  void PollWifi() {
+    uint32_t now = LibXR::Timebase::GetMilliseconds();
+
+    if (smartconfig_requested_ && wifi_state_ != WifiState::PROVISIONING) {
+      smartconfig_requested_ = false;
+      MarkLinkDown();
+      StartProvisioning();
+    }
+
+    switch (wifi_state_) {
+      case WifiState::ONLINE:
+        if (!wifi_->IsConnected()) {
+          XR_LOG_WARN("WiFi link lost");
+          MarkLinkDown();
+          StartReconnect(now);
+        }
+        break;
+      case WifiState::RECONNECTING:
+        if (wifi_->IsConnected()) {
+          OnWifiUp();
+        } else if (now - wifi_attempt_ms_ >= RECONNECT_ATTEMPT_MS) {
+          TryNextAp(now);
+        }
+        break;
+      case WifiState::PROVISIONING: {
+        auto ans = BlufiPoll(PROVISION_TIMEOUT_MS);
+        if (ans == ErrorCode::BUSY) {
+          break;
+        }
+        if (ans == ErrorCode::OK && wifi_->IsConnected()) {
+          XR_LOG_PASS("BLUFI success");
+          OnWifiUp();
+        } else {
+          XR_LOG_WARN("BLUFI failed or timed out: %d", ans);
+          StartReconnect(now);
+        }
+        break;
+      }
+    }
+
+    if (wifi_state_ == WifiState::PROVISIONING) {
+      mode_ = Mode::SMART_CONFIG;
+    } else if (mode_ != Mode::CONNECTED) {
+      mode_ = Mode::SCANING;
+    }
+  }
+
+  void StartReconnect(uint32_t now) {
+    wifi_state_ = WifiState::RECONNECTING;
+    ap_cursor_ = 0;
+    TryNextAp(now);
+  }
+
+  void TryNextAp(uint32_t now) {
+    auto &known = known_ap_key_->data_;
+    while (ap_cursor_ < KNOWN_AP_NUM && known[ap_cursor_].ssid[0] == '\0') {
+      ap_cursor_++;
+    }
+
+    if (ap_cursor_ >= KNOWN_AP_NUM) {
+      StartProvisioning();
+      return;
+    }
+
+    auto &ap = known[ap_cursor_++];
+    XR_LOG_INFO("Reconnecting to %s on channel %d", ap.ssid, ap.channel);
+    FastConnect(ap);
+    wifi_attempt_ms_ = now;
+  }
+
+  void StartProvisioning() {
+    wifi_state_ = WifiState::PROVISIONING;
+    BlufiStart();
+  }
+
+  /**
+   * @brief 连上 AP 后刷新已知列表，当前 AP 移到首位 /
+   *        Refresh the known list once associated, current AP first
+   */
+  void OnWifiUp() {
+    wifi_state_ = WifiState::ONLINE;
+
+    KnownAp ap{};
+    if (!QueryApInfo(ap) || ap.ssid[0] == '\0') {
+      return;
+    }
+
+    auto known = known_ap_key_->data_;
+    size_t slot = KNOWN_AP_NUM - 1;
+    for (size_t i = 0; i < KNOWN_AP_NUM; i++) {
+      if (strncmp(known[i].ssid, ap.ssid, sizeof(ap.ssid)) == 0) {
+        slot = i;
+        break;
+      }
+    }
+    std::move_backward(known.begin(), known.begin() + slot,
+                       known.begin() + slot + 1);
+    known[0] = ap;
+
+    if (memcmp(&known, &known_ap_key_->data_, sizeof(known)) != 0) {
+      known_ap_key_->Set(known);
+    }
+  }
+
+  void MarkLinkDown() {
+    if (link_down_ms_ == 0) {
+      link_down_ms_ = LibXR::Timebase::GetMilliseconds();
+    }
+  }
+
+  void MarkStreaming() {
+    if (link_down_ms_ != 0) {
+      reconnect_ms_ = LibXR::Timebase::GetMilliseconds() - link_down_ms_;
+      link_down_ms_ = 0;
+      XR_LOG_INFO("Streaming again %d ms after link loss", reconnect_ms_);
+    }
+  }
+
+  /**
+   * @brief 打开离线存储的闪存分区，不存在时返回 nullptr /
+   *        Open the capture flash partition, nullptr if there is none
+   */
+  CaptureFlash *OpenCaptureFlash();
+
+  /**
+   * @brief 开始 BLUFI 配网，立即返回 / Start BLUFI provisioning, non-blocking
+   */
+  void BlufiStart();
+
+  /**
+   * @brief 查询配网结果 / Poll provisioning
+   * @return BUSY 等待中，OK 已连接，TIMEOUT 超时 /
+   *         BUSY while waiting, OK once connected, TIMEOUT on timeout
+   */
+  ErrorCode BlufiPoll(uint32_t timeout_ms);
+
+  /**
+   * @brief 开始关联一个已知 AP，立即返回 / Start associating with a known
+   *        AP, non-blocking
+   *
+   * WifiClient::Config 不带 BSSID 与信道，因此由平台实现直接设置；信道非 0 时
+   * 只在缓存的信道上连接缓存的 BSSID，不做全信道扫描。结果由 IsConnected 轮询。
+   * WifiClient::Config carries no BSSID or channel, so the platform sets them
+   * itself. With a non-zero channel only the cached BSSID is joined on the
+   * cached channel, without a full scan. Poll IsConnected for the outcome.
+   */
+  ErrorCode FastConnect(const KnownAp &ap);
+
+  /**
+   * @brief 读取当前 AP 的 SSID、密码、BSSID 与信道 /
+   *        Read SSID, password, BSSID and channel of the current AP
+   */
+  bool QueryApInfo(KnownAp &ap);
+
+  void PowerSaveInit();
+
+  /**
+   * @brief 以硬件随机数填充 / Fill with hardware random bytes
+   */
+  static void FillRandom(uint8_t *buf, size_t len);
+
+  /**
+   * @brief 当前任务栈的历史最低剩余字节，平台不支持时为 0 /
+   *        Lowest free stack of the calling task so far in bytes, 0 where
+   *        unsupported
+   */
+  static uint32_t StackHeadroom();
+
+  static inline NetDebugLink *instance_ = nullptr;
+
+  Mode mode_ = Mode::Init;
+  bool smartconfig_requested_ = false;
 
   static constexpr int GOT_CREDENTIAL_BIT = 1;
   LibXR::WifiClient::Config sta_cfg_;
@@ -451,22 +3386,120 @@ public:
   LibXR::GPIO *button_;
   LibXR::PWM *led_;
   LibXR::UART *uart_cdc_;
+  CdcTransport *cdc_transport_ = nullptr;
+  // 服务任务置位，网络任务读取并在会话结束时清除 / Set by the service task,
+  // read by the net task and cleared when the session ends
+  std::atomic<bool> cdc_host_ = false;
+  LibXR::WritePort *muted_stdio_ = nullptr;
   LibXR::WifiClient *wifi_;
   LibXR::Database *db_;
   LibXR::Database::Key<std::array<char, 32>> *device_name_key_;
+  LibXR::Database::Key<std::array<uint8_t, MAX_PORT_NUM>> *route_key_;
+  LibXR::Database::Key<std::array<uint8_t, DataCipher::KEY_SIZE>> *data_key_;
+  LibXR::Database::Key<uint8_t> *cipher_enable_key_;
+  LibXR::Database::Key<std::array<uint8_t, WebSocketServer::TOKEN_SIZE>>
+      *ws_token_db_;
+  LibXR::Database::Key<std::array<KnownAp, KNOWN_AP_NUM>> *known_ap_key_;
   LibXR::LockFreeList uarts_;
   LibXR::LockFreeList topics_;
   LibXR::Topic uart_cdc_topic_;
   LibXR::Topic wifi_config_topic_;
   LibXR::Topic command_topic_;
+  LibXR::Topic flash_topic_;
+  LibXR::Topic capture_topic_;
+  LibXR::Topic trace_topic_;
+  LibXR::Topic tap_topic_;
+
+  std::array<UartInfo *, MAX_PORT_NUM> ports_{};
+  uint8_t port_num_ = 0;
+  uint8_t sched_cursor_ = 0;
+  bool sched_visited_ = false; // 游标端口本轮已得配额 / quantum granted
 
-  LibXR::BaseQueue to_net_data_queue_;
+  LibXR::BaseQueue to_net_ctrl_queue_;
   LibXR::Mutex to_net_data_queue_mutex_;
   LibXR::BaseQueue to_cdc_data_queue_;
   LibXR::Mutex to_cdc_data_queue_mutex_;
+  LibXR::BaseQueue capture_queue_;
+  LibXR::Mutex capture_mutex_;
+  LibXR::BaseQueue tap_queue_;
+  LibXR::Mutex tap_mutex_;
   LibXR::Semaphore read_sem_;
   LibXR::Semaphore write_sem_;
+  LibXR::Semaphore route_write_sem_;
   LibXR::Topic::Server from_net_server_;
+  LibXR::Topic::Server ws_net_server_;
+  WebSocketServer websocket_;
+  std::array<uint8_t, DataCipher::KEY_SIZE> ws_token_key_{};
+  std::array<uint8_t, WebSocketServer::TOKEN_SIZE> ws_token_set_{};
+  bool ws_token_active_ = false;
+  static_assert(WebSocketServer::TOKEN_SIZE == DataCipher::KEY_SIZE);
+  std::array<NetSegment, MAX_NET_SEGMENTS> segments_{};
+  size_t segment_num_ = 0;
+  PendingBatch pending_;
+  std::array<uint8_t, NET_HOLD_SIZE> hold_buf_{};
+  std::array<NetSegment, MAX_NET_SEGMENTS> hold_segments_{};
+  size_t hold_len_ = 0;
+  size_t hold_num_ = 0;
+  // 接收任务的命令处理写入，发送任务读取 / Written by the RX task's
+  // command handler, read by the TX task
+  std::atomic<uint8_t> framing_ = FRAMING_V1;
+  uint8_t batch_framing_ = FRAMING_V1;
+  FramingStats framing_stats_;
+  size_t ctrl_popped_ = 0; // 队首命令帧已发出的字节 / head frame bytes sent
+  bool flow_resync_ = false;
+  TraceRing trace_;
+  // 同上，另有服务任务读取 / Likewise, and also read by the service task
+  std::atomic<uint8_t> tap_mask_ = 0;
+  std::atomic<uint32_t> tap_dropped_ = 0;
+  uint32_t flow_report_ms_ = 0;
+
+  LibXR::Timer::TimerHandle service_task_ = nullptr;
+  uint32_t service_period_ms_ = SERVICE_MIN_MS;
+  uint32_t service_max_ms_ = SERVICE_MAX_MS;
+  uint32_t idle_ticks_ = 0;
+  uint32_t last_led_ms_ = 0;
+  uint32_t last_ping_ms_ = 0;
+  uint32_t net_idle_ms_ = 1;
+  LibXR::Semaphore net_wakeup_sem_;
+  std::atomic<bool> net_wakeup_pending_ = false;
+  PowerStats power_stats_;
+  LibXR::Mutex power_mutex_;
+  LinkHealth link_;
+  SelfTest self_test_;
+  SlipFlasher flasher_;
+  DataCipher cipher_;
+  CaptureStore capture_;
+  bool capture_backlog_ = false;
+  bool capture_dirty_ = false;
+  uint32_t capture_sync_ms_ = 0;
+  uint32_t capture_dropped_ = 0;
+
+  WifiState wifi_state_ = WifiState::RECONNECTING;
+  size_t ap_cursor_ = 0;
+  uint32_t wifi_attempt_ms_ = 0;
+  uint32_t link_down_ms_ = 0;
+  uint32_t reconnect_ms_ = 0;
+
+  struct {
+    bool active = false;
+    uint8_t seq = 0;
+    uint8_t count = 0;
+    uint32_t since = 0;
+    Command::UartConfig entries[Command::MAX_BATCH_SIZE];
+  } pending_config_;
 
   LibXR::Thread thread_;
+  LibXR::Thread rx_thread_;
+  LibXR::Semaphore rx_start_sem_;
+  LibXR::Semaphore rx_done_sem_;
+  LibXR::Mutex downlink_mutex_;
+  // 正在解析下行的任务，由 downlink_mutex_ 保护 / Task parsing the
+  // downlink, guarded by downlink_mutex_
+  TraceRing::Task downlink_task_ = TraceRing::Task::RX;
+  LibXR::Mutex link_mutex_;
+  NetTransport *session_transport_ = nullptr;
+  bool session_encrypted_ = false;
+  std::atomic<bool> session_active_ = false;
+  std::atomic<bool> session_lost_ = false;
+  TaskStats task_stats_;
 };
@@ -214,6 +214,18 @@ int blufi_aes_decrypt(uint8_t iv8, uint8_t *crypt_data, int crypt_len) {
   return crypt_len;
 }
 
+int blufi_security_get_psk(uint8_t *psk, int psk_len) {
+  static const uint8_t zero[PSK_LEN] = {0};
+
+  if (!blufi_sec || psk_len < PSK_LEN ||
+      memcmp(blufi_sec->psk, zero, PSK_LEN) == 0) {
+    return -1;
+  }
+
+  memcpy(psk, blufi_sec->psk, PSK_LEN);
+  return PSK_LEN;
+}
+
 uint16_t blufi_crc_checksum(uint8_t iv8, uint8_t *data, int len) {
   /* This iv8 ignore, not used */
   return esp_crc16_be(0, data, len);
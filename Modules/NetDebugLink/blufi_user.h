@@ -13,6 +13,7 @@ void blufi_dh_negotiate_data_handler(uint8_t *data, int len,
 int blufi_aes_encrypt(uint8_t iv8, uint8_t *crypt_data, int crypt_len);
 int blufi_aes_decrypt(uint8_t iv8, uint8_t *crypt_data, int crypt_len);
 uint16_t blufi_crc_checksum(uint8_t iv8, uint8_t *data, int len);
+int blufi_security_get_psk(uint8_t *psk, int psk_len);
 
 int blufi_security_init(void);
 void blufi_security_deinit(void);
@@ -0,0 +1,417 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+
+#include "libxr.hpp"
+
+/**
+ * @brief 离线抓包存储的闪存后端 / Flash backend of the offline capture store
+ *
+ * 语义与 NOR 闪存一致：擦除后为 0xFF，写入只能把 1 变为 0。
+ * NOR semantics: erased bytes read 0xFF and writes can only clear bits.
+ */
+class CaptureFlash {
+ public:
+  virtual ~CaptureFlash() = default;
+
+  virtual size_t Size() const = 0;
+
+  virtual ErrorCode Erase(size_t offset, size_t size) = 0;
+
+  virtual ErrorCode Write(size_t offset, const void *data, size_t size) = 0;
+
+  virtual ErrorCode Read(size_t offset, void *data, size_t size) = 0;
+};
+
+/**
+ * @brief 断网期间的串口数据环形日志 / Ring log of UART data while offline
+ *
+ * 扇区格式：[SectorHeader][Record][Record]...，未写区域为 0xFF。扇区按环顺序
+ * 依次擦写，每个扇区每圈只擦除一次，因此磨损天然均衡；头部记录擦除次数。
+ * 写入先攒满一页再落盘，Sync 可提前写出未满的页。读出离开某个扇区后将其
+ * drained 字段清零，重启后从第一个未读完的扇区继续。记录头带 CRC8，负载另有
+ * CRC16，负载损坏的记录在读出时丢弃。每次 Init 启动计数加一并写入之后的
+ * 每条记录，时间戳只在同一启动计数内可比。
+ * Sector layout: [SectorHeader][Record][Record]..., unwritten bytes are 0xFF.
+ * Sectors are erased in ring order, once per lap, which levels wear by
+ * construction; the header keeps the erase count. Writes are batched into
+ * whole pages and Sync flushes a partial page early. When reading leaves a
+ * sector its drained field is cleared, so after a reboot reading resumes at
+ * the first sector not fully drained. Record headers carry a CRC8 and the
+ * payload a CRC16 of its own; records with a damaged payload are dropped on
+ * read. Every Init bumps a boot counter that goes into each record written
+ * afterwards, and timestamps only compare within one boot count.
+ */
+class CaptureStore {
+ public:
+  static constexpr uint32_t MAGIC = 0x324c444e;  // "NDL2"
+  static constexpr size_t SECTOR_SIZE = 4096;
+  static constexpr size_t PAGE_SIZE = 256;
+  static constexpr size_t MAX_PAYLOAD = 1024;
+
+  struct SectorHeader {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t erase_count;
+    uint16_t boot;      // 打开扇区时的启动计数 / boot count when opened
+    uint16_t reserved;
+    uint32_t drained;  // 0xffffffff: 未读完 / not fully drained
+  };
+
+  struct RecordHeader {
+    uint32_t timestamp_lo;
+    uint32_t timestamp_hi;
+    uint16_t boot;
+    uint16_t len;  // 0xffff: 扇区结束 / end of sector
+    uint16_t data_crc;  // CRC16(负载) / CRC16(payload)
+    uint8_t port;
+    uint8_t check;  // CRC8(前面的所有字段) / CRC8(all fields above)
+  };
+
+  struct Stats {
+    uint32_t sectors = 0;
+    uint32_t max_erase_count = 0;
+    uint32_t lost_bytes = 0;     // 环满时覆盖的数据 / overwritten when full
+    uint32_t corrupt_bytes = 0;  // 负载校验失败丢弃 / dropped on payload CRC
+  };
+
+  /**
+   * @brief 扫描扇区头并恢复读写位置 / Scan headers and recover positions
+   */
+  ErrorCode Init(CaptureFlash *flash) {
+    flash_ = flash;
+    sector_num_ = flash->Size() / SECTOR_SIZE;
+    if (sector_num_ < 2) {
+      flash_ = nullptr;
+      return ErrorCode::SIZE_ERR;
+    }
+    stats_ = {};
+    stats_.sectors = sector_num_;
+    read_sector_ = SIZE_MAX;
+    peeked_ = false;
+
+    bool found = false;
+    uint32_t oldest_seq = 0;
+    for (size_t i = 0; i < sector_num_; i++) {
+      SectorHeader header;
+      if (!ReadHeader(i, header)) {
+        continue;
+      }
+      stats_.max_erase_count =
+          LibXR::max(stats_.max_erase_count, header.erase_count);
+      if (!found || static_cast<int32_t>(header.seq - seq_) > 0) {
+        write_sector_ = i;
+        seq_ = header.seq;
+      }
+      if (header.drained != 0 &&
+          (read_sector_ == SIZE_MAX ||
+           static_cast<int32_t>(header.seq - oldest_seq) < 0)) {
+        read_sector_ = i;
+        oldest_seq = header.seq;
+      }
+      found = true;
+    }
+
+    if (!found) {
+      boot_ = 0;
+      write_sector_ = sector_num_ - 1;
+      write_offset_ = SECTOR_SIZE;
+      read_sector_ = write_sector_;
+      read_offset_ = write_offset_;
+      return OpenSector(0);
+    }
+
+    // 写扇区中最新的记录决定上次的启动计数 / The newest record in the write
+    // sector tells the previous boot count
+    SectorHeader newest;
+    ReadHeader(write_sector_, newest);
+    uint16_t last_boot = newest.boot;
+    write_offset_ = ScanEnd(write_sector_, last_boot);
+    boot_ = last_boot + 1;
+    bool torn = write_offset_ == SIZE_MAX;
+    if (torn) {
+      write_offset_ = SECTOR_SIZE;
+    }
+
+    if (read_sector_ == SIZE_MAX) {
+      read_sector_ = write_sector_;
+      read_offset_ = write_offset_;
+    } else {
+      read_offset_ = sizeof(SectorHeader);
+    }
+
+    if (torn) {
+      // 掉电留下半条记录，从下一个扇区重新开始
+      // A power cut left a torn record; start over in the next sector
+      return OpenSector((write_sector_ + 1) % sector_num_);
+    }
+    return ErrorCode::OK;
+  }
+
+  bool Ready() const { return flash_ != nullptr; }
+
+  /**
+   * @brief 本次启动的计数 / Boot count of this run
+   */
+  uint16_t Boot() const { return boot_; }
+
+  bool Empty() const {
+    return !Ready() ||
+           (read_sector_ == write_sector_ && read_offset_ >= write_offset_);
+  }
+
+  /**
+   * @brief 追加一段端口数据，超过 MAX_PAYLOAD 时拆分 /
+   *        Append port data, split into MAX_PAYLOAD chunks
+   */
+  ErrorCode Append(uint8_t port, uint64_t timestamp_us, const uint8_t *data,
+                   size_t size) {
+    if (!Ready()) {
+      return ErrorCode::STATE_ERR;
+    }
+
+    while (size > 0) {
+      size_t len = LibXR::min(size, MAX_PAYLOAD);
+      if (write_offset_ + sizeof(RecordHeader) + len > SECTOR_SIZE) {
+        if (OpenSector((write_sector_ + 1) % sector_num_) != ErrorCode::OK) {
+          return ErrorCode::FAILED;
+        }
+      }
+
+      RecordHeader header = MakeHeader(port, boot_, timestamp_us, data, len);
+      Put(&header, sizeof(header));
+      Put(data, len);
+      data += len;
+      size -= len;
+    }
+    return ErrorCode::OK;
+  }
+
+  /**
+   * @brief 写出未满的页 / Flush the partial page
+   */
+  void Sync() { FlushPending(); }
+
+  /**
+   * @brief 下一条完好记录的负载长度，无数据返回 0 /
+   *        Payload length of the next intact record, 0 when empty
+   */
+  size_t PeekSize() { return LoadNext() ? peek_header_.len : 0; }
+
+  /**
+   * @brief 读出并消费下一条完好记录 / Read and consume the next intact record
+   * @return 负载长度，buf 不足或无数据时返回 0 /
+   *         Payload length, 0 when empty or buf is too small
+   */
+  size_t Read(uint8_t &port, uint16_t &boot, uint64_t &timestamp_us,
+              uint8_t *buf, size_t size) {
+    if (!LoadNext() || peek_header_.len > size) {
+      return 0;
+    }
+
+    auto &header = peek_header_;
+    memcpy(buf, peek_data_, header.len);
+    read_offset_ += sizeof(header) + header.len;
+    peeked_ = false;
+    port = header.port;
+    boot = header.boot;
+    timestamp_us = (static_cast<uint64_t>(header.timestamp_hi) << 32) |
+                   header.timestamp_lo;
+    return header.len;
+  }
+
+  const Stats &GetStats() const { return stats_; }
+
+ private:
+  size_t SectorBase(size_t sector) const { return sector * SECTOR_SIZE; }
+
+  bool ReadHeader(size_t sector, SectorHeader &header) {
+    return flash_->Read(SectorBase(sector), &header, sizeof(header)) ==
+               ErrorCode::OK &&
+           header.magic == MAGIC;
+  }
+
+  static RecordHeader MakeHeader(uint8_t port, uint16_t boot,
+                                 uint64_t timestamp_us, const uint8_t *data,
+                                 size_t len) {
+    RecordHeader header{static_cast<uint32_t>(timestamp_us),
+                        static_cast<uint32_t>(timestamp_us >> 32),
+                        boot,
+                        static_cast<uint16_t>(len),
+                        LibXR::CRC16::Calculate(data, len),
+                        port,
+                        0};
+    header.check = LibXR::CRC8::Calculate(&header, sizeof(header) - 1);
+    return header;
+  }
+
+  static bool CheckHeader(const RecordHeader &header) {
+    return header.len <= MAX_PAYLOAD &&
+           header.check == LibXR::CRC8::Calculate(&header, sizeof(header) - 1);
+  }
+
+  /**
+   * @brief 找到扇区内第一个空位，记录损坏时返回 SIZE_MAX /
+   *        Find the first free offset, SIZE_MAX on a torn record
+   * @param last_boot 返回最后一条完好记录的启动计数，没有记录时不变 /
+   *        Receives the boot count of the last intact record, untouched when
+   *        there is none
+   */
+  size_t ScanEnd(size_t sector, uint16_t &last_boot) {
+    size_t offset = sizeof(SectorHeader);
+    while (offset + sizeof(RecordHeader) <= SECTOR_SIZE) {
+      RecordHeader header;
+      flash_->Read(SectorBase(sector) + offset, &header, sizeof(header));
+      if (header.len == 0xffff) {
+        return offset;
+      }
+      if (!CheckHeader(header) ||
+          offset + sizeof(header) + header.len > SECTOR_SIZE) {
+        return SIZE_MAX;
+      }
+      last_boot = header.boot;
+      offset += sizeof(header) + header.len;
+    }
+    return offset;
+  }
+
+  ErrorCode OpenSector(size_t sector) {
+    FlushPending();
+
+    bool was_empty = Empty();
+    if (!was_empty && sector == read_sector_) {
+      // 环已满，丢弃最旧的扇区 / Ring full, drop the oldest sector
+      stats_.lost_bytes += SECTOR_SIZE - read_offset_;
+      read_sector_ = (sector + 1) % sector_num_;
+      read_offset_ = sizeof(SectorHeader);
+      peeked_ = false;
+    }
+
+    SectorHeader old;
+    uint32_t erase_count = ReadHeader(sector, old) ? old.erase_count + 1 : 1;
+    if (flash_->Erase(SectorBase(sector), SECTOR_SIZE) != ErrorCode::OK) {
+      return ErrorCode::FAILED;
+    }
+    stats_.max_erase_count = LibXR::max(stats_.max_erase_count, erase_count);
+
+    write_sector_ = sector;
+    write_offset_ = 0;
+    SectorHeader header{MAGIC, ++seq_, erase_count, boot_, 0xffff,
+                        0xffffffff};
+    Put(&header, sizeof(header));
+
+    if (was_empty) {
+      read_sector_ = write_sector_;
+      read_offset_ = write_offset_;
+    }
+    return ErrorCode::OK;
+  }
+
+  void Put(const void *data, size_t size) {
+    auto src = static_cast<const uint8_t *>(data);
+    while (size > 0) {
+      size_t room = PAGE_SIZE - write_offset_ % PAGE_SIZE;
+      size_t len = LibXR::min(room, size);
+      memcpy(pending_ + pending_len_, src, len);
+      pending_len_ += len;
+      write_offset_ += len;
+      src += len;
+      size -= len;
+      if (write_offset_ % PAGE_SIZE == 0) {
+        FlushPending();
+      }
+    }
+  }
+
+  void FlushPending() {
+    if (pending_len_ == 0) {
+      return;
+    }
+    flash_->Write(SectorBase(write_sector_) + write_offset_ - pending_len_,
+                  pending_, pending_len_);
+    pending_len_ = 0;
+  }
+
+  /**
+   * @brief 读取字节，尚未落盘的部分取自页缓冲 /
+   *        Read bytes, taking the unflushed tail from the page buffer
+   */
+  void ReadBytes(size_t sector, size_t offset, void *data, size_t size) {
+    auto dst = static_cast<uint8_t *>(data);
+    size_t flushed = write_offset_ - pending_len_;
+    size_t from_flash = size;
+    if (sector == write_sector_ && offset + size > flushed) {
+      from_flash = offset < flushed ? flushed - offset : 0;
+      memcpy(dst + from_flash, pending_ + (offset + from_flash - flushed),
+             size - from_flash);
+    }
+    if (from_flash > 0) {
+      flash_->Read(SectorBase(sector) + offset, dst, from_flash);
+    }
+  }
+
+  /**
+   * @brief 把下一条负载完好的记录读入缓冲，跳过负载损坏的记录 /
+   *        Load the next record with an intact payload, skipping damaged ones
+   */
+  bool LoadNext() {
+    while (!peeked_) {
+      if (!NextHeader(peek_header_)) {
+        return false;
+      }
+      ReadBytes(read_sector_, read_offset_ + sizeof(RecordHeader), peek_data_,
+                peek_header_.len);
+      if (LibXR::CRC16::Calculate(peek_data_, peek_header_.len) ==
+          peek_header_.data_crc) {
+        peeked_ = true;
+      } else {
+        stats_.corrupt_bytes += peek_header_.len;
+        read_offset_ += sizeof(RecordHeader) + peek_header_.len;
+      }
+    }
+    return true;
+  }
+
+  bool NextHeader(RecordHeader &header) {
+    while (!Empty()) {
+      bool sector_end = read_offset_ + sizeof(header) > SECTOR_SIZE;
+      if (!sector_end) {
+        ReadBytes(read_sector_, read_offset_, &header, sizeof(header));
+        if (header.len != 0xffff && CheckHeader(header)) {
+          return true;
+        }
+        sector_end = true;
+      }
+
+      if (read_sector_ == write_sector_) {
+        // 当前写扇区中的坏记录，跳到写位置 / Bad record in the write sector
+        read_offset_ = write_offset_;
+        return false;
+      }
+
+      // 离开已读完的扇区 / Leave a fully drained sector
+      uint32_t drained = 0;
+      flash_->Write(SectorBase(read_sector_) + offsetof(SectorHeader, drained),
+                    &drained, sizeof(drained));
+      read_sector_ = (read_sector_ + 1) % sector_num_;
+      read_offset_ = sizeof(SectorHeader);
+    }
+    return false;
+  }
+
+  CaptureFlash *flash_ = nullptr;
+  size_t sector_num_ = 0;
+  uint32_t seq_ = 0;
+  uint16_t boot_ = 0;
+  size_t write_sector_ = 0;
+  size_t write_offset_ = 0;
+  size_t read_sector_ = SIZE_MAX;
+  size_t read_offset_ = 0;
+  uint8_t pending_[PAGE_SIZE];
+  size_t pending_len_ = 0;
+  RecordHeader peek_header_;
+  uint8_t peek_data_[MAX_PAYLOAD];
+  bool peeked_ = false;
+  Stats stats_;
+};
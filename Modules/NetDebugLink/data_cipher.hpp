@@ -0,0 +1,288 @@
+#pragma once
+
+#include <mbedtls/gcm.h>
+#include <mbedtls/md.h>
+#include <mbedtls/sha256.h>
+
+#include <cstring>
+
+#include "libxr.hpp"
+
+/**
+ * @brief 数据面 AES-128-GCM 加密记录 /
+ *        AES-128-GCM record layer for the data plane
+ *
+ * 记录格式：[长度 u16 LE][密文][16 字节标签]，长度字段作为附加认证数据。
+ * 随机数为 [方向 u8][0 0 0][计数 u64 LE]，每个方向每条连接从 0 开始递增。
+ * 计数随连接归零，因此每条连接都用 Start 由长期密钥和双方的随机数派生新的
+ * 会话密钥，(密钥, 随机数) 不会跨连接重复，旧连接的记录也无法重放到新连接。
+ * ESP32-C3 上 mbedtls 的 AES 与 SHA 由硬件加速。
+ * Record: [length u16 LE][ciphertext][16 byte tag], with the length field as
+ * additional authenticated data. The nonce is [direction u8][0 0 0]
+ * [counter u64 LE]; each direction counts from 0 per connection. Since the
+ * counters restart, Start derives a fresh session key per connection from
+ * the long-term key and random nonces from both sides, so no (key, nonce)
+ * pair repeats across connections and records from an old connection cannot
+ * be replayed into a new one. mbedtls AES and SHA are hardware accelerated
+ * on the ESP32-C3.
+ */
+class DataCipher {
+ public:
+  enum class Direction : uint8_t { DEVICE_TO_HOST = 0, HOST_TO_DEVICE = 1 };
+
+  static constexpr size_t KEY_SIZE = 16;
+  static constexpr size_t HEADER_SIZE = 2;
+  static constexpr size_t TAG_SIZE = 16;
+  static constexpr size_t NONCE_SIZE = 12;
+  static constexpr size_t SESSION_NONCE_SIZE = 16;
+  static constexpr size_t OVERHEAD = HEADER_SIZE + TAG_SIZE;
+  static constexpr size_t MAX_RECORD = 4096;
+
+  /**
+   * @brief 加解密耗时统计 / Cipher time accounting
+   */
+  struct Stats {
+    uint64_t bytes = 0;
+    uint64_t busy_us = 0;
+    uint32_t auth_failures = 0;
+  };
+
+  DataCipher() {
+    mbedtls_gcm_init(&tx_gcm_);
+    mbedtls_gcm_init(&rx_gcm_);
+  }
+
+  ~DataCipher() {
+    mbedtls_gcm_free(&tx_gcm_);
+    mbedtls_gcm_free(&rx_gcm_);
+  }
+
+  DataCipher(const DataCipher &) = delete;
+  DataCipher &operator=(const DataCipher &) = delete;
+
+  /**
+   * @brief 由 BLUFI 协商出的 PSK 派生数据面密钥 /
+   *        Derive the data plane key from the BLUFI negotiated PSK
+   *
+   * key = SHA-256("NetDebugLink data" || psk)[0:16]，避免与配网阶段的 AES
+   * 密钥复用。
+   * key = SHA-256("NetDebugLink data" || psk)[0:16], so the provisioning AES
+   * key is never reused on the data plane.
+   */
+  static void DeriveKey(const uint8_t *psk, size_t psk_len,
+                        uint8_t key[KEY_SIZE]) {
+    static constexpr char LABEL[] = "NetDebugLink data";
+    uint8_t digest[32];
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    mbedtls_sha256_update(&sha, reinterpret_cast<const uint8_t *>(LABEL),
+                          sizeof(LABEL) - 1);
+    mbedtls_sha256_update(&sha, psk, psk_len);
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+    memcpy(key, digest, KEY_SIZE);
+  }
+
+  /**
+   * @brief 由长期密钥与双方随机数派生会话密钥 /
+   *        Derive the session key from the long-term key and both nonces
+   *
+   * HKDF-SHA256，salt = device_nonce || host_nonce，IKM = 长期密钥，
+   * info = "NetDebugLink session"，取输出前 16 字节。
+   * HKDF-SHA256 with salt = device_nonce || host_nonce, IKM = the long-term
+   * key and info = "NetDebugLink session", keeping the first 16 bytes.
+   */
+  static ErrorCode DeriveSessionKey(
+      const uint8_t key[KEY_SIZE],
+      const uint8_t device_nonce[SESSION_NONCE_SIZE],
+      const uint8_t host_nonce[SESSION_NONCE_SIZE],
+      uint8_t session_key[KEY_SIZE]) {
+    static constexpr char INFO[] = "NetDebugLink session";
+    auto md = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+
+    uint8_t salt[SESSION_NONCE_SIZE * 2];
+    memcpy(salt, device_nonce, SESSION_NONCE_SIZE);
+    memcpy(salt + SESSION_NONCE_SIZE, host_nonce, SESSION_NONCE_SIZE);
+    uint8_t prk[32];
+    if (mbedtls_md_hmac(md, salt, sizeof(salt), key, KEY_SIZE, prk) != 0) {
+      return ErrorCode::FAILED;
+    }
+
+    // 只需一个输出块 T(1) = HMAC(PRK, info || 0x01)
+    // One output block is enough: T(1) = HMAC(PRK, info || 0x01)
+    uint8_t info[sizeof(INFO)];
+    memcpy(info, INFO, sizeof(INFO) - 1);
+    info[sizeof(INFO) - 1] = 0x01;
+    uint8_t okm[32];
+    if (mbedtls_md_hmac(md, prk, sizeof(prk), info, sizeof(info), okm) != 0) {
+      return ErrorCode::FAILED;
+    }
+    memcpy(session_key, okm, KEY_SIZE);
+    return ErrorCode::OK;
+  }
+
+  /**
+   * @brief 由长期密钥派生 WebSocket 握手令牌 /
+   *        Derive the WebSocket handshake token from the long-term key
+   *
+   * 取 HMAC-SHA256(key, "NetDebugLink websocket") 的前 16 字节，令牌泄露
+   * 不会暴露密钥本身。
+   * The first 16 bytes of HMAC-SHA256(key, "NetDebugLink websocket"), so a
+   * leaked token does not give away the key itself.
+   */
+  static ErrorCode DeriveWebSocketToken(const uint8_t key[KEY_SIZE],
+                                        uint8_t token[KEY_SIZE]) {
+    static constexpr char LABEL[] = "NetDebugLink websocket";
+    uint8_t digest[32];
+    if (mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), key,
+                        KEY_SIZE, reinterpret_cast<const uint8_t *>(LABEL),
+                        sizeof(LABEL) - 1, digest) != 0) {
+      return ErrorCode::FAILED;
+    }
+    memcpy(token, digest, KEY_SIZE);
+    return ErrorCode::OK;
+  }
+
+  /**
+   * @brief 为新连接派生并装载会话密钥，重置计数器 /
+   *        Derive and load the session key for a new connection and reset
+   *        the counters
+   */
+  ErrorCode Start(const uint8_t key[KEY_SIZE],
+                  const uint8_t device_nonce[SESSION_NONCE_SIZE],
+                  const uint8_t host_nonce[SESSION_NONCE_SIZE]) {
+    uint8_t session_key[KEY_SIZE];
+    if (DeriveSessionKey(key, device_nonce, host_nonce, session_key) !=
+        ErrorCode::OK) {
+      return ErrorCode::INIT_ERR;
+    }
+
+    tx_counter_ = 0;
+    rx_counter_ = 0;
+    rx_len_ = 0;
+    if (mbedtls_gcm_setkey(&tx_gcm_, MBEDTLS_CIPHER_ID_AES, session_key,
+                           KEY_SIZE * 8) != 0 ||
+        mbedtls_gcm_setkey(&rx_gcm_, MBEDTLS_CIPHER_ID_AES, session_key,
+                           KEY_SIZE * 8) != 0) {
+      return ErrorCode::INIT_ERR;
+    }
+    return ErrorCode::OK;
+  }
+
+  /**
+   * @brief 加密一条记录 / Seal one record
+   * @param out 至少 len + OVERHEAD 字节 / At least len + OVERHEAD bytes
+   * @return 记录长度，失败返回 0 / Record length, 0 on failure
+   */
+  size_t Seal(const uint8_t *in, size_t len, uint8_t *out) {
+    if (len == 0 || len > MAX_RECORD) {
+      return 0;
+    }
+
+    uint64_t start_us = LibXR::Timebase::GetMicroseconds();
+    uint8_t nonce[NONCE_SIZE];
+    MakeNonce(Direction::DEVICE_TO_HOST, tx_counter_++, nonce);
+    out[0] = static_cast<uint8_t>(len);
+    out[1] = static_cast<uint8_t>(len >> 8);
+    if (mbedtls_gcm_crypt_and_tag(&tx_gcm_, MBEDTLS_GCM_ENCRYPT, len, nonce,
+                                  NONCE_SIZE, out, HEADER_SIZE, in,
+                                  out + HEADER_SIZE, TAG_SIZE,
+                                  out + HEADER_SIZE + len) != 0) {
+      return 0;
+    }
+    Account(len, start_us);
+    return len + OVERHEAD;
+  }
+
+  /**
+   * @brief 输入 TCP 字节流，每解出一条记录调用一次 on_plain /
+   *        Feed the TCP byte stream and call on_plain for every record
+   * @return 认证失败返回 CHECK_ERR，此时应断开连接 /
+   *         CHECK_ERR on authentication failure; drop the connection
+   */
+  template <typename OnPlain>
+  ErrorCode Open(const uint8_t *in, size_t len, OnPlain &&on_plain) {
+    static uint8_t plain[MAX_RECORD];
+
+    while (len > 0) {
+      size_t need = HEADER_SIZE;
+      if (rx_len_ >= HEADER_SIZE) {
+        need = RecordLength() + OVERHEAD;
+      }
+
+      size_t copy = LibXR::min(need - rx_len_, len);
+      memcpy(rx_buf_ + rx_len_, in, copy);
+      rx_len_ += copy;
+      in += copy;
+      len -= copy;
+
+      if (rx_len_ == HEADER_SIZE) {
+        size_t record_len = RecordLength();
+        if (record_len == 0 || record_len > MAX_RECORD) {
+          stats_.auth_failures++;
+          return ErrorCode::CHECK_ERR;
+        }
+        continue;
+      }
+
+      if (rx_len_ < need) {
+        continue;
+      }
+
+      uint64_t start_us = LibXR::Timebase::GetMicroseconds();
+      size_t record_len = RecordLength();
+      uint8_t nonce[NONCE_SIZE];
+      MakeNonce(Direction::HOST_TO_DEVICE, rx_counter_++, nonce);
+      rx_len_ = 0;
+      if (mbedtls_gcm_auth_decrypt(&rx_gcm_, record_len, nonce, NONCE_SIZE,
+                                   rx_buf_, HEADER_SIZE,
+                                   rx_buf_ + HEADER_SIZE + record_len,
+                                   TAG_SIZE, rx_buf_ + HEADER_SIZE,
+                                   plain) != 0) {
+        stats_.auth_failures++;
+        return ErrorCode::CHECK_ERR;
+      }
+      Account(record_len, start_us);
+      on_plain(plain, record_len);
+    }
+
+    return ErrorCode::OK;
+  }
+
+  /**
+   * @brief 取出并清零统计 / Take and reset statistics
+   */
+  Stats TakeStats() {
+    Stats stats = stats_;
+    stats_ = {};
+    return stats;
+  }
+
+ private:
+  static void MakeNonce(Direction dir, uint64_t counter,
+                        uint8_t nonce[NONCE_SIZE]) {
+    memset(nonce, 0, NONCE_SIZE);
+    nonce[0] = static_cast<uint8_t>(dir);
+    for (int i = 0; i < 8; i++) {
+      nonce[4 + i] = static_cast<uint8_t>(counter >> (8 * i));
+    }
+  }
+
+  size_t RecordLength() const { return rx_buf_[0] | (rx_buf_[1] << 8); }
+
+  void Account(size_t len, uint64_t start_us) {
+    stats_.bytes += len;
+    stats_.busy_us += LibXR::Timebase::GetMicroseconds() - start_us;
+  }
+
+  // 每个方向一个上下文，Seal 与 Open 可在不同任务中同时运行
+  // One context per direction so Seal and Open may run on separate tasks
+  mbedtls_gcm_context tx_gcm_;
+  mbedtls_gcm_context rx_gcm_;
+  uint64_t tx_counter_ = 0;
+  uint64_t rx_counter_ = 0;
+  uint8_t rx_buf_[MAX_RECORD + OVERHEAD];
+  size_t rx_len_ = 0;
+  Stats stats_;
+};
@@ -0,0 +1,241 @@
+#pragma once
+
+#if defined(ESP_PLATFORM)
+#include <lwip/sockets.h>
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#endif
+
+#include <cstring>
+
+#include "libxr.hpp"
+#include "logger.hpp"
+#include "uart.hpp"
+
+/**
+ * @brief 承载多路复用流的链路 / Link carrying the multiplexed stream
+ *
+ * 会话层（分帧、命令通道、端口复用）只通过这里收发字节，不关心下面是 TCP 还是
+ * USB CDC。两个调用都不阻塞；Send 可以只接受一部分，其余由会话层下次重试。
+ * The session layer (framing, command channel, port multiplexing) only moves
+ * bytes through here and does not care whether TCP or USB CDC is underneath.
+ * Neither call blocks; Send may accept a prefix and the session retries the
+ * rest.
+ */
+class NetTransport {
+ public:
+  virtual ~NetTransport() = default;
+
+  virtual const char *Name() const = 0;
+
+  /**
+   * @brief 读取已到达的数据 / Read whatever has arrived
+   * @return 字节数，0 表示暂无数据，负数表示链路断开 /
+   *         Bytes read, 0 if nothing is pending, negative if the link is gone
+   */
+  virtual int Receive(uint8_t *buf, size_t size) = 0;
+
+  /**
+   * @brief 尽量写入数据 / Write as much as the link accepts
+   * @return 已接受的字节数，负数表示链路断开 /
+   *         Bytes accepted, negative if the link is gone
+   */
+  virtual int Send(const uint8_t *data, size_t size) = 0;
+};
+
+/**
+ * @brief 连接到主机的非阻塞 TCP 链路 / Nonblocking TCP link to the host
+ */
+class TcpTransport : public NetTransport {
+ public:
+  ~TcpTransport() override { Close(); }
+
+  /**
+   * @brief 向发现报文的发送方发起连接，不等待握手完成 /
+   *        Connect to the sender of the discovery message without waiting for
+   *        the handshake
+   */
+  ErrorCode Open(struct sockaddr_in addr, uint16_t port) {
+    sock_ = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (sock_ < 0) {
+      XR_LOG_ERROR("TCP socket creation failed");
+      return ErrorCode::FAILED;
+    } else {
+      XR_LOG_INFO("TCP socket created");
+    }
+
+    // 设置非阻塞模式
+    int flags = fcntl(sock_, F_GETFL, 0);
+    if (flags == -1) {
+      XR_LOG_ERROR("fcntl get flags failed");
+      Close();
+      return ErrorCode::FAILED;
+    }
+    fcntl(sock_, F_SETFL, flags | O_NONBLOCK);
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+
+    XR_LOG_INFO("Connecting to TCP server %s:%d", inet_ntoa(addr.sin_addr),
+                port);
+
+    if (connect(sock_, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+      if (errno != EINPROGRESS) {
+        XR_LOG_ERROR("TCP connect failed: %d", errno);
+        Close();
+        return ErrorCode::FAILED;
+      }
+    }
+
+#if defined(ESP_PLATFORM)
+    struct tcp_keepalive {
+      uint32_t keep_idle;  // 空闲时间
+      uint32_t keep_intvl; // Keep Alive 间隔
+      uint32_t keep_count; // 最大重试次数
+    };
+
+    tcp_keepalive ka = {.keep_idle = 5, .keep_intvl = 1, .keep_count = 5};
+    setsockopt(sock_, IPPROTO_TCP, TCP_KEEPALIVE, &ka, sizeof(ka));
+#else
+    int keep_alive = 1, keep_idle = 5, keep_intvl = 1, keep_count = 5;
+    setsockopt(sock_, SOL_SOCKET, SO_KEEPALIVE, &keep_alive,
+               sizeof(keep_alive));
+    setsockopt(sock_, IPPROTO_TCP, TCP_KEEPIDLE, &keep_idle,
+               sizeof(keep_idle));
+    setsockopt(sock_, IPPROTO_TCP, TCP_KEEPINTVL, &keep_intvl,
+               sizeof(keep_intvl));
+    setsockopt(sock_, IPPROTO_TCP, TCP_KEEPCNT, &keep_count,
+               sizeof(keep_count));
+#endif
+
+    return ErrorCode::OK;
+  }
+
+  void Close() {
+    if (sock_ >= 0) {
+      close(sock_);
+      sock_ = -1;
+    }
+  }
+
+  const char *Name() const override { return "TCP"; }
+
+  int Receive(uint8_t *buf, size_t size) override {
+    auto ans = recv(sock_, buf, size, 0);
+    if (ans > 0) {
+      return static_cast<int>(ans);
+    }
+    if (ans == 0) {
+      // 连接关闭
+      XR_LOG_ERROR("Connection closed by server");
+      return -1;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      // 没有数据可读，继续轮询
+      return 0;
+    }
+    XR_LOG_ERROR("TCP recv failed: %d", errno);
+    return -1;
+  }
+
+  int Send(const uint8_t *data, size_t size) override {
+    auto ans = send(sock_, data, size, 0);
+    if (ans >= 0) {
+      return static_cast<int>(ans);
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS) {
+      // 套接字不可用或仍在握手，继续轮询
+      // Socket busy or still handshaking, keep polling
+      return 0;
+    }
+    XR_LOG_ERROR("TCP send failed: %d", errno);
+    return -1;
+  }
+
+ private:
+  int sock_ = -1;
+};
+
+/**
+ * @brief USB CDC 链路 / USB CDC link
+ *
+ * CDC 没有连接状态，主机一段时间不发任何数据（包括心跳应答）即视为断开。
+ * CDC has no connection state; the link counts as gone once the host has
+ * sent nothing, ping replies included, for IDLE_TIMEOUT_MS.
+ */
+class CdcTransport : public NetTransport {
+ public:
+  static constexpr uint32_t IDLE_TIMEOUT_MS = 3000;
+  static constexpr size_t PRELOAD_SIZE = 4096;
+
+  explicit CdcTransport(LibXR::UART *uart) : uart_(uart) {}
+
+  void Open() { last_rx_ms_ = LibXR::Timebase::GetMilliseconds(); }
+
+  const char *Name() const override { return "CDC"; }
+
+  /**
+   * @brief 存下与发现报文同批读出、位于其后的会话字节，Receive 先返回它们 /
+   *        Keep the session bytes read in the same pass as, and after, the
+   *        discovery message; Receive returns them first
+   */
+  void Preload(const uint8_t *data, size_t size) {
+    preload_len_ = LibXR::min(size, sizeof(preload_));
+    preload_pos_ = 0;
+    memcpy(preload_, data, preload_len_);
+  }
+
+  int Receive(uint8_t *buf, size_t size) override {
+    uint32_t now_ms = LibXR::Timebase::GetMilliseconds();
+    if (preload_pos_ < preload_len_) {
+      auto len = LibXR::min(preload_len_ - preload_pos_, size);
+      memcpy(buf, preload_ + preload_pos_, len);
+      preload_pos_ += len;
+      last_rx_ms_ = now_ms;
+      return static_cast<int>(len);
+    }
+    auto len = LibXR::min(uart_->read_port_->Size(), size);
+    if (len == 0) {
+      if (now_ms - last_rx_ms_ > IDLE_TIMEOUT_MS) {
+        XR_LOG_WARN("CDC host silent for %d ms", now_ms - last_rx_ms_);
+        return -1;
+      }
+      return 0;
+    }
+
+    LibXR::ReadOperation read_op(read_sem_, 20);
+    if (uart_->Read({buf, len}, read_op) != ErrorCode::OK) {
+      return 0;
+    }
+    last_rx_ms_ = now_ms;
+    return static_cast<int>(len);
+  }
+
+  int Send(const uint8_t *data, size_t size) override {
+    auto len = LibXR::min(uart_->write_port_->EmptySize(), size);
+    if (len == 0) {
+      return 0;
+    }
+
+    LibXR::WriteOperation write_op(write_sem_, 20);
+    if (uart_->Write({data, len}, write_op) != ErrorCode::OK) {
+      return 0;
+    }
+    return static_cast<int>(len);
+  }
+
+ private:
+  LibXR::UART *uart_;
+  LibXR::Semaphore read_sem_;
+  LibXR::Semaphore write_sem_;
+  uint32_t last_rx_ms_ = 0;
+  uint8_t preload_[PRELOAD_SIZE];
+  size_t preload_len_ = 0;
+  size_t preload_pos_ = 0;
+};
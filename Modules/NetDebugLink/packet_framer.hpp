@@ -0,0 +1,223 @@
+#pragma once
+
+#include <cstring>
+
+#include "libxr.hpp"
+
+/**
+ * @brief 串口数据包分帧器 / UART packet framer
+ *
+ * 按端口配置的协议从字节流中切出完整数据包：SLIP 与 COBS 输出解码后的负载，
+ * MAVLink v2 与定长模式输出原始帧。开启校验时丢弃损坏的包（SLIP 非法转义、
+ * COBS 码越界、MAVLink 未知的不兼容标志），否则照常输出。超过 MAX_PACKET 的
+ * 包总是丢弃并重新同步。MAVLink 的 CRC 依赖各消息的 CRC_EXTRA，设备上不做
+ * 校验。
+ * Cuts complete packets out of a byte stream by the protocol configured for
+ * a port: SLIP and COBS yield the decoded payload, MAVLink v2 and fixed
+ * length yield the raw frame. With validation on, corrupted packets (bad
+ * SLIP escape, COBS code past the end, unknown MAVLink incompat flags) are
+ * dropped, otherwise they are passed on. Packets over MAX_PACKET are always
+ * dropped and the framer resynchronizes. MAVLink CRCs depend on per-message
+ * CRC_EXTRA and are not checked on the device.
+ */
+class PacketFramer {
+ public:
+  enum class Mode : uint8_t {
+    RAW = 0,
+    SLIP = 1,
+    COBS = 2,
+    MAVLINK2 = 3,
+    FIXED = 4,
+  };
+
+  static constexpr uint8_t FLAG_VALIDATE = 1 << 0;
+  static constexpr size_t MAX_PACKET = 1024;
+
+  struct Config {
+    Mode mode;
+    uint8_t flags;       // FLAG_*
+    uint16_t fixed_len;  // FIXED 模式的包长 / packet length in FIXED mode
+  };
+
+  /**
+   * @brief 校验配置 / Check a configuration
+   */
+  static bool Valid(const Config &config) {
+    if (config.mode > Mode::FIXED) {
+      return false;
+    }
+    return config.mode != Mode::FIXED ||
+           (config.fixed_len > 0 && config.fixed_len <= MAX_PACKET);
+  }
+
+  /**
+   * @brief 切换配置并丢弃未完成的包 / Switch config, dropping any partial
+   *        packet
+   */
+  void Configure(const Config &config) {
+    config_ = config;
+    Reset();
+  }
+
+  bool Active() const { return config_.mode != Mode::RAW; }
+
+  const Config &GetConfig() const { return config_; }
+
+  /**
+   * @brief 输入字节流，每完成一个包调用一次 on_packet /
+   *        Feed bytes and call on_packet for every completed packet
+   * @return 被丢弃的字节数 / Bytes dropped
+   */
+  template <typename OnPacket>
+  size_t Feed(const uint8_t *data, size_t size, OnPacket &&on_packet) {
+    dropped_ = 0;
+    for (size_t i = 0; i < size; i++) {
+      switch (config_.mode) {
+        case Mode::SLIP:
+          FeedSlip(data[i], on_packet);
+          break;
+        case Mode::COBS:
+          FeedCobs(data[i], on_packet);
+          break;
+        case Mode::MAVLINK2:
+          FeedMavlink(data[i], on_packet);
+          break;
+        case Mode::FIXED:
+          Put(data[i]);
+          if (len_ == config_.fixed_len) {
+            Emit(true, on_packet);
+          }
+          break;
+        case Mode::RAW:
+          break;
+      }
+    }
+    return dropped_;
+  }
+
+ private:
+  static constexpr uint8_t SLIP_END = 0xc0;
+  static constexpr uint8_t SLIP_ESC = 0xdb;
+  static constexpr uint8_t SLIP_ESC_END = 0xdc;
+  static constexpr uint8_t SLIP_ESC_ESC = 0xdd;
+
+  static constexpr uint8_t MAVLINK2_STX = 0xfd;
+  static constexpr size_t MAVLINK2_HEADER = 10;
+  static constexpr size_t MAVLINK2_CRC = 2;
+  static constexpr size_t MAVLINK2_SIGNATURE = 13;
+  static constexpr uint8_t MAVLINK2_IFLAG_SIGNED = 0x01;
+
+  void Reset() {
+    len_ = 0;
+    escaped_ = false;
+    corrupt_ = false;
+    overflow_ = false;
+    expected_ = 0;
+  }
+
+  void Put(uint8_t byte) {
+    if (len_ < MAX_PACKET) {
+      buf_[len_++] = byte;
+    } else {
+      overflow_ = true;
+      dropped_++;
+    }
+  }
+
+  template <typename OnPacket>
+  void Emit(bool valid, OnPacket &on_packet) {
+    bool drop = overflow_ || (!valid && (config_.flags & FLAG_VALIDATE));
+    if (drop) {
+      dropped_ += len_;
+    } else if (len_ > 0) {
+      on_packet(buf_, len_);
+    }
+    Reset();
+  }
+
+  template <typename OnPacket>
+  void FeedSlip(uint8_t byte, OnPacket &on_packet) {
+    if (byte == SLIP_END) {
+      if (len_ > 0 || overflow_) {
+        Emit(!corrupt_ && !escaped_, on_packet);
+      }
+      Reset();
+      return;
+    }
+    if (escaped_) {
+      escaped_ = false;
+      if (byte == SLIP_ESC_END) {
+        byte = SLIP_END;
+      } else if (byte == SLIP_ESC_ESC) {
+        byte = SLIP_ESC;
+      } else {
+        corrupt_ = true;
+      }
+      Put(byte);
+    } else if (byte == SLIP_ESC) {
+      escaped_ = true;
+    } else {
+      Put(byte);
+    }
+  }
+
+  template <typename OnPacket>
+  void FeedCobs(uint8_t byte, OnPacket &on_packet) {
+    if (byte != 0) {
+      Put(byte);
+      return;
+    }
+    if (len_ == 0 && !overflow_) {
+      return;
+    }
+
+    // 原地解码：输出永远不超过输入位置 / Decode in place; output never
+    // overtakes input
+    size_t in = 0, out = 0;
+    bool valid = true;
+    while (in < len_) {
+      uint8_t code = buf_[in++];
+      if (code == 0 || in + code - 1 > len_) {
+        valid = false;
+        break;
+      }
+      memmove(buf_ + out, buf_ + in, code - 1);
+      out += code - 1;
+      in += code - 1;
+      if (code != 0xff && in < len_) {
+        buf_[out++] = 0;
+      }
+    }
+    if (valid) {
+      len_ = out;
+    }
+    Emit(valid, on_packet);
+  }
+
+  template <typename OnPacket>
+  void FeedMavlink(uint8_t byte, OnPacket &on_packet) {
+    if (len_ == 0 && byte != MAVLINK2_STX) {
+      dropped_++;  // 帧间杂散字节 / stray byte between frames
+      return;
+    }
+    Put(byte);
+    if (len_ == 3) {
+      uint8_t incompat = buf_[2];
+      corrupt_ = (incompat & ~MAVLINK2_IFLAG_SIGNED) != 0;
+      expected_ = MAVLINK2_HEADER + buf_[1] + MAVLINK2_CRC +
+                  ((incompat & MAVLINK2_IFLAG_SIGNED) ? MAVLINK2_SIGNATURE : 0);
+    }
+    if (expected_ > 0 && len_ == expected_) {
+      Emit(!corrupt_, on_packet);
+    }
+  }
+
+  Config config_{Mode::RAW, 0, 0};
+  uint8_t buf_[MAX_PACKET];
+  size_t len_ = 0;
+  size_t expected_ = 0;
+  size_t dropped_ = 0;
+  bool escaped_ = false;
+  bool corrupt_ = false;
+  bool overflow_ = false;
+};
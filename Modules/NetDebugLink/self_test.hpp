@@ -0,0 +1,206 @@
+#pragma once
+
+#include <atomic>
+
+#include "libxr.hpp"
+
+/**
+ * @brief 链路自测：按指定速率生成确定性数据并校验回环数据 /
+ *        Link self test: generate a deterministic pattern at a given rate and
+ *        verify the looped-back stream
+ *
+ * PRBS15 校验器直接移入接收到的比特，因此丢字节或误码后会自动重新同步。
+ * 时延按每 CHECKPOINT_BYTES 字节的发送/接收时刻计算，丢字节后不再可比。
+ * The PRBS15 checker shifts in the received bits, so it resynchronizes by
+ * itself after a lost or corrupted byte. Latency is sampled every
+ * CHECKPOINT_BYTES bytes by stream offset and stops being meaningful once
+ * bytes are lost.
+ *
+ * 生成在服务任务中进行，主机回显的校验在接收任务中进行，状态由 mutex_ 保护。
+ * Generation runs on the service task and checking a host echo on the RX
+ * task, so the state is guarded by mutex_.
+ */
+class SelfTest {
+ public:
+  enum class Pattern : uint8_t { COUNTER = 0, PRBS15 = 1 };
+
+  enum class Target : uint8_t {
+    UART_TX = 0,  // 写入串口，期望接线回环 / UART TX, expects a wired loopback
+    NET = 1,      // 写入上行数据流，期望主机回显 / uplink, expects host echo
+  };
+
+  struct Config {
+    uint8_t uart_index;
+    Target target;
+    Pattern pattern;
+    uint32_t rate;  // 字节每秒 / bytes per second
+    uint32_t duration_ms;
+  };
+
+  struct Result {
+    uint32_t tx_bytes;
+    uint32_t rx_bytes;
+    uint32_t errors;  // 错误字节数 / mismatched bytes
+    uint32_t throughput;  // 接收字节每秒 / received bytes per second
+    uint32_t latency_avg_us;
+    uint32_t latency_max_us;
+  };
+
+  static constexpr uint32_t CHECKPOINT_BYTES = 256;
+  static constexpr size_t CHECKPOINT_NUM = 64;
+  static constexpr uint32_t DRAIN_MS = 500;  // 结束后等待在途数据 / in-flight grace
+  static constexpr uint16_t PRBS_SEED = 0x7fff;
+
+  void Start(const Config &config, uint64_t now_us) {
+    LibXR::Mutex::LockGuard guard(mutex_);
+    config_ = config;
+    result_ = {};
+    start_us_ = now_us;
+    last_rx_us_ = now_us;
+    tx_state_ = PRBS_SEED;
+    rx_state_ = PRBS_SEED;
+    tx_counter_ = 0;
+    rx_counter_ = 0;
+    latency_sum_us_ = 0;
+    latency_samples_ = 0;
+    active_ = true;
+  }
+
+  bool Active() const { return active_; }
+
+  bool Match(uint8_t uart_index) const {
+    LibXR::Mutex::LockGuard guard(mutex_);
+    return active_ && config_.uart_index == uart_index;
+  }
+
+  Config GetConfig() const {
+    LibXR::Mutex::LockGuard guard(mutex_);
+    return config_;
+  }
+
+  /**
+   * @brief 生成截至 now_us 应发送的数据 / Generate the bytes due by now_us
+   * @return 写入 buf 的字节数 / Bytes written to buf
+   */
+  size_t Generate(uint8_t *buf, size_t size, uint64_t now_us) {
+    LibXR::Mutex::LockGuard guard(mutex_);
+    uint64_t elapsed_us = now_us - start_us_;
+    if (!active_ || elapsed_us >= config_.duration_ms * 1000ull) {
+      return 0;
+    }
+
+    uint64_t due = elapsed_us * config_.rate / 1000000;
+    size_t len = static_cast<size_t>(
+        LibXR::min<uint64_t>(due - LibXR::min<uint64_t>(due, result_.tx_bytes),
+                             size));
+
+    for (size_t i = 0; i < len; i++) {
+      if (result_.tx_bytes % CHECKPOINT_BYTES == 0) {
+        checkpoint_us_[(result_.tx_bytes / CHECKPOINT_BYTES) %
+                       CHECKPOINT_NUM] = now_us;
+      }
+      if (config_.pattern == Pattern::COUNTER) {
+        buf[i] = tx_counter_++;
+      } else {
+        buf[i] = NextPrbsByte(tx_state_);
+      }
+      result_.tx_bytes++;
+    }
+    return len;
+  }
+
+  /**
+   * @brief 校验回环数据 / Verify looped-back data
+   */
+  void Check(const uint8_t *data, size_t size, uint64_t now_us) {
+    LibXR::Mutex::LockGuard guard(mutex_);
+    if (!active_) {
+      return;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+      uint8_t expected;
+      if (config_.pattern == Pattern::COUNTER) {
+        expected = rx_counter_;
+        rx_counter_ = data[i] + 1;
+      } else {
+        expected = PeekPrbsByte(rx_state_);
+        ShiftInByte(rx_state_, data[i]);
+      }
+      if (expected != data[i]) {
+        result_.errors++;
+      }
+
+      if (result_.rx_bytes % CHECKPOINT_BYTES == 0 &&
+          result_.rx_bytes < result_.tx_bytes) {
+        uint64_t latency =
+            now_us - checkpoint_us_[(result_.rx_bytes / CHECKPOINT_BYTES) %
+                                    CHECKPOINT_NUM];
+        latency_sum_us_ += latency;
+        latency_samples_++;
+        result_.latency_max_us = LibXR::max<uint32_t>(
+            result_.latency_max_us, static_cast<uint32_t>(latency));
+      }
+      result_.rx_bytes++;
+    }
+    last_rx_us_ = now_us;
+  }
+
+  /**
+   * @brief 测试时长与收尾时间都已过去 / Test time and drain grace have elapsed
+   */
+  bool Finished(uint64_t now_us) const {
+    LibXR::Mutex::LockGuard guard(mutex_);
+    return active_ && now_us - start_us_ >=
+                          (config_.duration_ms + DRAIN_MS) * 1000ull;
+  }
+
+  Result Stop() {
+    LibXR::Mutex::LockGuard guard(mutex_);
+    active_ = false;
+    uint64_t span_us = last_rx_us_ - start_us_;
+    result_.throughput =
+        span_us > 0
+            ? static_cast<uint32_t>(result_.rx_bytes * 1000000ull / span_us)
+            : 0;
+    result_.latency_avg_us =
+        latency_samples_ > 0
+            ? static_cast<uint32_t>(latency_sum_us_ / latency_samples_)
+            : 0;
+    return result_;
+  }
+
+ private:
+  // PRBS15: x^15 + x^14 + 1
+  static uint8_t PeekPrbsByte(uint16_t state) { return NextPrbsByte(state); }
+
+  static uint8_t NextPrbsByte(uint16_t &state) {
+    uint8_t byte = 0;
+    for (int bit = 0; bit < 8; bit++) {
+      uint16_t next = ((state >> 14) ^ (state >> 13)) & 1;
+      state = ((state << 1) | next) & 0x7fff;
+      byte = (byte << 1) | next;
+    }
+    return byte;
+  }
+
+  static void ShiftInByte(uint16_t &state, uint8_t byte) {
+    for (int bit = 7; bit >= 0; bit--) {
+      state = ((state << 1) | ((byte >> bit) & 1)) & 0x7fff;
+    }
+  }
+
+  mutable LibXR::Mutex mutex_;
+  Config config_{};
+  Result result_{};
+  std::atomic<bool> active_ = false;
+  uint64_t start_us_ = 0;
+  uint64_t last_rx_us_ = 0;
+  uint16_t tx_state_ = PRBS_SEED;
+  uint16_t rx_state_ = PRBS_SEED;
+  uint8_t tx_counter_ = 0;
+  uint8_t rx_counter_ = 0;
+  uint64_t latency_sum_us_ = 0;
+  uint32_t latency_samples_ = 0;
+  std::array<uint64_t, CHECKPOINT_NUM> checkpoint_us_{};
+};
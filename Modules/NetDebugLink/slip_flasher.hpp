@@ -0,0 +1,511 @@
+#pragma once
+
+#include "libxr.hpp"
+#include "uart.hpp"
+
+/**
+ * @brief 在本地驱动 ESP ROM 串口下载协议烧录目标芯片 /
+ *        Flash an attached ESP target by driving the ROM serial protocol
+ *        locally
+ *
+ * 主机只需通过 TCP 一次性推送 zlib 压缩后的固件，同步、切换波特率、
+ * FLASH_DEFL_DATA 分块写入与 MD5 校验都在本机完成，每个往返不再经过 WiFi。
+ * The host streams the zlib-compressed image once; sync, baud switch,
+ * FLASH_DEFL_DATA blocks and MD5 verification run on the bridge, so no
+ * command/response round trip crosses WiFi.
+ *
+ * 由定时任务周期调用 Poll()，目标串口收到的数据通过 Feed() 送入。Start 与
+ * PushImage 来自接收任务，因此所有公开接口都在 mutex_ 内运行。
+ * Poll() is called from the periodic task; bytes read from the target UART
+ * are handed in through Feed(). Start and PushImage come from the RX task,
+ * so every public entry point runs under mutex_.
+ */
+class SlipFlasher {
+ public:
+  enum class State : uint8_t {
+    IDLE = 0,
+    SYNC = 1,
+    CHANGE_BAUD = 2,
+    ATTACH = 3,
+    BEGIN = 4,
+    DATA = 5,
+    END = 6,
+    VERIFY = 7,
+    DONE = 8,
+    FAILED = 9,
+  };
+
+  enum Flag : uint8_t {
+    FLAG_ENCRYPTED_BEGIN = 1 << 0,  // BEGIN 带加密字段（C3/S2/S3 ROM）
+    FLAG_REBOOT = 1 << 1,           // 完成后重启目标 / reboot target when done
+  };
+
+  struct Config {
+    uint8_t uart_index;
+    uint8_t flags;
+    uint32_t offset;           // 烧录地址 / flash offset
+    uint32_t size;             // 解压后大小 / uncompressed size
+    uint32_t compressed_size;  // 主机推送的字节数 / bytes streamed by host
+    uint32_t baudrate;         // 切换到的波特率，0 不切换 / 0: keep current
+    uint8_t md5[16];           // 解压后镜像的 MD5 / MD5 of the raw image
+  };
+
+  struct Status {
+    uint8_t uart_index;
+    State state;
+    int8_t error;  // ErrorCode
+    uint32_t received;  // 已收到的压缩数据 / compressed bytes received
+    uint32_t written;   // 目标已确认的压缩数据 / compressed bytes acked
+  };
+
+  static constexpr size_t IMAGE_WINDOW = 8192;  // 主机最多领先的字节数
+  static constexpr size_t BLOCK_SIZE = 0x400;   // ROM FLASH_WRITE_SIZE
+  static constexpr uint8_t SYNC_RETRY = 10;
+  static constexpr uint8_t CMD_RETRY = 3;
+  static constexpr uint32_t CMD_TIMEOUT_MS = 3000;
+  static constexpr uint32_t SYNC_TIMEOUT_MS = 100;
+  static constexpr uint32_t ERASE_TIMEOUT_MS_PER_KB = 30;
+  static constexpr uint32_t MD5_TIMEOUT_MS_PER_KB = 8;
+  static constexpr uint32_t HOST_STALL_TIMEOUT_MS = 5000; // 主机断供上限
+  static constexpr uint32_t PUSH_TIMEOUT_MS = CMD_TIMEOUT_MS * CMD_RETRY;
+
+  SlipFlasher() : image_(1, IMAGE_WINDOW) {}
+
+  ErrorCode Start(const Config &config, LibXR::UART *uart,
+                  LibXR::Semaphore &write_sem, uint32_t now_ms) {
+    LibXR::Mutex::LockGuard guard(mutex_);
+    if (Active()) {
+      return ErrorCode::BUSY;
+    }
+    if (config.compressed_size == 0 || config.size == 0) {
+      return ErrorCode::ARG_ERR;
+    }
+
+    image_.Reset();
+    config_ = config;
+    uart_ = uart;
+    write_sem_ = &write_sem;
+    status_ = {config.uart_index, State::SYNC,
+               static_cast<int8_t>(ErrorCode::OK), 0, 0};
+    seq_ = 0;
+    retry_ = 0;
+    waiting_ = false;
+    response_ready_ = false;
+    rx_len_ = 0;
+    rx_escape_ = false;
+    status_len_ = 4;
+    stall_size_ = 0;
+    stall_since_ms_ = now_ms;
+    progress_ = true;
+    SendSync(now_ms);
+    return ErrorCode::OK;
+  }
+
+  bool Active() const {
+    return status_.state != State::IDLE && status_.state != State::DONE &&
+           status_.state != State::FAILED;
+  }
+
+  bool Match(uint8_t uart_index) const {
+    return Active() && config_.uart_index == uart_index;
+  }
+
+  /**
+   * @brief 接收主机推送的压缩镜像 / Accept compressed image bytes from the host
+   *
+   * 窗口满时在调用任务中等待目标消化数据，由此把背压传回 TCP；等待超过
+   * PUSH_TIMEOUT_MS 则烧录失败，而不是静默丢弃镜像数据。
+   * When the window is full the calling task waits for the target to drain
+   * it, which pushes back on TCP. Waiting longer than PUSH_TIMEOUT_MS fails
+   * the flash instead of silently dropping image bytes.
+   */
+  ErrorCode PushImage(const void *data, size_t size) {
+    auto src = static_cast<const uint8_t *>(data);
+    uint32_t last_progress_ms = LibXR::Timebase::GetMilliseconds();
+
+    while (true) {
+      {
+        LibXR::Mutex::LockGuard guard(mutex_);
+        if (!Active() || status_.received + size > config_.compressed_size) {
+          return ErrorCode::STATE_ERR;
+        }
+        size_t len = LibXR::min(image_.EmptySize(), size);
+        if (len > 0) {
+          image_.PushBatch(src, len);
+          status_.received += len;
+          src += len;
+          size -= len;
+          last_progress_ms = LibXR::Timebase::GetMilliseconds();
+        }
+        if (size == 0) {
+          return ErrorCode::OK;
+        }
+        if (LibXR::Timebase::GetMilliseconds() - last_progress_ms >=
+            PUSH_TIMEOUT_MS) {
+          Fail(ErrorCode::FULL);
+          return ErrorCode::FULL;
+        }
+      }
+      LibXR::Thread::Sleep(1);
+    }
+  }
+
+  /**
+   * @brief 解析目标返回的 SLIP 数据 / Decode SLIP bytes from the target
+   */
+  void Feed(const uint8_t *data, size_t size) {
+    LibXR::Mutex::LockGuard guard(mutex_);
+    for (size_t i = 0; i < size; i++) {
+      uint8_t byte = data[i];
+      if (byte == SLIP_END) {
+        if (rx_len_ >= RESPONSE_HEADER_SIZE && rx_buf_[0] == 0x01) {
+          OnResponse();
+        }
+        rx_len_ = 0;
+        rx_escape_ = false;
+        continue;
+      }
+      if (rx_escape_) {
+        byte = byte == SLIP_ESC_END ? SLIP_END : SLIP_ESC;
+        rx_escape_ = false;
+      } else if (byte == SLIP_ESC) {
+        rx_escape_ = true;
+        continue;
+      }
+      if (rx_len_ < sizeof(rx_buf_)) {
+        rx_buf_[rx_len_++] = byte;
+      }
+    }
+  }
+
+  void Poll(uint32_t now_ms) {
+    LibXR::Mutex::LockGuard guard(mutex_);
+    if (!Active()) {
+      return;
+    }
+
+    if (waiting_ && response_ready_) {
+      waiting_ = false;
+      response_ready_ = false;
+      OnCommandDone(now_ms);
+      return;
+    }
+
+    if (waiting_ && now_ms - sent_ms_ >= timeout_ms_) {
+      waiting_ = false;
+      if (status_.state == State::SYNC) {
+        if (++retry_ >= SYNC_RETRY) {
+          Fail(ErrorCode::NO_RESPONSE);
+        } else {
+          SendSync(now_ms);
+        }
+      } else if (++retry_ >= CMD_RETRY) {
+        Fail(ErrorCode::TIMEOUT);
+      } else {
+        Resend(now_ms);
+      }
+      return;
+    }
+
+    if (!waiting_ && status_.state == State::DATA) {
+      SendNextBlock(now_ms);
+    }
+  }
+
+  /**
+   * @brief 读取并清除进度更新标志 / Fetch and clear the progress flag
+   */
+  bool TakeProgress(Status &status) {
+    LibXR::Mutex::LockGuard guard(mutex_);
+    if (!progress_) {
+      return false;
+    }
+    progress_ = false;
+    status = status_;
+    return true;
+  }
+
+ private:
+  enum Op : uint8_t {
+    FLASH_DEFL_BEGIN = 0x10,
+    FLASH_DEFL_DATA = 0x11,
+    FLASH_DEFL_END = 0x12,
+    SPI_FLASH_MD5 = 0x13,
+    SYNC = 0x08,
+    SPI_ATTACH = 0x0d,
+    CHANGE_BAUDRATE = 0x0f,
+  };
+
+  static constexpr uint8_t SLIP_END = 0xc0;
+  static constexpr uint8_t SLIP_ESC = 0xdb;
+  static constexpr uint8_t SLIP_ESC_END = 0xdc;
+  static constexpr uint8_t SLIP_ESC_ESC = 0xdd;
+  static constexpr size_t COMMAND_HEADER_SIZE = 8;
+  static constexpr size_t RESPONSE_HEADER_SIZE = 8;
+  static constexpr size_t DATA_HEADER_SIZE = 16;
+  static constexpr uint8_t CHECKSUM_SEED = 0xef;
+
+  void SendSync(uint32_t now_ms) {
+    uint8_t payload[36] = {0x07, 0x07, 0x12, 0x20};
+    memset(payload + 4, 0x55, sizeof(payload) - 4);
+    SendCommand(SYNC, payload, sizeof(payload), 0, now_ms, SYNC_TIMEOUT_MS);
+  }
+
+  void SendWords(Op op, std::initializer_list<uint32_t> words, uint32_t now_ms,
+                 uint32_t timeout_ms) {
+    uint8_t payload[5 * sizeof(uint32_t)];
+    size_t len = 0;
+    for (auto word : words) {
+      PutWord(payload + len, word);
+      len += sizeof(uint32_t);
+    }
+    SendCommand(op, payload, len, 0, now_ms, timeout_ms);
+  }
+
+  void SendNextBlock(uint32_t now_ms) {
+    size_t remain = config_.compressed_size - status_.written;
+    size_t len = LibXR::min(remain, BLOCK_SIZE);
+
+    // 等待主机数据；窗口长时间没有增长说明主机已停止推送
+    // Wait for host data; a window that stops growing means the host stalled
+    size_t held = image_.Size();
+    if (held < len) {
+      if (held != stall_size_) {
+        stall_size_ = held;
+        stall_since_ms_ = now_ms;
+      } else if (now_ms - stall_since_ms_ >= HOST_STALL_TIMEOUT_MS) {
+        Fail(ErrorCode::TIMEOUT);
+      }
+      return;
+    }
+    image_.PopBatch(block_ + DATA_HEADER_SIZE, len);
+    stall_size_ = image_.Size();
+    stall_since_ms_ = now_ms;
+
+    PutWord(block_, len);
+    PutWord(block_ + 4, seq_);
+    PutWord(block_ + 8, 0);
+    PutWord(block_ + 12, 0);
+
+    uint8_t checksum = CHECKSUM_SEED;
+    for (size_t i = 0; i < len; i++) {
+      checksum ^= block_[DATA_HEADER_SIZE + i];
+    }
+
+    block_len_ = len;
+    SendCommand(FLASH_DEFL_DATA, block_, DATA_HEADER_SIZE + len, checksum,
+                now_ms, CMD_TIMEOUT_MS);
+  }
+
+  void SendCommand(Op op, const uint8_t *payload, size_t len,
+                   uint32_t checksum, uint32_t now_ms, uint32_t timeout_ms) {
+    uint8_t header[COMMAND_HEADER_SIZE] = {0x00, op};
+    header[2] = len & 0xff;
+    header[3] = (len >> 8) & 0xff;
+    PutWord(header + 4, checksum);
+
+    size_t out = 0;
+    tx_buf_[out++] = SLIP_END;
+    out = Encode(header, sizeof(header), out);
+    out = Encode(payload, len, out);
+    tx_buf_[out++] = SLIP_END;
+
+    last_op_ = op;
+    tx_len_ = out;
+    timeout_ms_ = timeout_ms;
+    Resend(now_ms);
+  }
+
+  void Resend(uint32_t now_ms) {
+    sent_ms_ = now_ms;
+    waiting_ = true;
+    response_ready_ = false;
+
+    LibXR::WriteOperation write_op(*write_sem_, 100);
+    uart_->Write({tx_buf_, tx_len_}, write_op);
+  }
+
+  size_t Encode(const uint8_t *data, size_t len, size_t out) {
+    for (size_t i = 0; i < len; i++) {
+      if (data[i] == SLIP_END) {
+        tx_buf_[out++] = SLIP_ESC;
+        tx_buf_[out++] = SLIP_ESC_END;
+      } else if (data[i] == SLIP_ESC) {
+        tx_buf_[out++] = SLIP_ESC;
+        tx_buf_[out++] = SLIP_ESC_ESC;
+      } else {
+        tx_buf_[out++] = data[i];
+      }
+    }
+    return out;
+  }
+
+  void OnResponse() {
+    if (!waiting_ || rx_buf_[1] != last_op_) {
+      return;  // ROM 会重复应答 SYNC / ROM answers SYNC several times
+    }
+    size_t len = rx_buf_[2] | (rx_buf_[3] << 8);
+    len = LibXR::min(len, rx_len_ - RESPONSE_HEADER_SIZE);
+    resp_data_ = rx_buf_ + RESPONSE_HEADER_SIZE;
+    // ESP32 系列 ROM 附带 4 字节状态，桩程序只有 2 字节；SYNC 应答只含状态，
+    // 据此确定后续应答的状态长度
+    // ESP32-family ROMs append 4 status bytes, the stub only 2. A SYNC reply
+    // carries nothing but the status, so it tells the length for the rest
+    if (last_op_ == SYNC) {
+      status_len_ = len >= 4 ? 4 : 2;
+    }
+    resp_status_ = len >= status_len_ ? resp_data_[len - status_len_] : 1;
+    resp_len_ = len >= status_len_ ? len - status_len_ : 0;
+    response_ready_ = true;
+  }
+
+  void OnCommandDone(uint32_t now_ms) {
+    if (resp_status_ != 0) {
+      Fail(ErrorCode::FAILED);
+      return;
+    }
+    retry_ = 0;
+
+    switch (status_.state) {
+      case State::SYNC:
+        if (config_.baudrate != 0) {
+          status_.state = State::CHANGE_BAUD;
+          SendWords(CHANGE_BAUDRATE, {config_.baudrate, 0}, now_ms,
+                    CMD_TIMEOUT_MS);
+        } else {
+          status_.state = State::ATTACH;
+          SendWords(SPI_ATTACH, {0, 0}, now_ms, CMD_TIMEOUT_MS);
+        }
+        break;
+      case State::CHANGE_BAUD: {
+        LibXR::UART::Configuration config = {
+            config_.baudrate, LibXR::UART::Parity::NO_PARITY, 8, 1};
+        uart_->SetConfig(config);
+        status_.state = State::ATTACH;
+        SendWords(SPI_ATTACH, {0, 0}, now_ms, CMD_TIMEOUT_MS);
+        break;
+      }
+      case State::ATTACH: {
+        status_.state = State::BEGIN;
+        uint32_t blocks = (config_.compressed_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        uint32_t timeout = LibXR::max<uint32_t>(
+            CMD_TIMEOUT_MS, config_.size / 1024 * ERASE_TIMEOUT_MS_PER_KB);
+        if (config_.flags & FLAG_ENCRYPTED_BEGIN) {
+          SendWords(FLASH_DEFL_BEGIN,
+                    {config_.size, blocks, BLOCK_SIZE, config_.offset, 0},
+                    now_ms, timeout);
+        } else {
+          SendWords(FLASH_DEFL_BEGIN,
+                    {config_.size, blocks, BLOCK_SIZE, config_.offset}, now_ms,
+                    timeout);
+        }
+        break;
+      }
+      case State::BEGIN:
+        // 擦除期间不算主机断供 / The erase does not count as a host stall
+        status_.state = State::DATA;
+        stall_size_ = image_.Size();
+        stall_since_ms_ = now_ms;
+        SendNextBlock(now_ms);
+        break;
+      case State::DATA:
+        seq_++;
+        status_.written += block_len_;
+        progress_ = true;
+        if (status_.written >= config_.compressed_size) {
+          status_.state = State::END;
+          // 先不重启，等待 MD5 校验 / Stay in the loader for MD5
+          SendWords(FLASH_DEFL_END, {1}, now_ms, CMD_TIMEOUT_MS);
+        } else {
+          SendNextBlock(now_ms);
+        }
+        break;
+      case State::END:
+        status_.state = State::VERIFY;
+        SendWords(SPI_FLASH_MD5, {config_.offset, config_.size, 0, 0}, now_ms,
+                  LibXR::max<uint32_t>(CMD_TIMEOUT_MS,
+                                       config_.size / 1024 *
+                                           MD5_TIMEOUT_MS_PER_KB));
+        break;
+      case State::VERIFY:
+        if (!CheckMd5()) {
+          Fail(ErrorCode::CHECK_ERR);
+          break;
+        }
+        status_.state = State::DONE;
+        progress_ = true;
+        if (config_.flags & FLAG_REBOOT) {
+          SendWords(FLASH_DEFL_END, {0}, now_ms, CMD_TIMEOUT_MS);
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  /**
+   * @brief ROM 返回 32 字节十六进制字符，桩程序返回 16 字节原始值 /
+   *        The ROM returns 32 hex characters, the stub 16 raw bytes
+   */
+  bool CheckMd5() const {
+    if (resp_len_ >= 32) {
+      static constexpr char HEX[] = "0123456789abcdef";
+      for (size_t i = 0; i < 16; i++) {
+        if (resp_data_[i * 2] != HEX[config_.md5[i] >> 4] ||
+            resp_data_[i * 2 + 1] != HEX[config_.md5[i] & 0x0f]) {
+          return false;
+        }
+      }
+      return true;
+    }
+    return resp_len_ >= 16 && memcmp(resp_data_, config_.md5, 16) == 0;
+  }
+
+  void Fail(ErrorCode error) {
+    status_.state = State::FAILED;
+    status_.error = static_cast<int8_t>(error);
+    waiting_ = false;
+    progress_ = true;
+  }
+
+  static void PutWord(uint8_t *buf, uint32_t value) {
+    buf[0] = value & 0xff;
+    buf[1] = (value >> 8) & 0xff;
+    buf[2] = (value >> 16) & 0xff;
+    buf[3] = (value >> 24) & 0xff;
+  }
+
+  Config config_{};
+  Status status_{0, State::IDLE, 0, 0, 0};
+  LibXR::UART *uart_ = nullptr;
+  LibXR::Semaphore *write_sem_ = nullptr;
+
+  LibXR::BaseQueue image_;
+  LibXR::Mutex mutex_;
+
+  uint32_t seq_ = 0;
+  uint8_t retry_ = 0;
+  bool waiting_ = false;
+  bool response_ready_ = false;
+  bool progress_ = false;
+  uint32_t sent_ms_ = 0;
+  uint32_t timeout_ms_ = 0;
+
+  uint8_t last_op_ = 0;
+  uint8_t status_len_ = 4;
+  size_t stall_size_ = 0;
+  uint32_t stall_since_ms_ = 0;
+
+  uint8_t block_[DATA_HEADER_SIZE + BLOCK_SIZE];
+  size_t block_len_ = 0;
+  uint8_t tx_buf_[(COMMAND_HEADER_SIZE + DATA_HEADER_SIZE + BLOCK_SIZE) * 2 +
+                  2];
+  size_t tx_len_ = 0;
+
+  uint8_t rx_buf_[128];
+  size_t rx_len_ = 0;
+  bool rx_escape_ = false;
+  const uint8_t *resp_data_ = nullptr;
+  size_t resp_len_ = 0;
+  uint8_t resp_status_ = 0;
+};
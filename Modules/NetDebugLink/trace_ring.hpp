@@ -0,0 +1,209 @@
+#pragma once
+
+#include <atomic>
+#include <cstring>
+
+#include "libxr.hpp"
+
+/**
+ * @brief 编译期开关，置 0 时所有跟踪调用编译为空 /
+ *        Compile-time switch; with 0 every trace call compiles to nothing
+ */
+#ifndef NDL_TRACE
+#define NDL_TRACE 1
+#endif
+
+#ifndef NDL_TRACE_EVENTS
+#define NDL_TRACE_EVENTS 512
+#endif
+
+/**
+ * @brief 数据通路各阶段耗时的内存环形记录 /
+ *        RAM ring of data path stage timings
+ *
+ * 每个事件在阶段结束时写入一条 [开始 us][耗时 us][阶段][端口][字节数][任务]，
+ * 写满后覆盖最旧的事件。运行期关闭时每个埋点只多一次原子读。导出前先暂停
+ * 记录，并等待已在写入的任务写完，避免读到写了一半的事件。
+ * Each event is written when its stage ends as [begin us][duration us]
+ * [stage][port][bytes][task], overwriting the oldest once full. While
+ * disabled at run time each probe costs one atomic load. A dump first pauses
+ * recording and waits for writers already inside Record, so no half-written
+ * event is read.
+ */
+class TraceRing {
+ public:
+  static constexpr bool COMPILED = NDL_TRACE != 0;
+  static constexpr size_t CAPACITY = NDL_TRACE_EVENTS;
+  static constexpr uint8_t NO_PORT = 0xff;
+
+  /**
+   * @brief 记录事件的任务 / Task that recorded the event
+   */
+  enum class Task : uint8_t {
+    SERVICE = 0,  // 定时器服务任务 / timer service task
+    TX = 1,       // 网络发送任务 / network TX task
+    RX = 2,       // 网络接收任务 / network RX task
+  };
+
+  enum class Stage : uint8_t {
+    SERVICE_TICK = 0,  // 定时器服务任务 / timer service task
+    UART_READ = 1,
+    QUEUE_PUSH = 2,    // 写入上行队列 / push to uplink queue
+    QUEUE_POP = 3,     // 从上行队列取出 / pop from uplink queue
+    PACK = 4,          // Topic::PackData
+    NET_SEND = 5,
+    NET_RECV = 6,
+    PARSE = 7,         // Topic::Server::ParseData
+    NET_WRITE_CB = 8,  // 下行 Topic 回调 / downlink topic callback
+    UART_WRITE = 9,
+    CIPHER = 10,
+  };
+
+#pragma pack(push, 1)
+  struct Event {
+    uint32_t begin_us;
+    uint32_t duration_us;
+    uint8_t stage;
+    uint8_t port;
+    uint16_t bytes;
+    uint8_t task;
+  };
+#pragma pack(pop)
+
+  bool Enabled() const {
+    return COMPILED && enabled_.load(std::memory_order_relaxed);
+  }
+
+  void SetEnabled(bool enable) {
+    if constexpr (COMPILED) {
+      enabled_.store(enable, std::memory_order_relaxed);
+    }
+  }
+
+  void Record(Task task, Stage stage, uint8_t port, size_t bytes,
+              uint32_t begin_us, uint32_t end_us) {
+    // 先登记再检查开关，BeginDump 关闭开关后据此等待 / Register before
+    // checking the switch; BeginDump waits on this after turning it off
+    writers_.fetch_add(1);
+    if (enabled_.load()) {
+      uint32_t index = head_.fetch_add(1, std::memory_order_relaxed);
+      events_[index % CAPACITY] = {
+          begin_us, end_us - begin_us, static_cast<uint8_t>(stage), port,
+          static_cast<uint16_t>(bytes > UINT16_MAX ? UINT16_MAX : bytes),
+          static_cast<uint8_t>(task)};
+    }
+    writers_.fetch_sub(1, std::memory_order_release);
+  }
+
+  /**
+   * @brief 暂停记录并从最旧的事件开始导出 /
+   *        Pause recording and start a dump from the oldest event
+   *
+   * 写者可能在开关关闭前已通过检查，这里等它们写完再读取环。
+   * A writer may have passed the check before the switch went off, so wait
+   * for it to finish before reading the ring.
+   *
+   * @return 待导出事件数 / Number of events to dump
+   */
+  uint32_t BeginDump() {
+    if constexpr (!COMPILED) {
+      return 0;
+    }
+    resume_ = enabled_.exchange(false);
+    while (writers_.load(std::memory_order_acquire) != 0) {
+      LibXR::Thread::Sleep(1);
+    }
+    uint32_t head = head_.load();
+    dump_cursor_ = head > CAPACITY ? head - CAPACITY : 0;
+    dump_end_ = head;
+    dumping_ = dump_end_ > dump_cursor_;
+    if (!dumping_) {
+      enabled_ = resume_;
+    }
+    return dump_end_ - dump_cursor_;
+  }
+
+  bool Dumping() const { return dumping_; }
+
+  /**
+   * @brief 记录开始以来被覆盖的事件数 / Events overwritten since start
+   */
+  uint32_t Lost() const {
+    uint32_t head = head_.load();
+    return head > CAPACITY ? head - CAPACITY : 0;
+  }
+
+  /**
+   * @brief 复制下一批事件，导出完成后恢复记录 /
+   *        Copy the next run of events, resuming recording when done
+   * @return 写入的事件数 / Events written
+   */
+  size_t ReadDump(Event *out, size_t max) {
+    size_t n = 0;
+    while (dumping_ && n < max && dump_cursor_ < dump_end_) {
+      out[n++] = events_[dump_cursor_++ % CAPACITY];
+    }
+    if (dumping_ && dump_cursor_ >= dump_end_) {
+      dumping_ = false;
+      head_ = 0;
+      enabled_ = resume_;
+    }
+    return n;
+  }
+
+ private:
+  std::atomic<bool> enabled_{false};
+  std::atomic<uint32_t> head_{0};
+  std::atomic<uint32_t> writers_{0};
+  bool dumping_ = false;
+  bool resume_ = false;
+  uint32_t dump_cursor_ = 0;
+  uint32_t dump_end_ = 0;
+  Event events_[COMPILED ? CAPACITY : 1];
+};
+
+/**
+ * @brief 作用域埋点，析构时记录一个事件 /
+ *        Scoped probe that records one event on destruction
+ *
+ * Finish 可在析构前补充端口和字节数，Cancel 丢弃本次事件（如非阻塞读无数据）。
+ * Finish fills in port and bytes before destruction; Cancel discards the
+ * event, e.g. for a nonblocking read that returned nothing.
+ */
+class TraceScope {
+ public:
+  TraceScope(TraceRing &ring, TraceRing::Task task, TraceRing::Stage stage,
+             uint8_t port = TraceRing::NO_PORT, size_t bytes = 0)
+      : ring_(ring), task_(task), stage_(stage), port_(port), bytes_(bytes) {
+    active_ = ring.Enabled();
+    if (active_) {
+      begin_us_ = static_cast<uint32_t>(LibXR::Timebase::GetMicroseconds());
+    }
+  }
+
+  ~TraceScope() {
+    if (active_) {
+      ring_.Record(task_, stage_, port_, bytes_, begin_us_,
+                   static_cast<uint32_t>(LibXR::Timebase::GetMicroseconds()));
+    }
+  }
+
+  TraceScope(const TraceScope &) = delete;
+  TraceScope &operator=(const TraceScope &) = delete;
+
+  void Finish(uint8_t port, size_t bytes) {
+    port_ = port;
+    bytes_ = bytes;
+  }
+
+  void Cancel() { active_ = false; }
+
+ private:
+  TraceRing &ring_;
+  TraceRing::Task task_;
+  TraceRing::Stage stage_;
+  uint8_t port_;
+  size_t bytes_;
+  uint32_t begin_us_ = 0;
+  bool active_ = false;
+};
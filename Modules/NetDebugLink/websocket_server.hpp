@@ -0,0 +1,636 @@
+#pragma once
+
+#if defined(ESP_PLATFORM)
+#include <lwip/sockets.h>
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#endif
+
+#include <mbedtls/base64.h>
+#include <mbedtls/sha1.h>
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "libxr.hpp"
+
+/**
+ * @brief 单客户端 WebSocket 二进制端点 / Single-client WebSocket binary endpoint
+ *
+ * 路径 "/" 的每条消息是一批与 TCP 完全相同的 Topic 帧；"/port/N" 只携带端口
+ * N 的 Topic 帧，每帧一条消息。消息头单独以 MSG_MORE 发送，负载直接取自
+ * 发送缓冲区，不额外拷贝。收到的负载按流交给回调，不依赖消息边界。
+ * On "/" every message is one batch of Topic frames identical to the TCP
+ * stream; "/port/N" carries only port N's Topic frames, one per message. The
+ * message header goes out separately with MSG_MORE and the payload straight
+ * from the send buffer, with no extra copy. Received payload is handed to the
+ * callback as a stream, independent of message boundaries.
+ *
+ * 设置了令牌时握手必须带上匹配的 "?token="；Origin 只能是设备自身地址或
+ * localhost。发送从不等待：发不完的部分进入发送缓冲，缓冲放不下整条消息时
+ * 丢弃该消息。
+ * Once a token is set the handshake must carry a matching "?token="; the
+ * Origin may only be the device's own address or localhost. Sending never
+ * waits: whatever the socket does not take goes to the send buffer, and a
+ * message that does not fit there whole is dropped.
+ *
+ * Poll 与 SendMessage 可以在不同任务中调用：连接与发送缓冲由 send_mutex_
+ * 保护，只在把负载交给回调时释放，因此回调可以阻塞而不挡住发送。
+ * Poll and SendMessage may run on different tasks: the connection and the
+ * send buffer are guarded by send_mutex_, which is only released while
+ * payload is handed to the callback, so the callback may block without
+ * holding up sends.
+ */
+class WebSocketServer {
+ public:
+  static constexpr uint8_t ALL_PORTS = 0xff;
+  static constexpr size_t REQUEST_MAX = 1024;
+  static constexpr size_t TOKEN_SIZE = 16;
+  static constexpr size_t CONTROL_MAX = 125;  // RFC 6455 控制帧负载上限
+  static constexpr size_t SEND_BUFFER_SIZE = 8192;
+
+  /**
+   * @brief 协议开销统计 / Protocol overhead accounting
+   */
+  struct Stats {
+    uint32_t messages = 0;
+    uint32_t dropped_messages = 0;  // 发送缓冲已满 / send buffer full
+    uint64_t payload_bytes = 0;
+    uint64_t header_bytes = 0;
+  };
+
+  /**
+   * @brief 开始监听 / Start listening
+   */
+  ErrorCode Start(uint16_t port) {
+    listen_sock_ = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+    if (listen_sock_ < 0) {
+      return ErrorCode::INIT_ERR;
+    }
+
+    int reuse = 1;
+    setsockopt(listen_sock_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(listen_sock_, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_sock_, 1) < 0) {
+      close(listen_sock_);
+      listen_sock_ = -1;
+      return ErrorCode::INIT_ERR;
+    }
+
+    SetNonBlocking(listen_sock_);
+    return ErrorCode::OK;
+  }
+
+  /**
+   * @brief 设置握手令牌，nullptr 表示不鉴权 /
+   *        Set the handshake token, nullptr disables authentication
+   */
+  void SetToken(const uint8_t *token) {
+    LibXR::Mutex::LockGuard guard(send_mutex_);
+    has_token_ = token != nullptr;
+    if (!has_token_) {
+      return;
+    }
+    static constexpr char HEX[] = "0123456789abcdef";
+    for (size_t i = 0; i < TOKEN_SIZE; i++) {
+      token_hex_[2 * i] = HEX[token[i] >> 4];
+      token_hex_[2 * i + 1] = HEX[token[i] & 0x0f];
+    }
+    token_hex_[2 * TOKEN_SIZE] = '\0';
+  }
+
+  bool Listening() const { return listen_sock_ >= 0; }
+
+  bool Streaming() const { return client_sock_ >= 0 && upgraded_; }
+
+  uint8_t PortFilter() const { return port_filter_; }
+
+  /**
+   * @brief 接受连接、完成握手并接收数据 /
+   *        Accept, complete the handshake and receive data
+   * @return 本次收到的负载字节数 / Payload bytes received by this call
+   */
+  template <typename OnData>
+  size_t Poll(OnData &&on_data) {
+    LibXR::Mutex::LockGuard guard(send_mutex_);
+    if (listen_sock_ < 0) {
+      return 0;
+    }
+
+    if (client_sock_ < 0) {
+      int sock = accept(listen_sock_, nullptr, nullptr);
+      if (sock < 0) {
+        return 0;
+      }
+      client_sock_ = sock;
+      upgraded_ = false;
+      request_len_ = 0;
+      send_len_ = 0;
+      ResetParser();
+      SetNonBlocking(client_sock_);
+      int nodelay = 1;
+      setsockopt(client_sock_, IPPROTO_TCP, TCP_NODELAY, &nodelay,
+                 sizeof(nodelay));
+    }
+
+    if (!FlushSend()) {
+      Disconnect();
+      return 0;
+    }
+
+    static uint8_t buf[1024];
+    ssize_t len = recv(client_sock_, buf, sizeof(buf), MSG_DONTWAIT);
+    if (len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+      Disconnect();
+      return 0;
+    }
+    if (len < 0) {
+      return 0;
+    }
+
+    size_t offset = 0;
+    if (!upgraded_) {
+      // 同一次读到的握手之后的字节属于第一条消息 / Bytes read along with the
+      // handshake belong to the first message
+      offset = Handshake(buf, static_cast<size_t>(len));
+      if (!upgraded_) {
+        return 0;
+      }
+    }
+
+    // 回调期间放开锁，让发送任务继续 / Let go of the lock during the
+    // callback so the sending task carries on
+    auto deliver = [&](const uint8_t *data, size_t size) {
+      send_mutex_.Unlock();
+      on_data(data, size);
+      send_mutex_.Lock();
+    };
+    return Parse(buf + offset, static_cast<size_t>(len) - offset, deliver);
+  }
+
+  /**
+   * @brief 发送一条二进制消息，不等待 / Send one binary message without
+   *        waiting
+   * @return 消息已发出或已进入发送缓冲 / Whether the message was sent or
+   *         buffered
+   */
+  bool SendMessage(const uint8_t *data, size_t len) {
+    LibXR::Mutex::LockGuard guard(send_mutex_);
+    if (!Streaming() || len == 0) {
+      return false;
+    }
+    if (!SendFrame(0x2, data, len)) {
+      return false;
+    }
+
+    stats_.messages++;
+    stats_.header_bytes += len < 126 ? 2 : 4;
+    stats_.payload_bytes += len;
+    return true;
+  }
+
+  void Close() {
+    LibXR::Mutex::LockGuard guard(send_mutex_);
+    Disconnect();
+  }
+
+  const Stats &GetStats() const { return stats_; }
+
+ private:
+  enum class ParseState : uint8_t { HEADER, PAYLOAD };
+
+  static void SetNonBlocking(int sock) {
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+  }
+
+  /**
+   * @brief 关闭客户端连接，调用方持有 send_mutex_ /
+   *        Close the client connection; the caller holds send_mutex_
+   */
+  void Disconnect() {
+    if (client_sock_ >= 0) {
+      close(client_sock_);
+      client_sock_ = -1;
+      if (upgraded_) {
+        XR_LOG_INFO("WebSocket closed: %d messages, %d dropped, %d header "
+                    "bytes",
+                    stats_.messages, stats_.dropped_messages,
+                    static_cast<int>(stats_.header_bytes));
+      }
+    }
+    upgraded_ = false;
+    send_len_ = 0;
+  }
+
+  /**
+   * @brief 发送一帧，整帧放不进发送缓冲时丢弃 / Send one frame, dropping it
+   *        when it does not fit the send buffer whole
+   *
+   * 消息不能被截断，所以只在确定剩余部分能全部缓冲时才开始发送。
+   * A message must never be cut short, so sending only starts once whatever
+   * is left over is sure to fit the buffer.
+   */
+  bool SendFrame(uint8_t opcode, const uint8_t *data, size_t len) {
+    uint8_t header[4];
+    size_t header_len = 2;
+    header[0] = 0x80 | opcode;  // FIN
+    if (len < 126) {
+      header[1] = static_cast<uint8_t>(len);
+    } else {
+      header[1] = 126;
+      header[2] = static_cast<uint8_t>(len >> 8);
+      header[3] = static_cast<uint8_t>(len);
+      header_len = 4;
+    }
+
+    if (!FlushSend()) {
+      Disconnect();
+      return false;
+    }
+    if (send_len_ + header_len + len > sizeof(send_buf_)) {
+      stats_.dropped_messages++;
+      return false;
+    }
+
+    if (!Send(header, header_len, MSG_MORE) || !Send(data, len, 0)) {
+      Disconnect();
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief 发送或追加到发送缓冲，调用方保证放得下 /
+   *        Send, or append to the send buffer; the caller makes sure it fits
+   */
+  bool Send(const uint8_t *data, size_t len, int flags) {
+    if (send_len_ == 0) {
+      ssize_t ans = send(client_sock_, data, len, flags | MSG_DONTWAIT);
+      if (ans < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          return false;
+        }
+        ans = 0;
+      }
+      data += ans;
+      len -= static_cast<size_t>(ans);
+    }
+    memcpy(send_buf_ + send_len_, data, len);
+    send_len_ += len;
+    return true;
+  }
+
+  /**
+   * @brief 尽量发出发送缓冲 / Push out as much of the send buffer as the
+   *        socket takes
+   */
+  bool FlushSend() {
+    if (send_len_ == 0) {
+      return true;
+    }
+    ssize_t ans = send(client_sock_, send_buf_, send_len_, MSG_DONTWAIT);
+    if (ans < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    send_len_ -= static_cast<size_t>(ans);
+    memmove(send_buf_, send_buf_ + ans, send_len_);
+    return true;
+  }
+
+  /**
+   * @brief 累积请求并完成握手 / Accumulate the request and complete the
+   *        handshake
+   * @return 本段数据中属于请求的字节数，其余是第一批帧 /
+   *         Bytes of this chunk that belong to the request; the rest are the
+   *         first frames
+   */
+  size_t Handshake(const uint8_t *data, size_t len) {
+    size_t prev_len = request_len_;
+    size_t copy = LibXR::min(len, REQUEST_MAX - request_len_);
+    memcpy(request_ + request_len_, data, copy);
+    request_len_ += copy;
+    request_[request_len_] = '\0';
+
+    char *end = strstr(request_, "\r\n\r\n");
+    if (end == nullptr) {
+      if (request_len_ >= REQUEST_MAX) {
+        Disconnect();
+      }
+      return len;
+    }
+    size_t request_end = static_cast<size_t>(end - request_) + 4;
+    // 之后的帧字节不参与头部解析 / Keep frame bytes out of header parsing
+    end[2] = '\0';
+
+    char key[64] = {};
+    char token[2 * TOKEN_SIZE + 1] = {};
+    if (strncmp(request_, "GET ", 4) != 0 ||
+        !ParseTarget(request_ + 4, token, sizeof(token)) ||
+        !FindHeader("sec-websocket-key:", key, sizeof(key))) {
+      Reject("404 Not Found");
+      return len;
+    }
+    if ((has_token_ && !TokenMatches(token)) || !OriginAllowed()) {
+      XR_LOG_WARN("WebSocket handshake rejected");
+      Reject("403 Forbidden");
+      return len;
+    }
+
+    static constexpr char GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    char concat[sizeof(key) + sizeof(GUID)];
+    snprintf(concat, sizeof(concat), "%s%s", key, GUID);
+    uint8_t digest[20];
+    mbedtls_sha1(reinterpret_cast<const uint8_t *>(concat), strlen(concat),
+                 digest);
+    uint8_t accept[32];
+    size_t accept_len = 0;
+    mbedtls_base64_encode(accept, sizeof(accept) - 1, &accept_len, digest,
+                          sizeof(digest));
+    accept[accept_len] = '\0';
+
+    char response[160];
+    int response_len =
+        snprintf(response, sizeof(response),
+                 "HTTP/1.1 101 Switching Protocols\r\n"
+                 "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+                 "Sec-WebSocket-Accept: %s\r\n\r\n",
+                 accept);
+    if (!Send(reinterpret_cast<uint8_t *>(response),
+              static_cast<size_t>(response_len), 0)) {
+      Disconnect();
+      return len;
+    }
+
+    upgraded_ = true;
+    stats_ = {};
+    XR_LOG_INFO("WebSocket attached, port filter 0x%02x", port_filter_);
+    return request_end - prev_len;
+  }
+
+  void Reject(const char *status) {
+    char response[80];
+    int response_len =
+        snprintf(response, sizeof(response),
+                 "HTTP/1.1 %s\r\nContent-Length: 0\r\n\r\n", status);
+    send(client_sock_, response, static_cast<size_t>(response_len),
+         MSG_DONTWAIT);
+    Disconnect();
+  }
+
+  /**
+   * @brief 解析 "/" 或 "/port/N"，可带 "?token=" / Parse "/" or "/port/N",
+   *        optionally followed by "?token="
+   */
+  bool ParseTarget(const char *target, char *token, size_t size) {
+    const char *query = target + strcspn(target, "? ");
+    if (query - target == 1 && target[0] == '/') {
+      port_filter_ = ALL_PORTS;
+    } else if (strncmp(target, "/port/", 6) == 0 && isdigit(target[6])) {
+      char *digits_end = nullptr;
+      port_filter_ =
+          static_cast<uint8_t>(strtoul(target + 6, &digits_end, 10));
+      if (digits_end != query || port_filter_ == ALL_PORTS) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+
+    if (*query != '?') {
+      return true;
+    }
+    for (const char *param = query + 1; *param != ' ' && *param != '\0';) {
+      size_t param_len = strcspn(param, "& ");
+      if (strncmp(param, "token=", 6) == 0 && param_len - 6 < size) {
+        memcpy(token, param + 6, param_len - 6);
+        token[param_len - 6] = '\0';
+      }
+      param += param_len;
+      if (*param == '&') {
+        param++;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * @brief 常数时间比较令牌 / Compare the token in constant time
+   */
+  bool TokenMatches(const char *token) const {
+    if (!has_token_ || strlen(token) != 2 * TOKEN_SIZE) {
+      return false;
+    }
+    uint8_t diff = 0;
+    for (size_t i = 0; i < 2 * TOKEN_SIZE; i++) {
+      diff |= static_cast<uint8_t>(tolower(token[i])) ^ token_hex_[i];
+    }
+    return diff == 0;
+  }
+
+  /**
+   * @brief 没有 Origin（非浏览器客户端），或其主机名为 Host 头的主机名或
+   *        localhost / No Origin (not a browser), or its host name is the
+   *        Host header's or localhost
+   */
+  bool OriginAllowed() {
+    char origin[128] = {};
+    if (!FindHeader("origin:", origin, sizeof(origin))) {
+      return true;
+    }
+    const char *scheme_end = strstr(origin, "://");
+    if (scheme_end == nullptr) {
+      return false;
+    }
+    const char *origin_host = scheme_end + 3;
+    size_t origin_host_len = strcspn(origin_host, ":/");
+
+    if (HostIs(origin_host, origin_host_len, "localhost") ||
+        HostIs(origin_host, origin_host_len, "127.0.0.1")) {
+      return true;
+    }
+    char host[128] = {};
+    if (!FindHeader("host:", host, sizeof(host))) {
+      return false;
+    }
+    host[strcspn(host, ":")] = '\0';
+    return HostIs(origin_host, origin_host_len, host);
+  }
+
+  static bool HostIs(const char *host, size_t len, const char *name) {
+    if (strlen(name) != len) {
+      return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+      if (tolower(host[i]) != tolower(name[i])) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool FindHeader(const char *name, char *value, size_t size) {
+    size_t name_len = strlen(name);
+    for (const char *line = request_; line != nullptr;
+         line = strstr(line, "\r\n")) {
+      while (*line == '\r' || *line == '\n') {
+        line++;
+      }
+      size_t i = 0;
+      while (i < name_len && tolower(line[i]) == name[i]) {
+        i++;
+      }
+      if (i != name_len) {
+        continue;
+      }
+      line += name_len;
+      while (*line == ' ') {
+        line++;
+      }
+      size_t len = strcspn(line, "\r\n");
+      if (len == 0 || len >= size) {
+        return false;
+      }
+      memcpy(value, line, len);
+      value[len] = '\0';
+      return true;
+    }
+    return false;
+  }
+
+  void ResetParser() {
+    parse_state_ = ParseState::HEADER;
+    header_len_ = 0;
+  }
+
+  /**
+   * @brief 解析客户端帧，负载去掩码后交给回调 /
+   *        Parse client frames and hand unmasked payload to the callback
+   *
+   * ping 以相同负载回复 pong，close 回送状态码后关闭连接。
+   * A ping is answered with a pong carrying the same payload; a close is
+   * echoed with its status code before the connection is closed.
+   */
+  template <typename OnData>
+  size_t Parse(uint8_t *data, size_t len, OnData &on_data) {
+    size_t delivered = 0;
+    while (len > 0 && client_sock_ >= 0) {
+      if (parse_state_ == ParseState::HEADER) {
+        header_[header_len_++] = *data++;
+        len--;
+        if (!HeaderComplete()) {
+          continue;
+        }
+        opcode_ = header_[0] & 0x0f;
+        if ((opcode_ & 0x8) && payload_left_ > CONTROL_MAX) {
+          Disconnect();
+          return delivered;
+        }
+        parse_state_ = ParseState::PAYLOAD;
+        mask_index_ = 0;
+        control_len_ = 0;
+        if (payload_left_ == 0) {
+          EndFrame();
+        }
+        continue;
+      }
+
+      size_t chunk = static_cast<size_t>(
+          LibXR::min<uint64_t>(payload_left_, static_cast<uint64_t>(len)));
+      for (size_t i = 0; i < chunk; i++) {
+        data[i] ^= mask_[mask_index_++ & 3];
+      }
+      if (opcode_ & 0x8) {
+        memcpy(control_ + control_len_, data, chunk);
+        control_len_ += chunk;
+      } else {
+        on_data(data, chunk);
+        delivered += chunk;
+      }
+      data += chunk;
+      len -= chunk;
+      payload_left_ -= chunk;
+      if (payload_left_ == 0) {
+        EndFrame();
+      }
+    }
+    return delivered;
+  }
+
+  /**
+   * @brief 一帧结束，应答控制帧 / End of a frame, answer control frames
+   */
+  void EndFrame() {
+    ResetParser();
+    if (opcode_ == 0x9) {
+      SendFrame(0xa, control_, control_len_);
+    } else if (opcode_ == 0x8) {
+      SendFrame(0x8, control_, LibXR::min<size_t>(control_len_, 2));
+      FlushSend();
+      Disconnect();
+    }
+  }
+
+  bool HeaderComplete() {
+    if (header_len_ < 2) {
+      return false;
+    }
+    uint8_t len7 = header_[1] & 0x7f;
+    size_t ext = len7 == 126 ? 2 : (len7 == 127 ? 8 : 0);
+    size_t mask = (header_[1] & 0x80) ? 4 : 0;
+    if (header_len_ < 2 + ext + mask) {
+      return false;
+    }
+
+    payload_left_ = len7;
+    if (ext > 0) {
+      payload_left_ = 0;
+      for (size_t i = 0; i < ext; i++) {
+        payload_left_ = (payload_left_ << 8) | header_[2 + i];
+      }
+    }
+    if (mask > 0) {
+      memcpy(mask_, header_ + 2 + ext, 4);
+    } else {
+      memset(mask_, 0, sizeof(mask_));
+    }
+    return true;
+  }
+
+  int listen_sock_ = -1;
+  int client_sock_ = -1;
+  bool upgraded_ = false;
+  uint8_t port_filter_ = ALL_PORTS;
+  char request_[REQUEST_MAX + 1];
+  size_t request_len_ = 0;
+  bool has_token_ = false;
+  char token_hex_[2 * TOKEN_SIZE + 1];
+  LibXR::Mutex send_mutex_;
+  uint8_t send_buf_[SEND_BUFFER_SIZE];
+  size_t send_len_ = 0;
+
+  ParseState parse_state_ = ParseState::HEADER;
+  uint8_t header_[14];
+  size_t header_len_ = 0;
+  uint8_t mask_[4];
+  size_t mask_index_ = 0;
+  uint64_t payload_left_ = 0;
+  uint8_t opcode_ = 0;
+  uint8_t control_[CONTROL_MAX];
+  size_t control_len_ = 0;
+
+  Stats stats_;
+};
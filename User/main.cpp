@@ -27,9 +27,19 @@ extern "C" void app_main(void) {
 
   LibXR::ESP32VirtualUART<2048> uart_cdc(20, 4, 2048, 4, 2048);
 
-  LibXR::ESP32UART uart_1(UART_NUM_0, 3, 4, 256, 2048, 4);
-
-  LibXR::ESP32UART uart_2(UART_NUM_1, 5, 6, 256, 2048, 4);
+  // 驱动缓冲按 3 Mbaud 设计：8 KB 约 27 ms 线速数据，足以跨过
+  // 服务定时器退避与一次 WiFi 发送抖动
+  // Driver buffers sized for 3 Mbaud: 8 KB is about 27 ms at line rate,
+  // enough to ride out service timer backoff and one WiFi send hiccup
+  //
+  // 驱动缓冲在构造时分配一次，之后 CONFIG_UART 改波特率不会重新分配；只有
+  // 网络侧队列（RebalanceBuffers）随波特率调整。高于 3 Mbaud 时需在此加大。
+  // Driver buffers are allocated once here and not resized when CONFIG_UART
+  // changes the baud rate; only the network side queues (RebalanceBuffers)
+  // follow it. Raise them here for rates above 3 Mbaud.
+  LibXR::ESP32UART uart_1(UART_NUM_0, 3, 4, 1024, 8192, 4);
+
+  LibXR::ESP32UART uart_2(UART_NUM_1, 5, 6, 1024, 8192, 4);
 
   LibXR::STDIO::write_ = uart_cdc.write_port_;
   LibXR::STDIO::read_ = uart_cdc.read_port_;
@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+"""Convert NetDebugLink tap records into a pcapng capture.
+
+Input is the concatenated payloads of the device's ``tap`` topic, i.e. a run
+of records:
+
+    [timestamp_us u64][len u16][port u8][direction u8][data]  (LE)
+
+direction 0 is target to device (inbound), 1 is device to target (outbound).
+Each port becomes its own interface and direction is kept in epb_flags, so
+Wireshark-style tools can filter and seek both sides of a conversation.
+
+Pass ``-`` as input to convert a live stream from stdin; blocks are written
+and flushed as records arrive, so the output is append-only and readable
+while the session is still running. ``ndl_demux.py`` pulls the tap payloads
+out of a raw session in either framing, decrypting it if needed::
+
+    nc -l 5000 | ndl_demux.py - --topic tap | capture_to_pcapng.py - s.pcapng
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+TAP_HEADER = struct.Struct("<QHBB")
+LINKTYPE_USER0 = 147
+
+SHB_TYPE = 0x0A0D0D0A
+IDB_TYPE = 0x00000001
+EPB_TYPE = 0x00000006
+BYTE_ORDER_MAGIC = 0x1A2B3C4D
+
+OPT_END = 0
+IF_NAME = 2
+IF_TSRESOL = 9
+EPB_FLAGS = 2
+EPB_INBOUND = 1
+EPB_OUTBOUND = 2
+
+
+def pad4(data):
+    return data + b"\0" * (-len(data) % 4)
+
+
+def option(code, value):
+    return struct.pack("<HH", code, len(value)) + pad4(value)
+
+
+def block(block_type, body):
+    length = 12 + len(body)
+    return (struct.pack("<II", block_type, length) + body +
+            struct.pack("<I", length))
+
+
+class PcapngWriter:
+    def __init__(self, out, offset_us):
+        self.out = out
+        self.offset_us = offset_us
+        self.interfaces = {}
+        body = struct.pack("<IHHq", BYTE_ORDER_MAGIC, 1, 0, -1)
+        self.out.write(block(SHB_TYPE, body))
+
+    def interface(self, port):
+        if port not in self.interfaces:
+            options = (option(IF_NAME, f"port {port}".encode()) +
+                       option(IF_TSRESOL, bytes([6])) + option(OPT_END, b""))
+            body = struct.pack("<HHI", LINKTYPE_USER0, 0, 0) + options
+            self.out.write(block(IDB_TYPE, body))
+            self.interfaces[port] = len(self.interfaces)
+        return self.interfaces[port]
+
+    def packet(self, timestamp_us, port, direction, data):
+        interface = self.interface(port)
+        ts = timestamp_us + self.offset_us
+        flags = EPB_OUTBOUND if direction else EPB_INBOUND
+        body = (struct.pack("<IIIII", interface, ts >> 32, ts & 0xFFFFFFFF,
+                            len(data), len(data)) + pad4(data) +
+                option(EPB_FLAGS, struct.pack("<I", flags)) +
+                option(OPT_END, b""))
+        self.out.write(block(EPB_TYPE, body))
+
+
+def records(stream):
+    pending = b""
+    while True:
+        chunk = stream.read1(65536) if hasattr(stream, "read1") else \
+            stream.read(65536)
+        if not chunk:
+            break
+        pending += chunk
+        offset = 0
+        while len(pending) - offset >= TAP_HEADER.size:
+            timestamp_us, size, port, direction = TAP_HEADER.unpack_from(
+                pending, offset)
+            end = offset + TAP_HEADER.size + size
+            if end > len(pending):
+                break
+            yield timestamp_us, port, direction, pending[offset +
+                                                         TAP_HEADER.size:end]
+            offset = end
+        pending = pending[offset:]
+    if pending:
+        print(f"ignoring {len(pending)} trailing bytes", file=sys.stderr)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("input", help="tap topic payloads, or - for stdin")
+    parser.add_argument("output", help="pcapng file to write")
+    parser.add_argument("--device-time", action="store_true",
+                        help="keep device uptime timestamps instead of "
+                        "anchoring the first record to the wall clock")
+    args = parser.parse_args()
+
+    source = sys.stdin.buffer if args.input == "-" else open(args.input, "rb")
+    count = 0
+    with source, open(args.output, "wb") as out:
+        writer = None
+        for timestamp_us, port, direction, data in records(source):
+            if writer is None:
+                offset_us = 0 if args.device_time else \
+                    int(time.time() * 1e6) - timestamp_us
+                writer = PcapngWriter(out, offset_us)
+            writer.packet(timestamp_us, port, direction, data)
+            count += 1
+            if args.input == "-":
+                out.flush()
+    print(f"{count} records", file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
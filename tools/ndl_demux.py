@@ -0,0 +1,248 @@
+#!/usr/bin/env python3
+"""Extract one topic's payloads from a raw NetDebugLink uplink stream.
+
+Input is the device's uplink as it came off the TCP link or CDC, e.g. saved
+with ``nc -l 5000 > session.bin``. Both framings are understood:
+
+* v1: Topic frames ``[0xA5][key u32][len u24][crc8][data][crc8]``;
+* v2: super-frames ``[0xA6][body len u16][entries...][crc16]`` with entries
+  ``[port u8][LEB128 len][data]``. Port entries 0xFC and up (tap, trace,
+  capture, control) hold whole Topic frames and are unpacked the same way.
+
+A TCP session with the data plane cipher starts with the device's 16 byte
+session nonce and then carries ``[len u16][ciphertext][tag]`` records; pass the
+long-term key and the nonce the host answered with to decrypt it first (needs
+the ``cryptography`` package).
+
+Payloads of the chosen topic are written back to back, which is the input
+``trace_to_chrome.py`` and ``capture_to_pcapng.py`` expect::
+
+    ndl_demux.py session.bin --topic trace -o dump.bin
+    ndl_demux.py - --topic tap | capture_to_pcapng.py - session.pcapng
+
+Pass ``-`` as input to follow a live stream from stdin; output is flushed as
+frames arrive. Checksums are not verified: the link below is already reliable,
+and the Topic CRCs are LibXR's own.
+"""
+
+import argparse
+import hashlib
+import hmac
+import sys
+import zlib
+
+TOPIC_PREFIX = 0xA5
+TOPIC_HEADER = 9  # prefix, name crc32, len u24, header crc8
+TOPIC_OVERHEAD = TOPIC_HEADER + 1
+
+V2_MAGIC = 0xA6
+V2_HEADER = 3
+V2_TRAILER = 2
+SEGMENT_TOPIC_MIN = 0xFC  # 此后的条目内是 Topic 帧 / entries holding frames
+
+KEY_SIZE = 16
+SESSION_NONCE_SIZE = 16
+CIPHER_HEADER = 2
+CIPHER_TAG = 16
+DEVICE_TO_HOST = 0
+
+
+def topic_key(name):
+    """LibXR's CRC32 of the topic name; it skips zlib's final XOR."""
+    return zlib.crc32(name.encode()) ^ 0xFFFFFFFF
+
+
+def session_key(key, device_nonce, host_nonce):
+    """HKDF-SHA256 as in DataCipher::DeriveSessionKey, first 16 bytes."""
+    prk = hmac.new(device_nonce + host_nonce, key, hashlib.sha256).digest()
+    okm = hmac.new(prk, b"NetDebugLink session\x01", hashlib.sha256).digest()
+    return okm[:KEY_SIZE]
+
+
+class Decryptor:
+    """Open the device-to-host records of an encrypted TCP session."""
+
+    def __init__(self, key, host_nonce):
+        try:
+            from cryptography.hazmat.primitives.ciphers.aead import AESGCM
+        except ImportError:
+            sys.exit("decryption needs the 'cryptography' package")
+        self.aesgcm = AESGCM
+        self.key = key
+        self.host_nonce = host_nonce
+        self.aead = None
+        self.counter = 0
+        self.pending = b""
+
+    def feed(self, chunk):
+        self.pending += chunk
+        if self.aead is None:
+            if len(self.pending) < SESSION_NONCE_SIZE:
+                return
+            device_nonce = self.pending[:SESSION_NONCE_SIZE]
+            self.pending = self.pending[SESSION_NONCE_SIZE:]
+            self.aead = self.aesgcm(
+                session_key(self.key, device_nonce, self.host_nonce))
+
+        while len(self.pending) >= CIPHER_HEADER:
+            size = int.from_bytes(self.pending[:CIPHER_HEADER], "little")
+            end = CIPHER_HEADER + size + CIPHER_TAG
+            if len(self.pending) < end:
+                break
+            nonce = (bytes([DEVICE_TO_HOST, 0, 0, 0]) +
+                     self.counter.to_bytes(8, "little"))
+            self.counter += 1
+            # 认证失败时异常退出 / Fails loudly on an authentication error
+            yield self.aead.decrypt(nonce, self.pending[CIPHER_HEADER:end],
+                                    self.pending[:CIPHER_HEADER])
+            self.pending = self.pending[end:]
+
+
+def read_key(path):
+    """A key file holds the 16 raw bytes or 32 hex digits."""
+    with open(path, "rb") as f:
+        data = f.read()
+    if len(data) != KEY_SIZE:
+        data = bytes.fromhex(data.decode().strip())
+    if len(data) != KEY_SIZE:
+        sys.exit(f"{path}: expected a {KEY_SIZE} byte key")
+    return data
+
+
+class Demux:
+    """Split an uplink stream into ("topic", key, data) and ("port", n, data).
+
+    Bytes that start neither frame type are skipped and counted in
+    ``skipped``, so a recording that starts mid-frame resynchronizes.
+    """
+
+    def __init__(self):
+        self.pending = b""
+        self.skipped = 0
+
+    def feed(self, chunk):
+        self.pending += chunk
+        offset = 0
+        while offset < len(self.pending):
+            first = self.pending[offset]
+            if first == TOPIC_PREFIX:
+                used = self._topic(self.pending, offset, len(self.pending))
+            elif first == V2_MAGIC:
+                used = self._super_frame(offset)
+            else:
+                self.skipped += 1
+                offset += 1
+                continue
+            if used is None:
+                break
+            items, size = used
+            yield from items
+            offset += size
+        self.pending = self.pending[offset:]
+
+    @staticmethod
+    def _topic(buf, offset, end):
+        if end - offset < TOPIC_OVERHEAD:
+            return None
+        size = int.from_bytes(buf[offset + 5:offset + 8], "little")
+        frame_end = offset + TOPIC_OVERHEAD + size
+        if frame_end > end:
+            return None
+        key = int.from_bytes(buf[offset + 1:offset + 5], "little")
+        data = buf[offset + TOPIC_HEADER:frame_end - 1]
+        return [("topic", key, data)], TOPIC_OVERHEAD + size
+
+    def _super_frame(self, offset):
+        buf = self.pending
+        if len(buf) - offset < V2_HEADER:
+            return None
+        body = int.from_bytes(buf[offset + 1:offset + 3], "little")
+        total = V2_HEADER + body + V2_TRAILER
+        if len(buf) - offset < total:
+            return None
+
+        items = []
+        pos = offset + V2_HEADER
+        end = pos + body
+        while pos < end:
+            port = buf[pos]
+            pos += 1
+            size = 0
+            shift = 0
+            while pos < end:
+                byte = buf[pos]
+                pos += 1
+                size |= (byte & 0x7F) << shift
+                shift += 7
+                if not byte & 0x80:
+                    break
+            entry_end = min(pos + size, end)
+            if port >= SEGMENT_TOPIC_MIN:
+                while pos < entry_end:
+                    used = self._topic(buf, pos, entry_end)
+                    if used is None:
+                        break
+                    items += used[0]
+                    pos += used[1]
+            else:
+                items.append(("port", port, buf[pos:entry_end]))
+            pos = entry_end
+        return items, total
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("input", help="raw uplink stream, or - for stdin")
+    parser.add_argument("--topic", required=True,
+                        help="topic name, e.g. trace, tap or uart1")
+    parser.add_argument("--port", type=int,
+                        help="also take v2 entries of this port index, "
+                        "e.g. 1 together with --topic uart1")
+    parser.add_argument("-o", "--output", default="-",
+                        help="output file (default: stdout)")
+    parser.add_argument("--key-file",
+                        help="data plane key, to decrypt a cipher session")
+    parser.add_argument("--host-nonce",
+                        help="the host's session nonce, 32 hex digits")
+    args = parser.parse_args()
+
+    decryptor = None
+    if args.key_file:
+        if not args.host_nonce:
+            parser.error("--key-file needs --host-nonce")
+        decryptor = Decryptor(read_key(args.key_file),
+                              bytes.fromhex(args.host_nonce))
+
+    key = topic_key(args.topic)
+    live = args.input == "-"
+    source = sys.stdin.buffer if live else open(args.input, "rb")
+    out = sys.stdout.buffer if args.output == "-" else open(args.output, "wb")
+    demux = Demux()
+    frames = 0
+    total = 0
+    with source:
+        while True:
+            chunk = source.read1(65536) if hasattr(source, "read1") else \
+                source.read(65536)
+            if not chunk:
+                break
+            if decryptor is not None:
+                chunk = b"".join(decryptor.feed(chunk))
+            for kind, ident, data in demux.feed(chunk):
+                if (kind == "topic" and ident == key) or \
+                        (kind == "port" and ident == args.port):
+                    out.write(data)
+                    frames += 1
+                    total += len(data)
+            if live:
+                out.flush()
+    if out is not sys.stdout.buffer:
+        out.close()
+    print(f"{frames} frames, {total} bytes of {args.topic}", file=sys.stderr)
+    if demux.skipped or demux.pending:
+        print(f"skipped {demux.skipped} bytes, {len(demux.pending)} trailing",
+              file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+"""Convert a NetDebugLink trace dump into Chrome trace JSON.
+
+Input is the concatenated payloads of the device's ``trace`` topic, i.e. a run
+of 13 byte ``TraceRing::Event`` records:
+
+    [begin_us u32][duration_us u32][stage u8][port u8][bytes u16][task u8]  (LE)
+
+``tools/ndl_demux.py session.bin --topic trace`` extracts them from a raw
+session recording.
+
+Open the output in chrome://tracing or https://ui.perfetto.dev. Each device
+task gets its own track, so nested stages stack the way they ran; the port is
+kept in the event args.
+"""
+
+import argparse
+import json
+import struct
+import sys
+
+EVENT = struct.Struct("<IIBBHB")
+NO_PORT = 0xFF
+
+# 与 trace_ring.hpp 中的 TraceRing::Task 保持一致
+# Keep in sync with TraceRing::Task in trace_ring.hpp
+TASKS = ["service", "tx", "rx"]
+
+# 与 trace_ring.hpp 中的 TraceRing::Stage 保持一致
+# Keep in sync with TraceRing::Stage in trace_ring.hpp
+STAGES = [
+    "service_tick",
+    "uart_read",
+    "queue_push",
+    "queue_pop",
+    "pack",
+    "net_send",
+    "net_recv",
+    "parse",
+    "net_write_cb",
+    "uart_write",
+    "cipher",
+]
+
+
+def read_events(data):
+    usable = len(data) - len(data) % EVENT.size
+    if usable != len(data):
+        print(f"ignoring {len(data) - usable} trailing bytes", file=sys.stderr)
+    for offset in range(0, usable, EVENT.size):
+        yield EVENT.unpack_from(data, offset)
+
+
+def convert(events):
+    trace = []
+    tracks = set()
+    base = None
+    last = 0
+    wraps = 0
+    for begin, duration, stage, port, size, task in events:
+        # 设备时间戳为 32 位微秒，约 71 分钟回绕一次
+        # Device timestamps are 32 bit microseconds and wrap every ~71 minutes
+        if base is None:
+            base = begin
+        if begin < last and last - begin > 1 << 31:
+            wraps += 1
+        last = begin
+        ts = begin + (wraps << 32) - base
+
+        name = STAGES[stage] if stage < len(STAGES) else f"stage_{stage}"
+        event_args = {"bytes": size}
+        if port != NO_PORT:
+            event_args["port"] = port
+        trace.append({
+            "name": name,
+            "ph": "X",
+            "ts": ts,
+            "dur": duration,
+            "pid": 0,
+            "tid": task,
+            "args": event_args,
+        })
+        tracks.add(task)
+
+    for task in sorted(tracks):
+        trace.append({
+            "name": "thread_name",
+            "ph": "M",
+            "pid": 0,
+            "tid": task,
+            "args": {"name": TASKS[task] if task < len(TASKS)
+                     else f"task {task}"},
+        })
+    return {"traceEvents": trace}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("dump", help="binary trace topic payloads")
+    parser.add_argument("-o", "--output", default="-",
+                        help="output JSON file (default: stdout)")
+    args = parser.parse_args()
+
+    with open(args.dump, "rb") as f:
+        result = convert(read_events(f.read()))
+
+    if args.output == "-":
+        json.dump(result, sys.stdout)
+    else:
+        with open(args.output, "w") as f:
+            json.dump(result, f)
+    events = sum(1 for e in result["traceEvents"] if e["ph"] == "X")
+    print(f"{events} events", file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()